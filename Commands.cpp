@@ -1,16 +1,36 @@
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <string.h>
 #include <iostream>
 #include <vector>
 #include <time.h>
 #include <sstream>
 #include <sys/wait.h>
+#include <sys/resource.h>
+#include <dirent.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/syscall.h>
+#include <sys/epoll.h>
+#include <sys/prctl.h>
 #include <iomanip>
+#include <algorithm>
 #include "Commands.h"
+#include "trace.h"
+#include "arena.h"
+#include "ioengine.h"
+#include "head.h"
+#include "zerocopy.h"
+#include "signals.h"
+#include <limits.h>
 
 using namespace std;
 
+#ifndef P_PIDFD
+#define P_PIDFD (3) // waitid on a pidfd, Linux 5.4; not in glibc's idtype_t yet
+#endif
+
 #if 0
 #define FUNC_ENTRY()  \
   cout << __PRETTY_FUNCTION__ << " --> " << endl;
@@ -41,14 +61,23 @@ string _trim(const std::string& s)
     return _rtrim(_ltrim(s));
 }
 
-int _parseCommandLine(const char* cmd_line, char** args) {
+bool _isWhitespace(char c) {
+    return c != 0 && strchr(WHITESPACE.c_str(), c) != NULL;
+}
+
+int _parseCommandLine(const char* cmd_line, char** args, Arena* arena) {
     FUNC_ENTRY()
     int i = 0;
-    std::istringstream iss(_trim(string(cmd_line)).c_str());
-    for(std::string s; iss >> s; ) {
-        args[i] = (char*)malloc(s.length()+1);
-        memset(args[i], 0, s.length()+1);
-        strcpy(args[i], s.c_str());
+    const char* p = cmd_line;
+    while (i < COMMAND_MAX_ARGS - 1) {
+        while (_isWhitespace(*p))
+            p++;
+        if (*p == 0)
+            break;
+        const char* start = p;
+        while (*p != 0 && !_isWhitespace(*p))
+            p++;
+        args[i] = arena->copy(start, p - start);
         args[++i] = NULL;
     }
     return i;
@@ -56,106 +85,87 @@ int _parseCommandLine(const char* cmd_line, char** args) {
 }
 
 bool _isTimeCommand(const char* cmd_line){
-    char* tmp_args[COMMAND_MAX_ARGS];
-    int arr_length = _parseCommandLine(cmd_line, tmp_args);
-    std::string str(tmp_args[0]);
-    bool check = (strcmp("timeout",str.c_str()) == 0);
-    for(int i = 0; i < arr_length; i++) {
-        free(tmp_args[i]);
-    }
-    return check;
+    while (_isWhitespace(*cmd_line))
+        cmd_line++;
+    return strncmp(cmd_line, "timeout", 7) == 0 && (cmd_line[7] == 0 || _isWhitespace(cmd_line[7]));
 }
 
 int _isPipeCommand(const char* cmd_line) {
-    const string cmd_line_copy(cmd_line);
-    std::string pipe_sign1 = " | ";
-    std::string pipe_sign2 = " |& ";
-    if (cmd_line_copy.find(pipe_sign1) != std::string::npos) {
+    // a quoted `|` is text, as in jobs --format '{id} | {cmd}'
+    if (findUnquoted(cmd_line, " | ") != NULL) {
         return 1; // pipe cout
     }
-    if (cmd_line_copy.find(pipe_sign2) != std::string::npos) {
+    if (findUnquoted(cmd_line, " |& ") != NULL) {
         return 2; // pipe cerr
     }
     return 0; // no pipe
 }
 
-void _splitPipeCommands(const char* cmd_line, std::string* left, std::string* right) {
-    const string cmd_line_copy(cmd_line);
-    std::string pipe_sign1 = " | ";
-    std::string pipe_sign2 = " |& ";
+void _splitPipeCommands(const char* cmd_line, char** left, char** right, Arena* arena) {
     int pipe = _isPipeCommand(cmd_line);
     if (pipe == 1) {
-        int pipe_sign_position = cmd_line_copy.find(pipe_sign1);
-        *left = cmd_line_copy.substr(0, pipe_sign_position);
-        *right = cmd_line_copy.substr(pipe_sign_position + 2, strlen(cmd_line));
+        const char* pipe_sign_position = findUnquoted(cmd_line, " | ");
+        *left = arena->copy(cmd_line, pipe_sign_position - cmd_line);
+        *right = arena->copy(pipe_sign_position + 2);
     }
     else { // pipe==2
-        int pipe_sign_position = cmd_line_copy.find(pipe_sign2);
-        *left = cmd_line_copy.substr(0, pipe_sign_position);
-        *right = cmd_line_copy.substr(pipe_sign_position + 3, strlen(cmd_line));
+        const char* pipe_sign_position = findUnquoted(cmd_line, " |& ");
+        *left = arena->copy(cmd_line, pipe_sign_position - cmd_line);
+        *right = arena->copy(pipe_sign_position + 3);
     }
 }
 
-bool _isBackgroundComamnd(const char* cmd_line) {
-    const string str(cmd_line);
-    return str[str.find_last_not_of(WHITESPACE)] == '&';
+bool _isChainCommand(const char* cmd_line) {
+    return findUnquoted(cmd_line, " && ") != NULL || findUnquoted(cmd_line, " || ") != NULL;
 }
 
-std::string removeTimeOut(const char* cmd_line, char* arg){
-    string str(cmd_line);
-    string str_arg(arg);
-    string sub_str = str.substr(str.find("timeout")+7, str.length());
-    const string sub_str2 = sub_str.substr(sub_str.find(arg) + str_arg.length(), sub_str.length());
-    sub_str = _ltrim(sub_str2);
-    return sub_str.c_str();
+// `a && b || c`: the stages, each with the condition on the stage before it (none for the first)
+void _splitChain(const char* cmd_line, std::vector<std::string>* stages, std::vector<JobCondition>* conditions) {
+    JobCondition condition = JOB_AFTER_ANY;
+    const char* start = cmd_line;
+    while (true) {
+        const char* and_sign = findUnquoted(start, " && "); // `echo "a && b" &` is one stage
+        const char* or_sign = findUnquoted(start, " || ");
+        const char* sign = (and_sign == NULL || (or_sign != NULL && or_sign < and_sign)) ? or_sign : and_sign;
+        const char* end = (sign != NULL) ? sign : start + strlen(start);
+        while (start < end && _isWhitespace(*start))
+            start++;
+        while (end > start && _isWhitespace(*(end - 1)))
+            end--;
+        stages->push_back(std::string(start, end - start));
+        conditions->push_back(condition);
+        if (sign == NULL)
+            break;
+        condition = (sign == and_sign) ? JOB_AFTER_SUCCESS : JOB_AFTER_FAILURE;
+        start = sign + 4;
+    }
 }
 
-int checkForFile(const char* cmd_line, string* new_cmd_line , string* file_name)
-{
-    std::string cmd_line_copy(cmd_line);
-    std::string file_sign1 = " > ";
-    std::string file_sign2 = " >> ";
-    int file_sign1_position1 = cmd_line_copy.find(file_sign1);
-    int file_sign2_position2 = cmd_line_copy.find(file_sign2);
-    if(cmd_line_copy.find(file_sign1) != std::string::npos && cmd_line_copy.find(file_sign2) != std::string::npos) { // there is >> and also >
-        if(file_sign1_position1< file_sign2_position2) {
-            *new_cmd_line =  cmd_line_copy.substr(0,file_sign1_position1);
-            *file_name = _trim(cmd_line_copy.substr(file_sign1_position1+2, strlen(cmd_line)));
-            return 0;
-        }
-        else {
-            *new_cmd_line =  cmd_line_copy.substr(0,file_sign2_position2);
-            *file_name = _trim(cmd_line_copy.substr(file_sign2_position2+3, strlen(cmd_line)));
-            return 1;
-        }
-    }
-    else if (cmd_line_copy.find(file_sign1) == std::string::npos && cmd_line_copy.find(file_sign2) == std::string::npos) { // there is no >> and no >
-        std::string file_sign1_last = " >";
-        std::string file_sign2_last = " >>";
-        if(strlen(cmd_line)>3 && cmd_line_copy.find(file_sign2_last) == cmd_line_copy.length()-3) { // if the last sub-string is " >>"
-            *new_cmd_line =  cmd_line_copy.substr(0,cmd_line_copy.length()-3);
-            *file_name = _trim(cmd_line_copy.substr(cmd_line_copy.length(), cmd_line_copy.length()));
-            return 1;
-        }
-        if(strlen(cmd_line)>2 && cmd_line_copy.find(file_sign1_last) == cmd_line_copy.length()-2) { // if the last sub-string is is " >"
-            *new_cmd_line =  cmd_line_copy.substr(0,cmd_line_copy.length()-2);
-            *file_name = _trim(cmd_line_copy.substr(cmd_line_copy.length(), cmd_line_copy.length()));
-            return 0;
-        }
-        file_name = NULL;
-        return 2;
-    }
-    else if (cmd_line_copy.find(file_sign1) == std::string::npos && cmd_line_copy.find(file_sign2) != std::string::npos) // there is >> and no >
-    {
-        *new_cmd_line = cmd_line_copy.substr(0,file_sign2_position2);
-        *file_name = _trim(cmd_line_copy.substr(file_sign2_position2+3, strlen(cmd_line)));
-        return 1;
-    }
-    else { // there is > and no >>
-        *new_cmd_line =  cmd_line_copy.substr(0,file_sign1_position1);
-        *file_name = _trim(cmd_line_copy.substr(file_sign1_position1+2, strlen(cmd_line)));
-        return 0;
+bool _isBackgroundComamnd(const char* cmd_line) {
+    const char* last = NULL;
+    for (const char* p = cmd_line; *p != 0; p++) {
+        if (!_isWhitespace(*p))
+            last = p;
     }
+    return last != NULL && *last == '&';
+}
+
+char* removeTimeOut(const char* cmd_line, const char* arg, Arena* arena){
+    const char* sub_str = strstr(cmd_line, "timeout") + 7;
+    const char* arg_position = strstr(sub_str, arg);
+    sub_str = (arg_position != NULL) ? arg_position + strlen(arg) : sub_str + strlen(sub_str);
+    while (_isWhitespace(*sub_str))
+        sub_str++;
+    return arena->copy(sub_str);
+}
+
+// copy of [start, end) without the surrounding whitespace
+char* _trimmedCopy(const char* start, const char* end, Arena* arena) {
+    while (start < end && _isWhitespace(*start))
+        start++;
+    while (end > start && _isWhitespace(*(end - 1)))
+        end--;
+    return arena->copy(start, end - start);
 }
 
 char* _removeConstToCmdLine(char* cmd_line) {
@@ -163,26 +173,61 @@ char* _removeConstToCmdLine(char* cmd_line) {
 }
 
 void _removeBackgroundSign(char* cmd_line) {
-    const string str(cmd_line);
     // find last character other than spaces
-    unsigned int idx = str.find_last_not_of(WHITESPACE);
+    char* last = NULL;
+    for (char* p = cmd_line; *p != 0; p++) {
+        if (!_isWhitespace(*p))
+            last = p;
+    }
     // if all characters are spaces then return
-    if (idx == string::npos) {
+    if (last == NULL) {
         return;
     }
     // if the command line does not end with & then return
-    if (cmd_line[idx] != '&') {
+    if (*last != '&') {
         return;
     }
     // replace the & (background sign) with space and then remove all tailing spaces.
-    cmd_line[idx] = ' ';
+    *last = 0;
     // truncate the command line string up to the last non-space character
-    cmd_line[str.find_last_not_of(WHITESPACE, idx)] = 0;
+    while (last > cmd_line && _isWhitespace(*(last - 1)))
+        *(--last) = 0;
+}
+
+// The words after the command name, read from the line rather than from args: quotes are taken
+// off and a wildcard may give more than COMMAND_MAX_ARGS words.
+void _lineWords(const char* cmd_line, std::vector<const char*>* words) {
+    Arena* arena = SmallShell::getInstance().getArena();
+    char* line = arena->copy(cmd_line);
+    _removeBackgroundSign(line);
+    const char* p = line + strspn(line, WHITESPACE.c_str());
+    p += strcspn(p, WHITESPACE.c_str());
+    char* word = (char*)arena->allocate(strlen(p) + 1); // each word is at most what it was read from
+    for (;;) {
+        p += strspn(p, WHITESPACE.c_str());
+        if (*p == 0)
+            break;
+        size_t length = readShellWord(&p, word);
+        if (length == 0) { // a redirection character left in the line
+            p++;
+            continue;
+        }
+        words->push_back(word);
+        word += length + 1;
+    }
 }
 
 // <---------- START JobEntry ------------>
-JobEntry::JobEntry(int job_id, std::string cmd_line, pid_t process_id, time_t time_inserted, bool isStopped, int time_up) :
-        job_id(job_id), cmd_line(cmd_line), process_id(process_id), time_inserted(time_inserted), isStopped(isStopped),time_up(time_up) {}
+JobEntry::JobEntry(int job_id, std::string cmd_line, pid_t process_id, time_t time_inserted, bool isStopped, int time_up,
+                   int pidfd) :
+        job_id(job_id), cmd_line(cmd_line), process_id(process_id), time_inserted(time_inserted), isStopped(isStopped),time_up(time_up),
+        pidfd(pidfd) {
+    memset(&orphans, 0, sizeof(orphans));
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    // a job re-adopted from the state file only knows the second it started in
+    start_ms = (int64_t)time_inserted * 1000 + (time_inserted == now.tv_sec ? now.tv_nsec / 1000000 : 0);
+}
 JobEntry::~JobEntry() {}
 void JobEntry::printJob(Command* cmd, int IO_status) {
     if(IO_status == 2) {
@@ -196,34 +241,10 @@ void JobEntry::printJob(Command* cmd, int IO_status) {
         }
     }
     else {
-        string buff("[");
-        char* s_job_id = (char*) malloc(sizeof(this->job_id));
-        sprintf(s_job_id, "%d", this->job_id);
-        buff.append(s_job_id);
-        buff.append("] ");
-        char* s_cmd_line = (char*) malloc(sizeof(this->cmd_line));
-        sprintf(s_cmd_line, "%s", (this->cmd_line).c_str());
-        buff.append(s_cmd_line);
-        buff.append(" : ");
-        char* spid = (char*) malloc(sizeof((long)this->process_id));
-        sprintf(spid, "%ld", (long)this->process_id);
-        buff.append(spid);
-        buff.append(" ");
-        char* s_time = (char*) malloc(sizeof((long)difftime(time(NULL), this->time_inserted)));
-        sprintf(s_time, "%ld", (long)difftime(time(NULL), this->time_inserted));
-        buff.append(s_time);
-        if (this->isStopped) {
-            buff.append(" secs (stopped)");
-        }
-        else {
-            buff.append(" secs");
-        }
-        buff.append("\n");
-        cmd->ChangeIO(IO_status, buff.c_str(), strlen(buff.c_str()));
-        free(s_job_id);
-        free(s_cmd_line);
-        free(spid);
-        free(s_time);
+        char* buff = SmallShell::getInstance().getArena()->format("[%d] %s : %ld %ld secs%s\n", this->job_id,
+                this->cmd_line.c_str(), (long)this->process_id, (long)difftime(time(NULL), this->time_inserted),
+                this->isStopped ? " (stopped)" : "");
+        cmd->ChangeIO(IO_status, buff, strlen(buff));
     }
 }
 pid_t JobEntry::getProcessID() {
@@ -241,12 +262,83 @@ bool JobEntry::isStoppedProcess() {
 time_t JobEntry::getTImeInserted(){
     return this->time_inserted;
 }
+int64_t JobEntry::getStartMs() {
+    return this->start_ms;
+}
 std::string JobEntry::getCmdLine() {
     return this->cmd_line;
 }
 void JobEntry::setIsStopped(bool setStopped) {
     this->isStopped = setStopped;
 }
+int JobEntry::getPidfd() {
+    return this->pidfd;
+}
+JobUsage* JobEntry::getOrphanUsage() {
+    return &this->orphans;
+}
+// utime, stime, cutime, cstime (clock ticks) and rss (pages) of a live process, from /proc/<pid>/stat
+bool _liveUsage(pid_t pid, uint64_t* user_us, uint64_t* sys_us, long* rss_kb) {
+    char path[32];
+    char buff[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    int fd = open(path, O_RDONLY|O_CLOEXEC);
+    if (fd == -1)
+        return false;
+    ssize_t length = read(fd, buff, sizeof(buff) - 1);
+    close(fd);
+    if (length <= 0)
+        return false;
+    buff[length] = 0;
+    const char* p = strrchr(buff, ')'); // fields are counted from the end of the command name
+    unsigned long long utime, stime, cutime, cstime, rss;
+    if (p == NULL || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu %llu %llu %*d %*d %*d %*d %*u %*u %llu",
+                            &utime, &stime, &cutime, &cstime, &rss) != 5)
+        return false;
+    long ticks = sysconf(_SC_CLK_TCK);
+    *user_us = (utime + cutime) * 1000000ULL / ticks;
+    *sys_us = (stime + cstime) * 1000000ULL / ticks;
+    *rss_kb = (long)rss * (sysconf(_SC_PAGESIZE) / 1024);
+    return true;
+}
+void JobEntry::printStats(Command* cmd, int IO_status) {
+    uint64_t user_us = 0, sys_us = 0;
+    long rss_kb = 0;
+    _liveUsage(this->process_id, &user_us, &sys_us, &rss_kb);
+    char* buff = SmallShell::getInstance().getArena()->format(
+            "[%d] %s : %ld user %.2fs sys %.2fs rss %ldkB orphans %u (user %.2fs sys %.2fs maxrss %ldkB)\n",
+            this->job_id, this->cmd_line.c_str(), (long)this->process_id, user_us / 1e6, sys_us / 1e6, rss_kb,
+            orphans.reaped, orphans.user_us / 1e6, orphans.sys_us / 1e6, orphans.maxrss_kb);
+    uint64_t cgroup_cpu_us;
+    long cgroup_mem_kb;
+    if (SmallShell::getInstance().getCgroups()->readUsage(this->process_id, &cgroup_cpu_us, &cgroup_mem_kb)) {
+        // the whole job tree, orphans included; memory.current only with the memory controller
+        size_t length = strlen(buff);
+        buff[length - 1] = 0;
+        buff = cgroup_mem_kb == -1 ?
+               SmallShell::getInstance().getArena()->format("%s cgroup cpu %.2fs\n", buff, cgroup_cpu_us / 1e6) :
+               SmallShell::getInstance().getArena()->format("%s cgroup cpu %.2fs mem %ldkB\n", buff, cgroup_cpu_us / 1e6,
+                                                            cgroup_mem_kb);
+    }
+    if (IO_status == 2)
+        std::cout << buff;
+    else
+        cmd->ChangeIO(IO_status, buff, strlen(buff));
+}
+int JobEntry::sendSignal(int sig) {
+    if (this->pidfd != -1)
+        return (int)syscall(SYS_pidfd_send_signal, this->pidfd, sig, NULL, 0);
+    return kill(this->process_id, sig);
+}
+int JobEntry::signalGroup(int sig) {
+    // kill(-pid) alone could hit a reused pgid: the leader's pidfd says it is not reaped yet, so its
+    // pid, and the group named after it, still belong to this job
+    if (this->pidfd != -1 && syscall(SYS_pidfd_send_signal, this->pidfd, 0, NULL, 0) == -1)
+        return -1;
+    if (kill(-this->process_id, sig) == 0)
+        return 0;
+    return sendSignal(sig); // the child may not have called setpgrp yet
+}
 // <---------- END JobEntry ------------>
 
 // <---------- START JobsList ------------>
@@ -254,20 +346,44 @@ JobsList::JobsList() {
     jobs_vec = new std::vector<JobEntry>;
     max_job_id = 0;
     max_stopped_jod_id = 0;
+    owner_pid = getpid();
+    pidfd_count = 0;
+    pidfd_max = JOBS_PIDFD_MAX;
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1)
+        perror("smash error: epoll_create1 failed");
 }
 JobsList::~JobsList() {
+    vector<JobEntry>::iterator it;
+    for (it = jobs_vec->begin(); it != jobs_vec->end(); it++) {
+        if (it->getPidfd() != -1)
+            close(it->getPidfd());
+    }
+    if (epoll_fd != -1)
+        close(epoll_fd);
     jobs_vec->clear();
     delete jobs_vec;
 }
-void JobsList::addJob(int job_id, const char* cmd_line, pid_t pid, bool isStopped) {
-    int effective_job_id;
-    if (job_id == -1) { // new job (not return from fg)
-        effective_job_id = max_job_id + 1;
-    }
-    else {
-        effective_job_id = job_id;
+int JobsList::openPidfd(pid_t pid) {
+    // the pidfd pins this very process: signals and reaping cannot reach whoever gets the pid next
+    if (getpid() != owner_pid || epoll_fd == -1 || pidfd_count >= pidfd_max)
+        return -1;
+    int pidfd = (int)syscall(SYS_pidfd_open, pid, 0);
+    if (pidfd == -1)
+        return -1;
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.u64 = ((uint64_t)pid << 32) | (uint32_t)pidfd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, pidfd, &event) == -1) {
+        perror("smash error: epoll_ctl failed");
+        close(pidfd);
+        return -1;
     }
-    JobEntry job(effective_job_id, std::string(cmd_line), pid, time(NULL), isStopped, -1);
+    pidfd_count++;
+    return pidfd;
+}
+void JobsList::insertJob(JobEntry job) {
+    int effective_job_id = job.getJobID();
     vector<JobEntry>::iterator it;
     if (jobs_vec->size() == 0) {
         jobs_vec->push_back(job);
@@ -282,55 +398,474 @@ void JobsList::addJob(int job_id, const char* cmd_line, pid_t pid, bool isStoppe
         for (it = jobs_vec->begin() + 1; it != jobs_vec->end(); it++) {
             if ((it - 1)->getJobID() < effective_job_id && it->getJobID() > effective_job_id) {
                 jobs_vec->insert(it, job);
+                break;
             }
         }
     }
+    if (state.isOpen() && getpid() == owner_pid)
+        state.add(effective_job_id, job.getProcessID(), job.getTImeInserted(), job.isStoppedProcess(), job.getCmdLine());
     updateMaxJobID();
     updateMaxStoppedJobID();
 }
-void JobsList::printJobsList(Command* cmd, int IO_status) {
+void JobsList::addJob(int job_id, const char* cmd_line, pid_t pid, bool isStopped) {
+    int effective_job_id;
+    if (job_id == -1) { // new job (not return from fg)
+        // the ids of jobs that wait on others are taken already
+        effective_job_id = std::max(max_job_id, SmallShell::getInstance().getJobGraph()->getMaxJobID()) + 1;
+        SmallShell::getInstance().getCaptures()->forget(effective_job_id); // a finished job's output
+    }
+    else {
+        effective_job_id = job_id;
+    }
+    insertJob(JobEntry(effective_job_id, std::string(cmd_line), pid, time(NULL), isStopped, -1, openPidfd(pid)));
+}
+bool JobsList::attachStateFile(const char* path) {
+    std::vector<JobStateRecord> records;
+    if (!state.open(path, &records))
+        return false;
+    SmallShell& smash = SmallShell::getInstance();
+    for (size_t i = 0; i < records.size(); i++) {
+        const JobStateRecord& r = records[i];
+        if (getJobById(r.job_id) != NULL)
+            continue;
+        // open first, then check it is still the process that was recorded: the pidfd cannot change under us
+        int pidfd = openPidfd(r.pid);
+        if (pidfd == -1)
+            continue; // gone (or no descriptors left, it can not be tracked safely)
+        if (JobStateFile::processStartTicks(r.pid) != r.start_ticks) {
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, pidfd, NULL);
+            close(pidfd);
+            pidfd_count--;
+            continue; // the pid belongs to another process by now
+        }
+        insertJob(JobEntry(r.job_id, std::string(r.cmd_line), r.pid, (time_t)r.start_time, r.stopped, -1, pidfd));
+        if (r.deadline != 0)
+            smash.addTimeJob(r.pid, r.cmd_line, (time_t)r.start_time, (int)(r.deadline - r.start_time));
+    }
+    return true;
+}
+void JobsList::setStopped(JobEntry* job, bool stopped) {
+    job->setIsStopped(stopped);
+    if (state.isOpen() && getpid() == owner_pid)
+        state.setStopped(job->getProcessID(), stopped);
+    updateMaxStoppedJobID();
+}
+void JobsList::setDeadline(pid_t pid, time_t deadline) {
+    if (state.isOpen() && getpid() == owner_pid)
+        state.setDeadline(pid, deadline);
+}
+// "%1 %3", the edges of a waiting job
+static std::string _jobRefs(const std::vector<int>& job_ids) {
+    std::string refs;
+    for (size_t i = 0; i < job_ids.size(); i++)
+        refs += (i > 0 ? " %" : "%") + std::to_string(job_ids[i]);
+    return refs;
+}
+static void _printWaitingJob(const WaitingJob& job, Command* cmd, int IO_status) {
+    const char* condition = (job.condition == JOB_AFTER_SUCCESS) ? " to succeed" :
+                            (job.condition == JOB_AFTER_FAILURE) ? " to fail" : "";
+    char* buff = SmallShell::getInstance().getArena()->format("[%d] %s : waiting for %s%s\n", job.job_id,
+            job.cmd_line.c_str(), _jobRefs(job.after).c_str(), condition);
+    if (IO_status == 2)
+        std::cout << buff;
+    else
+        cmd->ChangeIO(IO_status, buff, strlen(buff));
+}
+void JobsList::printJobsList(Command* cmd, int IO_status, bool stats) {
     vector<JobEntry>::iterator it;
     bool first_print = true;
+    // the jobs waiting on others go in between, by id
+    const std::vector<WaitingJob>* waiting = SmallShell::getInstance().getJobGraph()->getWaiting();
+    size_t next_waiting = stats ? waiting->size() : 0;
     for(it = jobs_vec->begin(); it != jobs_vec->end(); it++) {
-        if (IO_status == 2) {
-            it->printJob(cmd, IO_status);
+        for (; next_waiting < waiting->size() && (*waiting)[next_waiting].job_id < it->getJobID(); next_waiting++) {
+            _printWaitingJob((*waiting)[next_waiting], cmd, (IO_status == 2 || first_print) ? IO_status : 1);
             first_print = false;
         }
-        else {
-            if (first_print) {
-                it->printJob(cmd, IO_status);
-                first_print = false;
+        int status = (IO_status == 2 || first_print) ? IO_status : 1;
+        if (stats)
+            it->printStats(cmd, status);
+        else
+            it->printJob(cmd, status);
+        first_print = false;
+    }
+    for (; next_waiting < waiting->size(); next_waiting++) {
+        _printWaitingJob((*waiting)[next_waiting], cmd, (IO_status == 2 || first_print) ? IO_status : 1);
+        first_print = false;
+    }
+    if (stats && unattributed.reaped > 0) {
+        char* buff = SmallShell::getInstance().getArena()->format(
+                "smash: %u orphans of finished jobs (user %.2fs sys %.2fs maxrss %ldkB)\n", unattributed.reaped,
+                unattributed.user_us / 1e6, unattributed.sys_us / 1e6, unattributed.maxrss_kb);
+        if (IO_status == 2)
+            std::cout << buff;
+        else
+            cmd->ChangeIO(first_print ? IO_status : 1, buff, strlen(buff));
+    }
+}
+static const struct {
+    const char* name;
+    JobField field;
+} JOB_FIELDS[] = {
+    {"id", JOB_FIELD_ID}, {"pgid", JOB_FIELD_PGID}, {"pid", JOB_FIELD_PID}, {"state", JOB_FIELD_STATE},
+    {"elapsed_ms", JOB_FIELD_ELAPSED_MS}, {"timeout_remaining_ms", JOB_FIELD_TIMEOUT_REMAINING_MS},
+    {"cpu_ms", JOB_FIELD_CPU_MS}, {"rss_kb", JOB_FIELD_RSS_KB}, {"cmd", JOB_FIELD_CMD}, {"after", JOB_FIELD_AFTER},
+};
+bool parseJobFormat(const char* format, std::vector<JobFormatPart>* parts, std::string* bad_field) {
+    JobFormatPart text = {JOB_FIELD_TEXT, std::string()};
+    for (const char* p = format; *p != 0; p++) {
+        const char* close = (*p == '{') ? strchr(p, '}') : NULL;
+        if (*p == '\\' && (p[1] == 't' || p[1] == 'n')) {
+            text.text += (*++p == 't') ? '\t' : '\n';
+            continue;
+        }
+        if (close == NULL) {
+            text.text += *p;
+            continue;
+        }
+        std::string name(p + 1, close - p - 1);
+        size_t i = 0;
+        while (i < sizeof(JOB_FIELDS) / sizeof(JOB_FIELDS[0]) && name != JOB_FIELDS[i].name)
+            i++;
+        if (i == sizeof(JOB_FIELDS) / sizeof(JOB_FIELDS[0])) {
+            *bad_field = name;
+            return false;
+        }
+        if (!text.text.empty())
+            parts->push_back(text);
+        text.text.clear();
+        JobFormatPart field = {JOB_FIELDS[i].field, std::string()};
+        parts->push_back(field);
+        p = close;
+    }
+    if (!text.text.empty())
+        parts->push_back(text);
+    return true;
+}
+void JobsList::writeJobs(StreamWriter* out, const std::vector<JobFormatPart>* format) {
+    SmallShell& smash = SmallShell::getInstance();
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    int64_t now_ms = (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+    bool usage = (format == NULL);
+    for (size_t i = 0; format != NULL && i < format->size(); i++)
+        usage = usage || (*format)[i].field == JOB_FIELD_CPU_MS || (*format)[i].field == JOB_FIELD_RSS_KB;
+    for (size_t j = 0; j < jobs_vec->size(); j++) {
+        JobEntry& job = (*jobs_vec)[j];
+        pid_t pid = job.getProcessID();
+        pid_t pgid = getpgid(pid);
+        uint64_t user_us = 0, sys_us = 0;
+        long rss_kb = 0;
+        if (usage) // a /proc read per job, only when asked for
+            _liveUsage(pid, &user_us, &sys_us, &rss_kb);
+        long timeout_ms = smash.timeoutRemainingMs(pid, now_ms);
+        if (format == NULL) {
+            out->put("{\"id\":");
+            out->putInt(job.getJobID());
+            out->put(",\"pgid\":");
+            out->putInt(pgid == -1 ? pid : pgid);
+            out->put(",\"pid\":");
+            out->putInt(pid);
+            out->put(job.isStoppedProcess() ? ",\"state\":\"stopped\"" : ",\"state\":\"running\"");
+            out->put(",\"elapsed_ms\":");
+            out->putInt(now_ms - job.getStartMs());
+            out->put(",\"timeout_remaining_ms\":");
+            if (timeout_ms == -1)
+                out->put("null");
+            else
+                out->putInt(timeout_ms);
+            out->put(",\"cpu_ms\":");
+            out->putInt((int64_t)((user_us + sys_us) / 1000));
+            out->put(",\"rss_kb\":");
+            out->putInt(rss_kb);
+            out->put(",\"cmd\":");
+            out->putJsonString(job.getCmdLine());
+            out->put("}\n");
+            continue;
+        }
+        for (size_t i = 0; i < format->size(); i++) {
+            const JobFormatPart& part = (*format)[i];
+            switch (part.field) {
+                case JOB_FIELD_TEXT: out->put(part.text); break;
+                case JOB_FIELD_ID: out->putInt(job.getJobID()); break;
+                case JOB_FIELD_PGID: out->putInt(pgid == -1 ? pid : pgid); break;
+                case JOB_FIELD_PID: out->putInt(pid); break;
+                case JOB_FIELD_STATE: out->put(job.isStoppedProcess() ? "stopped" : "running"); break;
+                case JOB_FIELD_ELAPSED_MS: out->putInt(now_ms - job.getStartMs()); break;
+                case JOB_FIELD_TIMEOUT_REMAINING_MS:
+                    if (timeout_ms == -1)
+                        out->put('-');
+                    else
+                        out->putInt(timeout_ms);
+                    break;
+                case JOB_FIELD_CPU_MS: out->putInt((int64_t)((user_us + sys_us) / 1000)); break;
+                case JOB_FIELD_RSS_KB: out->putInt(rss_kb); break;
+                case JOB_FIELD_CMD: out->put(job.getCmdLine()); break;
+                case JOB_FIELD_AFTER: out->put('-'); break;
             }
-            else {
-                it->printJob(cmd, 1);
-                first_print = false;
+        }
+        out->put('\n');
+    }
+    const std::vector<WaitingJob>* waiting = smash.getJobGraph()->getWaiting();
+    for (size_t j = 0; j < waiting->size(); j++) {
+        const WaitingJob& job = (*waiting)[j];
+        const char* condition = (job.condition == JOB_AFTER_SUCCESS) ? "success" :
+                                (job.condition == JOB_AFTER_FAILURE) ? "failure" : "any";
+        if (format == NULL) {
+            out->put("{\"id\":");
+            out->putInt(job.job_id);
+            out->put(",\"pgid\":null,\"pid\":null,\"state\":\"waiting\",\"elapsed_ms\":");
+            out->putInt(now_ms - job.queued_ms);
+            out->put(",\"timeout_remaining_ms\":null,\"cpu_ms\":0,\"rss_kb\":0,\"cmd\":");
+            out->putJsonString(job.cmd_line);
+            out->put(",\"after\":[");
+            for (size_t i = 0; i < job.after.size(); i++) {
+                if (i > 0)
+                    out->put(',');
+                out->putInt(job.after[i]);
+            }
+            out->put("],\"condition\":\"");
+            out->put(condition);
+            out->put("\"}\n");
+            continue;
+        }
+        for (size_t i = 0; i < format->size(); i++) {
+            const JobFormatPart& part = (*format)[i];
+            switch (part.field) {
+                case JOB_FIELD_TEXT: out->put(part.text); break;
+                case JOB_FIELD_ID: out->putInt(job.job_id); break;
+                case JOB_FIELD_STATE: out->put("waiting"); break;
+                case JOB_FIELD_ELAPSED_MS: out->putInt(now_ms - job.queued_ms); break;
+                case JOB_FIELD_CMD: out->put(job.cmd_line); break;
+                case JOB_FIELD_AFTER: out->put(_jobRefs(job.after)); break;
+                default: out->put('-'); break; // no process yet
             }
         }
+        out->put('\n');
     }
 }
-void JobsList::removeFinishedJobs() {
-    if (!this->isVecEmpty()) {
-        pid_t kidpid = 1;
+void JobsList::reapOrphans() {
+    if (getpid() != owner_pid)
+        return;
+    while (true) {
+        siginfo_t info;
+        memset(&info, 0, sizeof(info));
+        // peek first: the process group of a zombie is only readable until it is reaped
+        if (waitid(P_ALL, 0, &info, WEXITED|WNOHANG|WNOWAIT) == -1 || info.si_pid == 0)
+            break;
+        pid_t pid = info.si_pid;
+        pid_t pgid = getpgid(pid);
         int status;
-        while (kidpid > 0) {
-            kidpid = waitpid(-1, &status, WNOHANG);
-            if (kidpid > 0) {
-                this->removeJobByProcessId(kidpid);
-            }
+        struct rusage usage;
+        if (wait4(pid, &status, WNOHANG, &usage) <= 0)
+            break;
+        if (getJobByProcessId(pid) != NULL) { // a job whose pidfd was not looked at yet
+            recordExit(pid, status);
+            continue;
         }
-        vector<JobEntry>::iterator it;
-        for(it = jobs_vec->begin(); it != jobs_vec->end(); it++) {
-            kidpid = it->getProcessID();
-            if (kidpid == 0)
+        JobEntry* job = (pgid > 0) ? getJobByProcessId(pgid) : NULL; // every job leads its own group
+        JobUsage* target = (job != NULL) ? job->getOrphanUsage() : &unattributed;
+        target->user_us += usage.ru_utime.tv_sec * 1000000ULL + usage.ru_utime.tv_usec;
+        target->sys_us += usage.ru_stime.tv_sec * 1000000ULL + usage.ru_stime.tv_usec;
+        target->maxrss_kb = std::max(target->maxrss_kb, usage.ru_maxrss);
+        target->reaped++;
+    }
+    updateMaxJobID();
+    updateMaxStoppedJobID();
+}
+static int _waitStatus(const siginfo_t* info) {
+    if (info->si_code == CLD_EXITED)
+        return info->si_status << 8;
+    return (info->si_code == CLD_DUMPED) ? (info->si_status | WCOREFLAG) : info->si_status; // WCOREDUMP sees it
+}
+void JobsList::reapReady(const struct epoll_event* events, int ready) {
+    std::vector<std::pair<pid_t, int> > exits;
+    for (int i = 0; i < ready; i++) {
+        // the event carries both, the list is only searched once for the whole batch
+        pid_t pid = (pid_t)(events[i].data.u64 >> 32);
+        int pidfd = (int)(uint32_t)events[i].data.u64;
+        siginfo_t info;
+        memset(&info, 0, sizeof(info));
+        int waited = waitid((idtype_t)P_PIDFD, pidfd, &info, WEXITED|WNOHANG);
+        if (waited == 0 && info.si_pid != 0)
+            exits.push_back(std::make_pair(pid, _waitStatus(&info)));
+        else if (waited == -1 && errno == ECHILD) // re-adopted from a state file: it exited, but its status went to its real parent
+            exits.push_back(std::make_pair(pid, JOBS_EXIT_UNKNOWN));
+    }
+    recordExits(exits);
+}
+void JobsList::setPidfdLimit(size_t max_pidfds) {
+    this->pidfd_max = max_pidfds;
+}
+void JobsList::reapPidJobs() {
+    if (pidfd_count == jobs_vec->size()) // every job has a pidfd
+        return;
+    int status;
+    for (size_t i = 0; i < jobs_vec->size();) {
+        pid_t pid = (*jobs_vec)[i].getProcessID();
+        if ((*jobs_vec)[i].getPidfd() == -1 && waitpid(pid, &status, WNOHANG) > 0)
+            recordExit(pid, status); // erases entry i
+        else
+            i++;
+    }
+}
+void JobsList::removeFinishedJobs() {
+    // only the shell can reap its jobs; a forked stage sees a copy of the list and the shared epoll
+    if (this->isVecEmpty() || getpid() != owner_pid)
+        return;
+    struct epoll_event events[JOBS_EPOLL_BATCH];
+    int ready = JOBS_EPOLL_BATCH;
+    while (ready == JOBS_EPOLL_BATCH && epoll_fd != -1) {
+        ready = epoll_wait(epoll_fd, events, JOBS_EPOLL_BATCH, 0); // only the exited jobs, whatever the list size
+        reapReady(events, ready);
+    }
+    reapPidJobs();
+    // need to do the rows below after every change in the vec
+    updateMaxJobID();
+    updateMaxStoppedJobID();
+}
+int JobsList::exitCode(int status) {
+    if (status == JOBS_EXIT_UNKNOWN)
+        return JOBS_EXIT_UNKNOWN;
+    if (WIFEXITED(status))
+        return WEXITSTATUS(status);
+    if (WIFSIGNALED(status))
+        return 128 + WTERMSIG(status);
+    return 0;
+}
+void JobsList::recordExit(pid_t pid, int status) {
+    std::vector<std::pair<pid_t, int> > exits(1, std::make_pair(pid, status));
+    recordExits(exits);
+}
+void JobsList::recordExits(const std::vector<std::pair<pid_t, int> >& exits) {
+    if (exits.empty())
+        return;
+    // one compacting pass however many exited: erasing them one by one is quadratic on `quit kill`;
+    // the exits are sorted by pid so each job finds its own in log time
+    std::vector<std::pair<pid_t, int> > by_pid(exits);
+    std::sort(by_pid.begin(), by_pid.end());
+    size_t kept = 0;
+    for (size_t i = 0; i < jobs_vec->size(); i++) {
+        JobEntry& job = (*jobs_vec)[i];
+        std::vector<std::pair<pid_t, int> >::const_iterator exit =
+            std::lower_bound(by_pid.begin(), by_pid.end(), std::make_pair(job.getProcessID(), INT_MIN));
+        if (exit == by_pid.end() || exit->first != job.getProcessID()) { // still running, or a foreground or pipeline child nobody can wait for
+            if (kept != i)
+                (*jobs_vec)[kept] = std::move(job);
+            kept++;
+            continue;
+        }
+        FinishedJob finished_job = {job.getJobID(), job.getProcessID(), exitCode(exit->second)};
+        if (finished.size() == JOBS_FINISHED_MAX)
+            finished.erase(finished.begin());
+        finished.push_back(finished_job);
+        closePidfd(&job);
+        if (state.isOpen() && getpid() == owner_pid)
+            state.remove(job.getProcessID());
+        SmallShell::getInstance().removeTimeJob(job.getProcessID());
+        SmallShell::getInstance().getCgroups()->removeLeaf(job.getProcessID());
+        if (getpid() == owner_pid) { // a forked stage would read the job's output away from smash
+            SmallShell::getInstance().getCaptures()->jobFinished(job.getJobID());
+            SmallShell::getInstance().getControl()->publishExit(job.getJobID(), job.getProcessID(), finished_job.exit_code);
+            SmallShell::getInstance().getJobGraph()->jobFinished(job.getJobID(), finished_job.exit_code);
+        }
+    }
+    jobs_vec->erase(jobs_vec->begin() + kept, jobs_vec->end());
+}
+void JobsList::closePidfd(JobEntry* job) {
+    if (job->getPidfd() == -1)
+        return;
+    // closing drops it from the epoll set too, unless a forked child still holds a copy
+    if (getpid() == owner_pid && epoll_ctl(epoll_fd, EPOLL_CTL_DEL, job->getPidfd(), NULL) == -1)
+        perror("smash error: epoll_ctl failed");
+    close(job->getPidfd());
+    pidfd_count--;
+}
+bool JobsList::takeFinished(int job_id, pid_t pid, int* exit_code) {
+    vector<FinishedJob>::iterator it;
+    for (it = finished.begin(); it != finished.end(); it++) {
+        if ((job_id != -1 && it->job_id == job_id) || (job_id == -1 && it->process_id == pid)) {
+            *exit_code = it->exit_code;
+            finished.erase(it);
+            return true;
+        }
+    }
+    return false;
+}
+bool JobsList::peekFinished(int job_id, int* exit_code) {
+    for (size_t i = finished.size(); i > 0; i--) { // the newest, ids are reused
+        if (finished[i - 1].job_id == job_id) {
+            *exit_code = finished[i - 1].exit_code;
+            return true;
+        }
+    }
+    return false;
+}
+int JobsList::waitJobs(std::vector<pid_t>* pids, bool any, int* exit_code) {
+    SmallShell& smash = SmallShell::getInstance();
+    smash.takeCtrlC(); // only a ctrl-C typed from now on interrupts the wait
+    std::vector<struct pollfd> pfds;
+    for (size_t i = 0; i < pids->size(); i++) {
+        // a copy of the job's own pidfd: a timeout (handleSignals) may reap the job and close the original meanwhile
+        JobEntry* job = getJobByProcessId((*pids)[i]);
+        int fd = (job != NULL && job->getPidfd() != -1) ? fcntl(job->getPidfd(), F_DUPFD_CLOEXEC, 0)
+                                                         : (int)syscall(SYS_pidfd_open, (*pids)[i], 0);
+        struct pollfd pfd = {fd, POLLIN, 0};
+        if (pfd.fd == -1) // already reaped behind our back: it reads as finished
+            pfd.fd = -(int)(*pids)[i] - 1;
+        pfds.push_back(pfd);
+    }
+    struct pollfd signal_pfd = {smash.getSignalFd(), POLLIN, 0};
+    pfds.push_back(signal_pfd); // last, after one entry per pid
+    int result = 0;
+    size_t remaining = pids->size();
+    while (remaining > 0) {
+        bool ready = false;
+        for (size_t i = 0; i < pids->size(); i++)
+            ready = ready || (pfds[i].fd < -1 && (*pids)[i] != 0);
+        if (!ready && poll(pfds.data(), pfds.size(), -1) == -1) {
+            if (errno != EINTR) {
+                perror("smash error: poll failed");
+                result = -1;
+                break;
+            }
+            if (smash.takeCtrlC()) {
+                result = -1;
                 break;
-            if (kill(kidpid, 0) != 0) {
-                this->removeJobByProcessId(kidpid);
             }
+            continue;
+        }
+        if (pfds.back().revents != 0) {
+            smash.handleSignals(); // an alarm for a timed job, the wait goes on
+            pfds.back().revents = 0;
+        }
+        for (size_t i = 0; i < pids->size(); i++) {
+            pid_t pid = (*pids)[i];
+            if (pid == 0 || (pfds[i].fd >= 0 && !(pfds[i].revents & POLLIN)))
+                continue;
+            siginfo_t info;
+            memset(&info, 0, sizeof(info));
+            if (pfds[i].fd >= 0 && waitid((idtype_t)P_PIDFD, pfds[i].fd, &info, WEXITED) == 0)
+                recordExit(pid, _waitStatus(&info));
+            // reaped here or by removeFinishedJobs (from handleSignals): the status was recorded
+            if (!takeFinished(-1, pid, exit_code))
+                *exit_code = JOBS_EXIT_UNKNOWN;
+            if (pfds[i].fd >= 0)
+                close(pfds[i].fd);
+            pfds[i].fd = -1;
+            (*pids)[i] = 0;
+            remaining = any ? 0 : remaining - 1;
+            if (remaining == 0)
+                break; // `wait -n` returns with the first job, the others stay for the next wait
         }
-        // need to do the rows below after every change in the vec
-        updateMaxJobID();
-        updateMaxStoppedJobID();
     }
+    for (size_t i = 0; i < pids->size(); i++) {
+        if (pfds[i].fd >= 0)
+            close(pfds[i].fd);
+    }
+    updateMaxJobID();
+    updateMaxStoppedJobID();
+    return result;
 }
 void JobsList::updateMaxJobID() {
     if (jobs_vec->size() != 0) {
@@ -373,6 +908,9 @@ void JobsList::removeJobByProcessId(pid_t process_to_delete) {
     vector<JobEntry>::iterator it;
     for(it = jobs_vec->begin(); it != jobs_vec->end(); it++) {
         if(it->getProcessID() == process_to_delete) {
+            closePidfd(&(*it));
+            if (state.isOpen() && getpid() == owner_pid)
+                state.remove(process_to_delete);
             jobs_vec->erase(it);
             break;
         }
@@ -394,6 +932,12 @@ int JobsList::getMaxJobID() {
 int JobsList::getMaxStoppedJobID() {
     return max_stopped_jod_id;
 }
+int JobsList::getEventFd() {
+    return this->epoll_fd;
+}
+static void _handleSignals() {
+    SmallShell::getInstance().handleSignals();
+}
 void JobsList::turnToForeground(JobEntry* bg_or_stopped_job, Command* cmd, SmallShell* smash) {
     if (bg_or_stopped_job == NULL) { // something wrong!!
         std::cerr << "something wrong!!" << endl;
@@ -406,28 +950,44 @@ void JobsList::turnToForeground(JobEntry* bg_or_stopped_job, Command* cmd, Small
             std::cout << (job_cmd_line).c_str() << " : " << job_pid << endl;
         }
         else {
-            char* s_cmd_line = (char*) malloc(sizeof((job_cmd_line).c_str()));
-            sprintf(s_cmd_line, "%s", (job_cmd_line).c_str());
-            string buff(s_cmd_line);
-            buff.append(" : ");
-            char* spid = (char*) malloc(sizeof((long)job_pid));
-            sprintf(spid, "%ld", (long)job_pid);
-            buff.append(spid);
-            buff.append("\n");
-            cmd->ChangeIO(cmd->getIOStatus(), buff.c_str(), strlen(buff.c_str()));
-            free(s_cmd_line);
-            free(spid);
-        }
-        int kill_status = kill(job_pid, 18); //SIGCONT
+            char* buff = smash->getArena()->format("%s : %ld\n", job_cmd_line.c_str(), (long)job_pid);
+            cmd->ChangeIO(cmd->getIOStatus(), buff, strlen(buff));
+        }
+        int kill_status = bg_or_stopped_job->sendSignal(SIGCONT);
         if (kill_status < 0) {
             perror("smash error: kill failed");
             return;
         }
+        // kept for a job re-adopted from a state file, which is not our child and cannot be waitpid'ed
+        int pidfd = (bg_or_stopped_job->getPidfd() != -1) ? fcntl(bg_or_stopped_job->getPidfd(), F_DUPFD_CLOEXEC, 0) : -1;
         removeJobByProcessId(job_pid); //remove from vec
         smash->setCurrProcessID(job_pid);
         smash->setCurrJobID(job_id);
         smash->setCurrCmdLine(job_cmd_line);
-        pid_t wait_status = waitpid(job_pid, NULL, WUNTRACED);
+        OutputCapture* captures = smash->getCaptures();
+        int status = 0;
+        pid_t wait_status = 0;
+        if (captures->find(job_id) != NULL) // 0 when its output ended first, the job is waited for below
+            wait_status = captures->waitForeground(job_id, job_pid, pidfd, smash->getSignalFd(), _handleSignals, &status);
+        if (wait_status == 0)
+            wait_status = smash->waitForeground(job_pid, &status);
+        if (wait_status < 0 && errno == ECHILD && pidfd != -1) {
+            struct pollfd pfds[2] = {{pidfd, POLLIN, 0}, {smash->getSignalFd(), POLLIN, 0}};
+            // ctrl-Z puts it back in the list, there is no exit to wait for then
+            while (getJobByProcessId(job_pid) == NULL && (poll(pfds, 2, -1) != -1 || errno == EINTR) &&
+                   pfds[0].revents == 0)
+                smash->handleSignals();
+            wait_status = job_pid;
+            status = JOBS_EXIT_UNKNOWN; // re-adopted, not our child
+        }
+        smash->handleSignals(); // a ctrl-Z during the capture's wait
+        if (pidfd != -1)
+            close(pidfd);
+        if (wait_status >= 0 && getJobByProcessId(job_pid) == NULL) { // not stopped again
+            smash->getCgroups()->removeLeaf(job_pid);
+            captures->jobFinished(job_id);
+            smash->getJobGraph()->jobFinished(job_id, exitCode(status));
+        }
         if (wait_status < 0) {
             perror("smash error: waitpid failed");
             return;
@@ -444,23 +1004,15 @@ void JobsList::resumesStoppedJob(JobEntry* stopped_job, Command* cmd) {
         std::cerr << "something wrong!!" << endl;
     }
     else {
-        if(kill(stopped_job->getProcessID(), 18) != -1 ) {// sending signal for job to continue.
-            stopped_job->setIsStopped(false);
+        if(stopped_job->sendSignal(SIGCONT) != -1 ) {// sending signal for job to continue.
+            setStopped(stopped_job, false);
             if(cmd->getIOStatus() == 2) {
                 std::cout << (stopped_job->getCmdLine()).c_str() << " : " << stopped_job->getProcessID() << endl;
             }
             else {
-                char* s_cmd_line = (char*) malloc(sizeof((stopped_job->getCmdLine()).c_str()));
-                sprintf(s_cmd_line, "%s", (stopped_job->getCmdLine()).c_str());
-                string buff(s_cmd_line);
-                buff.append(" : ");
-                char* spid = (char*) malloc(sizeof((long)stopped_job->getProcessID()));
-                sprintf(spid, "%ld", (long)stopped_job->getProcessID());
-                buff.append(spid);
-                buff.append("\n");
-                cmd->ChangeIO(cmd->getIOStatus(), buff.c_str(), strlen(buff.c_str()));
-                free(s_cmd_line);
-                free(spid);
+                char* buff = SmallShell::getInstance().getArena()->format("%s : %ld\n",
+                        stopped_job->getCmdLine().c_str(), (long)stopped_job->getProcessID());
+                cmd->ChangeIO(cmd->getIOStatus(), buff, strlen(buff));
             }
             updateMaxJobID();
             updateMaxStoppedJobID();
@@ -470,93 +1022,132 @@ void JobsList::resumesStoppedJob(JobEntry* stopped_job, Command* cmd) {
         }
     }
 }
-void JobsList::killAllJobs(Command* cmd) {
-    if(cmd->getIOStatus() == 2) {
-        std::cout << "smash: sending SIGKILL signal to " << jobs_vec->size() << " jobs:" << endl;
-    }
-    else {
-        string buff("smash: sending SIGKILL signal to ");
-        char* s_size = (char*) malloc(sizeof((long)jobs_vec->size()));
-        sprintf(s_size, "%ld", (long)jobs_vec->size());
-        buff.append(s_size);
-        buff.append(" jobs:\n");
-        cmd->ChangeIO(cmd->getIOStatus(), buff.c_str(), strlen(buff.c_str()));
-        free(s_size);
+static long _elapsedMs(const struct timespec& start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+}
+bool JobsList::hasPidOnlyJobs() {
+    return pidfd_count < jobs_vec->size();
+}
+bool JobsList::waitAllJobs(long timeout_ms) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    struct epoll_event events[JOBS_EPOLL_BATCH];
+    removeFinishedJobs();
+    long pid_poll_ms = 0;
+    while (!isVecEmpty()) {
+        long elapsed = _elapsedMs(start);
+        if (elapsed >= timeout_ms)
+            break;
+        // every exit wakes the epoll set; pid-only jobs are looked at every JOBS_PID_POLL_MS
+        long timeout = timeout_ms - elapsed;
+        if (pidfd_count < jobs_vec->size()) {
+            if (elapsed >= pid_poll_ms) {
+                reapPidJobs();
+                pid_poll_ms = elapsed + JOBS_PID_POLL_MS;
+            }
+            timeout = std::min(timeout, pid_poll_ms - elapsed);
+        }
+        int ready = epoll_wait(epoll_fd, events, JOBS_EPOLL_BATCH, (int)timeout);
+        if (ready == -1 && errno != EINTR) {
+            perror("smash error: epoll_wait failed");
+            break;
+        }
+        reapReady(events, ready);
     }
+    updateMaxJobID();
+    updateMaxStoppedJobID();
+    return isVecEmpty();
+}
+void JobsList::killAllJobs(Command* cmd, long timeout_ms) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    Arena* arena = SmallShell::getInstance().getArena();
+    std::string out = arena->format("smash: sending SIGTERM signal to %ld jobs:\n", (long)jobs_vec->size());
     vector<JobEntry>::iterator it;
     for(it = jobs_vec->begin(); it != jobs_vec->end(); it++) {
-        if(cmd->getIOStatus() == 2) {
-            std::cout << it->getProcessID() << ": " << (it->getCmdLine()).c_str() << endl;
-        }
-        else {
-            char* spid = (char*) malloc(sizeof((long)it->getProcessID()));
-            sprintf(spid, "%ld", (long)it->getProcessID());
-            string buff(spid);
-            buff.append(": ");
-            char* s_cmd_line = (char*) malloc(sizeof((it->getCmdLine()).c_str()));
-            sprintf(s_cmd_line, "%s", (it->getCmdLine()).c_str());
-            buff.append(s_cmd_line);
-            buff.append("\n");
-            cmd->ChangeIO(1, buff.c_str(), strlen(buff.c_str()));
-            free(s_cmd_line);
-            free(spid);
-        }
-        int kill_status = kill(it->getProcessID(), 9); //SIGKILL
-        if (kill_status < 0) {
+        out += arena->format("%ld: %s\n", (long)it->getProcessID(), it->getCmdLine().c_str());
+        if (it->signalGroup(SIGTERM) == -1) {
             perror("smash error: kill failed");
         }
+        else if (it->isStoppedProcess()) {
+            it->signalGroup(SIGCONT); // a stopped job only acts on SIGTERM once it runs
+        }
     }
-}
-// <---------- END JobsList ------------>
-
-// <---------- START Command ------------>
-Command::Command(const char* cmd_line) : cmd_line(cmd_line) {
-    string new_cmd_line;
-    IO_status = checkForFile(cmd_line,&new_cmd_line ,&file_name);
-    if(IO_status == 2) {
-        this->args_length = _parseCommandLine(cmd_line, this->args);
-        this->cmd_line_without_const = strdup(cmd_line);
+    size_t total = jobs_vec->size();
+    if (!waitAllJobs(timeout_ms)) {
+        out += arena->format("smash: sending SIGKILL signal to %ld jobs:\n", (long)jobs_vec->size());
+        for(it = jobs_vec->begin(); it != jobs_vec->end(); it++) {
+            out += arena->format("%ld: %s\n", (long)it->getProcessID(), it->getCmdLine().c_str());
+            // one write takes down the whole job tree, also what left the process group
+            if (!SmallShell::getInstance().getCgroups()->killAll(it->getProcessID()) && it->signalGroup(SIGKILL) == -1)
+                perror("smash error: kill failed");
+        }
+        // SIGKILL cannot be caught, but a process stuck in the kernel may still take a while
+        waitAllJobs(timeout_ms);
     }
-    else {
-        this->args_length = _parseCommandLine(new_cmd_line.c_str(), this->args);
-        this->cmd_line_without_const = strdup(new_cmd_line.c_str());
+    out += arena->format("smash: %ld jobs terminated in %ld ms\n", (long)(total - jobs_vec->size()), _elapsedMs(start));
+    if(cmd->getIOStatus() == 2) {
+        std::cout << out;
     }
-    _removeBackgroundSign(this->args[this->args_length-1]);
-}
-Command::~Command() {
-    for(int i = 0; i < this->args_length; i++) {
-        if (this->args[i] != NULL)
-            free(this->args[i]);
+    else {
+        cmd->ChangeIO(cmd->getIOStatus(), out.c_str(), out.size());
     }
-    free(this->cmd_line_without_const);
 }
+// <---------- END JobsList ------------>
+
+// <---------- START Command ------------>
+Command::Command(const char* cmd_line) : cmd_line(cmd_line), file_name(NULL) {
+    Arena* arena = SmallShell::getInstance().getArena();
+    this->cmd_line_without_const = redirects.parse(cmd_line, arena);
+    this->IO_status = redirects.stdoutStatus(&file_name);
+    this->args_length = _parseCommandLine(this->cmd_line_without_const, this->args, arena);
+    if (this->args_length > 0)
+        _removeBackgroundSign(this->args[this->args_length-1]);
+}
+Command::~Command() {} // args and strings live in the line arena
+void* Command::operator new(size_t size, Arena* arena) {
+    return arena->allocate(size);
+}
+void Command::operator delete(void* ptr, Arena* arena) {} // only reached when a constructor throws
+void Command::operator delete(void* ptr) {} // the arena owns the memory, see executeCommand
 const char* Command::getCmdLine() {
     return this->cmd_line;
 }
 int Command::getIOStatus() {
     return this->IO_status;
 }
+bool Command::prepare() {
+    return redirects.apply(true);
+}
+void Command::cleanup() {
+    redirects.restore();
+}
 
-void Command::ChangeIO(int isAppend, const char* buff = "", int length = 0) {
-    int open_fd = 0;
+int Command::openIOFile(int isAppend) {
+    int open_fd;
     if (isAppend == 1) {
-        open_fd = open(file_name.c_str(), O_WRONLY|O_CREAT|O_APPEND, S_IRWXU|S_IRWXG|S_IRWXO);
+        open_fd = open(file_name, O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC, S_IRWXU|S_IRWXG|S_IRWXO);
     }
     else {
-        open_fd = open(file_name.c_str(), O_WRONLY|O_CREAT|O_TRUNC, S_IRWXU|S_IRWXG|S_IRWXO);
+        open_fd = open(file_name, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, S_IRWXU|S_IRWXG|S_IRWXO);
     }
     if (open_fd == -1) {
         perror("smash error: open failed");
-        return;
     }
-    if(length != 0) {
-        if (write(open_fd, buff, length) == -1) {
-            perror("smash error: write failed");
-            return;
-        }
-        if (close(open_fd) == -1) {
-            perror("smash error: close failed");
-        }
+    return open_fd;
+}
+
+void Command::ChangeIO(int isAppend, const char* buff = "", int length = 0) {
+    int flags = (isAppend == 1) ? O_WRONLY|O_CREAT|O_APPEND : O_WRONLY|O_CREAT|O_TRUNC;
+    if(length != 0)
+        Tracer::getInstance().stamp(TRACE_FIRST_BYTE);
+    // open, write and close in one io_uring submission where there is one
+    const char* failed;
+    if (!IoEngine::getInstance().writeFile(file_name, flags, S_IRWXU|S_IRWXG|S_IRWXO, buff, length, &failed)) {
+        std::string message = std::string("smash error: ") + failed + " failed";
+        perror(message.c_str());
     }
 }
 // <---------- END Command ------------>
@@ -567,44 +1158,42 @@ BuiltInCommand::BuiltInCommand(const char* cmd_line) : Command(cmd_line) {}
 
 // <---------- START ExternalCommand ------------>
 ExternalCommand::ExternalCommand(const char* cmd_line, JobsList* jobs) : Command(cmd_line), jobs(jobs) {}
+bool ExternalCommand::prepare() {
+    return redirects.apply(false); // runs in the forked child, nothing to restore
+}
+void ExternalCommand::cleanup() {}
+bool ExternalCommand::isSimpleCommand() {
+    // anything bash would still expand, quote or interpret keeps going through bash -c; globs that
+    // matched nothing are passed on literally, like bash does
+    if (strpbrk(cmd_line_without_const, "$`'\"\\;&|(){}<>~!#") != NULL)
+        return false;
+    if (args_length == 0 || args_length >= COMMAND_MAX_ARGS - 1 || strchr(args[0], '=') != NULL)
+        return false; // no command, args possibly cut at COMMAND_MAX_ARGS, or a VAR=value prefix
+    return true;
+}
 void ExternalCommand::execute() {
-    char file[] = "/bin/bash";
-    char sign[] = "-c";
     _removeBackgroundSign(cmd_line_without_const);
-    char* const argv[] = {file, sign, cmd_line_without_const, NULL};
-    if (IO_status ==2) {
-        int execv_status = execv("/bin/bash", argv);
-        if (execv_status < 0) {
-            perror("smash error: execv failed");
+    SmallShell::getInstance().restoreFdLimit();
+    if (isSimpleCommand()) {
+        char* argv[COMMAND_MAX_ARGS];
+        int argc = 0;
+        for (int i = 0; i < args_length; i++) {
+            if (args[i][0] != 0) // a lone & leaves an empty last argument
+                argv[argc++] = args[i];
         }
+        argv[argc] = NULL;
+        Tracer::getInstance().stamp(TRACE_EXEC);
+        environ = SmallShell::getInstance().getEnvironment()->envp(); // also the PATH execvp searches
+        execvp(argv[0], argv);
+        // not a program (a bash builtin such as `type`, or a typo): let bash run it and report
     }
-    else
-    {
-        int open_fd;
-        if (IO_status == 1) {
-            open_fd = open(file_name.c_str(), O_WRONLY|O_CREAT|O_APPEND, S_IRWXU|S_IRWXG|S_IRWXO);
-            if (open_fd == -1) {
-                perror("smash error: open failed");
-                return;
-            }
-        }
-        else {
-            open_fd = open(file_name.c_str(), O_WRONLY|O_CREAT|O_TRUNC, S_IRWXU|S_IRWXG|S_IRWXO);
-            if (open_fd == -1) {
-                perror("smash error: open failed");
-                return;
-            }
-        }
-        dup2(open_fd, 1);
-        int execv_status = execv("/bin/bash", argv);
-        if (close(open_fd) == -1) {
-            perror("smash error: close failed");
-        }
-        if (execv_status < 0) {
-            perror("smash error: execv failed");
-        }
+    char file[] = "/bin/bash";
+    char sign[] = "-c";
+    char* const argv[] = {file, sign, cmd_line_without_const, NULL};
+    Tracer::getInstance().stamp(TRACE_EXEC);
+    if (execve("/bin/bash", argv, SmallShell::getInstance().getEnvironment()->envp()) < 0) {
+        perror("smash error: execv failed");
     }
-
 }
 // <---------- END ExternalCommand ------------>
 
@@ -625,13 +1214,8 @@ void ShowPidCommand::execute(){
         std::cout << "smash pid is " << smash->getSmashPid() << endl;  // need to check if that is the proper way.
     }
     else {
-        string buff = "smash pid is ";
-        char* spid = (char*) malloc(sizeof((long)getpid()));
-        sprintf(spid, "%ld", (long)getpid());
-        buff.append(spid);
-        buff.append("\n");
-        ChangeIO(IO_status, buff.c_str(), strlen(buff.c_str()));
-        free(spid);
+        char* buff = smash->getArena()->format("smash pid is %ld\n", (long)smash->getSmashPid());
+        ChangeIO(IO_status, buff, strlen(buff));
     }
 }
 // <---------- END ShowPidCommand ------------>
@@ -639,16 +1223,19 @@ void ShowPidCommand::execute(){
 // <---------- START GetCurrDirCommand ------------>
 GetCurrDirCommand::GetCurrDirCommand(const char* cmd_line) : BuiltInCommand(cmd_line) {}
 void GetCurrDirCommand::execute() {
-    char* curr_dir = getcwd(NULL, 0);
+    char curr_dir[PATH_MAX + 1];
+    if (getcwd(curr_dir, PATH_MAX) == NULL) {
+        perror("smash error: getcwd failed");
+        return;
+    }
     if(IO_status == 2) {
         std::cout << curr_dir << endl;
     }
     else {
-        string buff(curr_dir);
-        buff.append("\n");
-        ChangeIO(IO_status, buff.c_str(), strlen(buff.c_str()));
+        size_t length = strlen(curr_dir);
+        curr_dir[length] = '\n';
+        ChangeIO(IO_status, curr_dir, length + 1);
     }
-    free(curr_dir);
 }
 // <---------- END GetCurrDirCommand ------------>
 
@@ -665,27 +1252,22 @@ void ChangeDirCommand::execute(){
                 std::cerr << "smash error: cd: OLDPWD not set" << endl;
             }
             else{
-                char* copy_last_pwd = (char*)malloc(strlen(smash->getLastPwd()) + 1);
-                strcpy(copy_last_pwd, smash->getLastPwd());
-                char* curr_dir = getcwd(NULL, 0);
-                smash->setLastPwd(curr_dir);
-                free(curr_dir);
+                char* copy_last_pwd = smash->getArena()->copy(smash->getLastPwd());
+                char curr_dir[PATH_MAX + 1];
+                smash->setLastPwd(getcwd(curr_dir, PATH_MAX));
                 if(chdir(copy_last_pwd) == -1){
                     perror("smash error: chdir failed");
                     smash->setLastPwd(copy_last_pwd);
                 }
-                free(copy_last_pwd);
             }
         }
         else { // change to arg[1]
             char* copy_last_pwd = NULL;
             if (smash->isLastPwdInitialized()) {
-                copy_last_pwd = (char *) malloc(strlen(smash->getLastPwd()) + 1);
-                strcpy(copy_last_pwd, smash->getLastPwd());
+                copy_last_pwd = smash->getArena()->copy(smash->getLastPwd());
             }
-            char* curr_dir = getcwd(NULL, 0);
-            smash->setLastPwd(curr_dir);
-            free(curr_dir);
+            char curr_dir[PATH_MAX + 1];
+            smash->setLastPwd(getcwd(curr_dir, PATH_MAX));
             if (chdir(args[1]) == -1){
                 perror("smash error: chdir failed");
                 smash->setLastPwd(copy_last_pwd);
@@ -693,7 +1275,6 @@ void ChangeDirCommand::execute(){
             else {
                 smash->changeLastPwdStatus(); // from this point there is last_pwd in the system!!
             }
-            free(copy_last_pwd);
         }
     }
 }
@@ -702,11 +1283,163 @@ void ChangeDirCommand::execute(){
 // <---------- START JobsCommand ------------>
 JobsCommand::JobsCommand(const char* cmd_line, JobsList* jobs) : BuiltInCommand(cmd_line), jobs(jobs) {}
 void JobsCommand::execute() {
+    bool json = (args_length == 2 && strcmp(args[1], "--json") == 0);
+    bool formatted = (args_length >= 3 && strcmp(args[1], "--format") == 0);
+    std::vector<JobFormatPart> format;
+    if (formatted) {
+        // the format may be quoted and hold blanks, it is read from the line rather than from args
+        const char* p = strstr(cmd_line_without_const, "--format") + 8;
+        p += strspn(p, WHITESPACE.c_str());
+        char* word = (char*)SmallShell::getInstance().getArena()->allocate(strlen(p) + 1);
+        readShellWord(&p, word);
+        std::string bad_field;
+        p += strspn(p, WHITESPACE.c_str());
+        if (*p != 0 || !parseJobFormat(word, &format, &bad_field)) {
+            if(IO_status!=2)
+                ChangeIO(IO_status);
+            if (*p != 0)
+                std::cerr << "smash error: jobs: invalid arguments" << endl;
+            else
+                std::cerr << "smash error: jobs: unknown field " << bad_field << endl;
+            return;
+        }
+    }
+    else if (args_length > 2 || (args_length == 2 && !json && strcmp(args[1], "--stats") != 0)) {
+        if(IO_status!=2)
+            ChangeIO(IO_status);
+        std::cerr << "smash error: jobs: invalid arguments" << endl;
+        return;
+    }
     jobs->removeFinishedJobs();
-    jobs->printJobsList(this, IO_status);
+    if (SmallShell::getInstance().isSubreaper())
+        jobs->reapOrphans();
+    if (!json && !formatted) {
+        jobs->printJobsList(this, IO_status, args_length == 2);
+        return;
+    }
+    std::cout.flush();
+    int fd = (IO_status == 2) ? STDOUT_FILENO : openIOFile(IO_status);
+    if (fd == -1)
+        return;
+    {
+        StreamWriter out(fd);
+        jobs->writeJobs(&out, formatted ? &format : NULL);
+    } // flushed here, before the file is closed
+    if (fd != STDOUT_FILENO && close(fd) == -1)
+        perror("smash error: close failed");
 }
 // <---------- END JobsCommand ------------>
 
+// <---------- START LimitCommand ------------>
+LimitCommand::LimitCommand(const char* cmd_line, JobsList* jobs, SmallShell* smash) : BuiltInCommand(cmd_line), jobs(jobs), smash(smash) {}
+void LimitCommand::execute() {
+    JobCgroups* cgroups = smash->getCgroups();
+    if (args_length == 1) { // the launch-time defaults
+        JobLimits* defaults = cgroups->getDefaults();
+        char* buff = smash->getArena()->format("cpu=%s%s mem=%s pids=%s\n",
+                defaults->cpu_percent == -1 ? "max" : std::to_string(defaults->cpu_percent).c_str(),
+                defaults->cpu_percent == -1 ? "" : "%",
+                defaults->mem_bytes == -1 ? "max" : std::to_string(defaults->mem_bytes).c_str(),
+                defaults->pids == -1 ? "max" : std::to_string(defaults->pids).c_str());
+        if (IO_status == 2)
+            std::cout << buff;
+        else
+            ChangeIO(IO_status, buff, strlen(buff));
+        return;
+    }
+    if(IO_status!=2)
+        ChangeIO(IO_status);
+    JobLimits limits;
+    if (args_length < 3 || !parseJobLimits(args + 2, args_length - 2, &limits)) {
+        std::cerr << "smash error: limit: invalid arguments" << endl;
+        return;
+    }
+    if (strcmp(args[1], "default") == 0) {
+        *cgroups->getDefaults() = limits; // jobs launched from now on
+        return;
+    }
+    char* end;
+    long job_id = (args[1][0] == '%') ? strtol(args[1] + 1, &end, 10) : 0;
+    if (job_id <= 0 || *end != 0) {
+        std::cerr << "smash error: limit: invalid arguments" << endl;
+        return;
+    }
+    jobs->removeFinishedJobs();
+    JobEntry* job = jobs->getJobById((int)job_id);
+    if (job == NULL) {
+        std::cerr << "smash error: limit: job-id " << job_id << " does not exist" << endl;
+        return;
+    }
+    cgroups->applyLimits(job->getProcessID(), limits);
+}
+// <---------- END LimitCommand ------------>
+
+// <---------- START OutputCommand ------------>
+OutputCommand::OutputCommand(const char* cmd_line, JobsList* jobs, SmallShell* smash) : BuiltInCommand(cmd_line), jobs(jobs), smash(smash) {}
+void OutputCommand::execute() {
+    char* end;
+    long job_id = ((args_length == 2 || args_length == 3) && args[1][0] == '%') ? strtol(args[1] + 1, &end, 10) : 0;
+    bool follow = (args_length == 3);
+    if (job_id <= 0 || *end != 0 || (follow && strcmp(args[2], "-f") != 0)) {
+        if(IO_status!=2)
+            ChangeIO(IO_status);
+        std::cerr << "smash error: output: invalid arguments" << endl;
+        return;
+    }
+    OutputCapture* captures = smash->getCaptures();
+    jobs->removeFinishedJobs(); // drains what a job that just exited left in its pipe
+    captures->drainReady(0);
+    if (captures->find((int)job_id) == NULL) {
+        if(IO_status!=2)
+            ChangeIO(IO_status);
+        if (jobs->getJobById((int)job_id) != NULL)
+            std::cerr << "smash error: output: job-id " << job_id << " is not captured" << endl;
+        else
+            std::cerr << "smash error: output: job-id " << job_id << " does not exist" << endl;
+        return;
+    }
+    std::cout.flush();
+    int fd = (IO_status == 2) ? STDOUT_FILENO : openIOFile(IO_status);
+    if (fd == -1)
+        return;
+    Tracer::getInstance().stamp(TRACE_FIRST_BYTE);
+    uint64_t shown = captures->find((int)job_id)->writeTo(fd, 0);
+    if (follow) {
+        smash->takeCtrlC(); // only a ctrl-C typed from now on stops following
+        OutputRing* ring;
+        while ((ring = captures->find((int)job_id)) != NULL && ring->isOpen() && !smash->takeCtrlC()) {
+            shown = captures->relay((int)job_id, fd, shown);
+            smash->handleSignals(); // relay returns early on a signal, an alarm among them
+        }
+    }
+    if (fd != STDOUT_FILENO && close(fd) == -1)
+        perror("smash error: close failed");
+}
+// <---------- END OutputCommand ------------>
+
+// <---------- START ReniceCommand ------------>
+ReniceCommand::ReniceCommand(const char* cmd_line, JobsList* jobs) : BuiltInCommand(cmd_line), jobs(jobs) {}
+void ReniceCommand::execute() {
+    if(IO_status!=2)
+        ChangeIO(IO_status);
+    char* end;
+    long job_id = (args_length == 3 && args[1][0] == '%') ? strtol(args[1] + 1, &end, 10) : 0;
+    int nice;
+    if (job_id <= 0 || *end != 0 || !parseNice(args[2], &nice)) {
+        std::cerr << "smash error: renice: invalid arguments" << endl;
+        return;
+    }
+    jobs->removeFinishedJobs();
+    JobEntry* job = jobs->getJobById((int)job_id);
+    if (job == NULL) {
+        std::cerr << "smash error: renice: job-id " << job_id << " does not exist" << endl;
+        return;
+    }
+    // the whole process group: a pipeline or a script's children are reniced along with the leader
+    reniceGroup(job->getProcessID(), nice);
+}
+// <---------- END ReniceCommand ------------>
+
 // <---------- START KillCommand ------------>
 KillCommand::KillCommand(const char* cmd_line, JobsList* jobs): BuiltInCommand(cmd_line), jobs(jobs) {}
 void KillCommand::execute() {
@@ -727,24 +1460,21 @@ void KillCommand::execute() {
         }
         else
         {
-            if (kill(job_to_send_signal->getProcessID(), abs(atoi(args[1]))) != -1) {
+            bool tree_killed = (abs(atoi(args[1])) == SIGKILL &&
+                                SmallShell::getInstance().getCgroups()->killAll(job_to_send_signal->getProcessID()));
+            if (tree_killed || job_to_send_signal->sendSignal(abs(atoi(args[1]))) != -1) {
+                int sig = abs(atoi(args[1]));
+                if (sig == SIGSTOP || sig == SIGTSTP || sig == SIGTTIN || sig == SIGTTOU || sig == SIGCONT) {
+                    jobs->setStopped(job_to_send_signal, sig != SIGCONT); // `quit kill` must know to wake it up
+                }
                 if(IO_status == 2) {
                     std::cout << "signal number " << abs(atoi(args[1])) << " was sent to pid "
                               << job_to_send_signal->getProcessID() << endl;
                 }
                 else {
-                    string buff("signal number ");
-                    char* s_signal = (char*) malloc(sizeof(abs(atoi(args[1]))));
-                    sprintf(s_signal, "%d", abs(atoi(args[1])));
-                    buff.append(s_signal);
-                    buff.append(" was sent to pid ");
-                    char* spid = (char*) malloc(sizeof((long)job_to_send_signal->getProcessID()));
-                    sprintf(spid, "%ld", (long)job_to_send_signal->getProcessID());
-                    buff.append(spid);
-                    buff.append("\n");
-                    ChangeIO(IO_status, buff.c_str(), strlen(buff.c_str()));
-                    free(s_signal);
-                    free(spid);
+                    char* buff = SmallShell::getInstance().getArena()->format("signal number %d was sent to pid %ld\n",
+                            abs(atoi(args[1])), (long)job_to_send_signal->getProcessID());
+                    ChangeIO(IO_status, buff, strlen(buff));
                 }
             }
             else {
@@ -838,96 +1568,792 @@ void QuitCommand::execute() {
     jobs->removeFinishedJobs();
     char sign[] = "kill";
     if (args[1] != NULL && strcmp(args[1], sign) == 0) {
-        jobs->killAllJobs(this);
+        jobs->killAllJobs(this, SmallShell::getInstance().getKillTimeout());
     }
-    delete this; //delete command
-    exit(0);
+    exit(0); // the command itself lives in the line arena, nothing to delete
+
 }
 // <---------- END QuitCommand ------------>
 
-// <---------- START HeadCommand ------------>
-HeadCommand::HeadCommand(const char* cmd_line, JobsList* jobs) : BuiltInCommand(cmd_line), jobs(jobs) {}
-void HeadCommand::execute() {
-    if(args_length < 2) {
-        if(IO_status!=2)
-            ChangeIO(IO_status);
-        std::cerr << "smash error: head: not enough arguments" << endl;
-        return;
-    }
-    else {
-        int line_numbers;
-        int open_fd;
-        if(args_length == 2) {
-            line_numbers = 10; // default value.
-            open_fd = open(args[1], O_RDONLY, 0666);
+// <---------- START WaitCommand ------------>
+WaitCommand::WaitCommand(const char* cmd_line, JobsList* jobs, SmallShell* smash) : BuiltInCommand(cmd_line), jobs(jobs), smash(smash) {}
+void WaitCommand::execute() {
+    if(IO_status!=2)
+        ChangeIO(IO_status);
+    jobs->removeFinishedJobs();
+    bool any = (args_length > 1 && strcmp(args[1], "-n") == 0);
+    int first_target = any ? 2 : 1;
+    std::vector<pid_t> pids;
+    int exit_code = 0;
+    bool found_finished = false;
+    for (int i = first_target; i < args_length; i++) {
+        char* end;
+        bool is_job_id = (args[i][0] == '%');
+        long id = strtol(args[i] + (is_job_id ? 1 : 0), &end, 10);
+        if (*end != 0 || id <= 0) {
+            std::cerr << "smash error: wait: invalid arguments" << endl;
+            return;
         }
-        else {
-            line_numbers = abs(atoi(args[1]));
-            open_fd = open(args[2], O_RDONLY, 0666);
+        if (any && found_finished)
+            continue; // `wait -n` returns with the first finished job, the others stay for the next wait
+        JobEntry* job = is_job_id ? jobs->getJobById((int)id) : jobs->getJobByProcessId((pid_t)id);
+        if (job != NULL) {
+            pids.push_back(job->getProcessID());
         }
-        if (open_fd == -1) {
-            if(IO_status!=2)
-                ChangeIO(IO_status);
-            perror("smash error: open failed");
-            return;
+        else if (jobs->takeFinished(is_job_id ? (int)id : -1, (pid_t)id, &exit_code)) {
+            found_finished = true; // finished before we got here, its status is still known
         }
-        if (line_numbers == 0) {
-            if(IO_status!=2)
-                ChangeIO(IO_status);
-            return; // stop if we should not print any lines
-        }
-        int size = 3000;
-        char* buff = (char*) malloc(size);
-        double lines = 0;
-        int i =0;
-        int round = 1;
-        int status = read(open_fd, &buff[i], 1);
-        if(status == -1) {
-            if(IO_status!=2)
-                ChangeIO(IO_status);
-            perror("smash error: read failed");
+        else if (is_job_id) {
+            std::cerr << "smash error: wait: job-id " << id << " does not exist" << endl;
+            exit_code = 127;
+        }
+        else {
+            std::cerr << "smash error: wait: pid " << id << " is not a child of this shell" << endl;
+            exit_code = 127;
         }
-        if(buff[i] == '\n') {
-            lines = lines + 1;
+    }
+    if (args_length == first_target) { // every running job
+        for (std::vector<JobEntry>::iterator it = jobs->getJobsVec()->begin(); it != jobs->getJobsVec()->end(); it++) {
+            if (!it->isStoppedProcess())
+                pids.push_back(it->getProcessID());
         }
-        while(status == 1) {
-            i++;
-            if(i/round == size) {
-                round = round +1;
-                buff = (char*)realloc(buff, size*round); // they said almost no limitations on line length (MAX_INT) so array won't work.
+    }
+    if (!pids.empty() && !(any && found_finished)) {
+        if (jobs->waitJobs(&pids, any, &exit_code) == -1)
+            exit_code = 128 + SIGINT;
+    }
+    if (args_length == first_target && !any)
+        exit_code = 0; // a plain `wait` succeeds whatever the jobs returned, like bash
+    if (exit_code == JOBS_EXIT_UNKNOWN) { // a re-adopted job: no status rather than a made-up 127
+        std::cerr << "smash: wait: exit status unknown, the job was re-adopted from a state file" << endl;
+        return;
+    }
+    smash->setLastStatus(exit_code);
+}
+// <---------- END WaitCommand ------------>
+
+// <---------- START HeadCommand ------------>
+// The command's stdout: the terminal, or its redirection target, opened with the first bytes
+// so that the open and the first write go in one submission.
+class _HeadOutput : public HeadSink {
+    IoEngine* engine;
+    int IO_status;
+    const char* file_name;
+    IoFile out;
+    bool failed; // reported once, later heads are dropped
+public:
+    bool open;
+    _HeadOutput(IoEngine* engine, int IO_status, const char* file_name) : engine(engine), IO_status(IO_status),
+        file_name(file_name), failed(false), open(IO_status == 2) {
+        out.fd = (IO_status == 2) ? STDOUT_FILENO : -1;
+        out.slot = -1;
+    }
+    bool put(const char* data, size_t length) override {
+        if (failed)
+            return false;
+        if (!open) {
+            Tracer::getInstance().stamp(TRACE_FIRST_BYTE);
+            int flags = (IO_status == 1) ? O_WRONLY|O_CREAT|O_APPEND : O_WRONLY|O_CREAT|O_TRUNC;
+            const char* step;
+            open = true;
+            if (!engine->openWrite(file_name, flags, S_IRWXU|S_IRWXG|S_IRWXO, data, length, &out, &step)) {
+                std::string message = std::string("smash error: ") + step + " failed";
+                perror(message.c_str());
+                failed = true;
             }
-            status = read(open_fd, &buff[i], 1);
-            if(status == -1) {
-                if(IO_status!=2)
-                    ChangeIO(IO_status);
-                perror("smash error: read failed");
-                free(buff);
-                return;
+        }
+        else if (!engine->write(&out, data, length)) {
+            perror("smash error: write failed");
+            failed = true;
+        }
+        return !failed;
+    }
+    void close() {
+        if (IO_status != 2)
+            engine->close(&out);
+        engine->flush();
+    }
+};
+
+HeadCommand::HeadCommand(const char* cmd_line, JobsList* jobs) : BuiltInCommand(cmd_line), jobs(jobs) {}
+void HeadCommand::execute() {
+    std::vector<const char*> words;
+    _lineWords(cmd_line_without_const, &words);
+    std::vector<const char*> paths;
+    long line_numbers = 10; // the default
+    int threads = 1;
+    bool options = true;
+    bool bad_option = false;
+    for (size_t i = 0; i < words.size() && !bad_option; i++) {
+        const char* word = words[i];
+        if (options && strcmp(word, "--") == 0) {
+            options = false;
+        }
+        else if (options && (strcmp(word, "-P") == 0 || strcmp(word, "-n") == 0)) {
+            const char* value = (i + 1 < words.size()) ? words[++i] : "";
+            char* end;
+            long number = strtol(value, &end, 10);
+            if (*value == 0 || *end != 0 || number < 0) {
+                bad_option = true;
             }
-            if(buff[i] == '\n' || buff[i] == 0x0) {
-                lines = lines + 1;
+            else if (word[1] == 'n') {
+                line_numbers = number;
             }
-            if(lines == line_numbers) {
-                break;
+            else {
+                // -P 0: one thread per CPU
+                threads = (number == 0) ? (int)sysconf(_SC_NPROCESSORS_ONLN) : (int)std::min(number, (long)HEAD_THREADS_MAX);
+                threads = std::max(threads, 1);
             }
         }
-        if(IO_status == 2) {
-            buff = (char*)realloc(buff, i+2);
-            write(STDOUT_FILENO,buff, strlen(buff));
+        else if (options && word[0] == '-' && word[1] != 0) {
+            line_numbers = labs(atol(word + 1));
         }
         else {
-            buff = (char*)realloc(buff, i+2);
-            ChangeIO(IO_status, buff, strlen(buff));
+            paths.push_back(word);
         }
-        if(close(open_fd) == -1)
-            perror("smash error: close failed");
-        free(buff);
     }
+    if (bad_option || paths.empty()) {
+        if(IO_status!=2)
+            ChangeIO(IO_status);
+        std::cerr << (bad_option ? "smash error: head: invalid arguments" : "smash error: head: not enough arguments") << endl;
+        return;
+    }
+    IoEngine& engine = IoEngine::getInstance();
+    _HeadOutput output(&engine, IO_status, file_name);
+    if (output.open)
+        Tracer::getInstance().stamp(TRACE_FIRST_BYTE);
+    headFiles(paths, line_numbers, threads, &output);
+    if (!output.open)
+        ChangeIO(IO_status); // nothing to show, the target is still created or truncated
+    output.close();
 }
 // <---------- END HeadCommand ------------>
 
+// <---------- START CatCommand ------------>
+static bool copy_interrupted; // a ctrl-C or ctrl-Z reached the shell during the current cat or tee
+
+static bool _copyInterrupted() {
+    SmallShell& smash = SmallShell::getInstance();
+    if (smash.takeCtrlC() || smash.takeStopCopy())
+        copy_interrupted = true;
+    return copy_interrupted;
+}
+
+// cat and tee run in the shell only for what they implement: a line with an option they do not
+// know (cat -n, tee -i, --help ..) or a trailing & goes to the real program.
+static bool _streamBuiltinFits(const char* cmd_line, bool is_tee) {
+    if (_isBackgroundComamnd(cmd_line))
+        return false;
+    Redirections redirects;
+    std::vector<const char*> words;
+    _lineWords(redirects.parse(cmd_line, SmallShell::getInstance().getArena()), &words);
+    for (size_t i = 0; i < words.size(); i++) {
+        if (is_tee && strcmp(words[i], "--") == 0)
+            return true; // file names only from here on
+        if (words[i][0] == '-' && words[i][1] != 0 && !(is_tee && strcmp(words[i], "-a") == 0))
+            return false;
+    }
+    return true;
+}
+
+static bool _catFits(const char* cmd_line) {
+    return _streamBuiltinFits(cmd_line, false);
+}
+
+CatCommand::CatCommand(const char* cmd_line) : BuiltInCommand(cmd_line) {}
+void CatCommand::execute() {
+    std::vector<const char*> paths;
+    _lineWords(cmd_line_without_const, &paths);
+    if (paths.empty())
+        paths.push_back("-"); // stdin, as redirected or piped in
+    int out = (IO_status == 2) ? STDOUT_FILENO : openIOFile(IO_status);
+    if (out == -1)
+        return;
+    Tracer::getInstance().stamp(TRACE_FIRST_BYTE);
+    SmallShell::getInstance().takeCtrlC(); // only a ctrl-C or ctrl-Z typed from now on stops the copy
+    SmallShell::getInstance().takeStopCopy();
+    copy_interrupted = false;
+    for (size_t i = 0; i < paths.size() && !copy_interrupted; i++) {
+        bool from_stdin = (strcmp(paths[i], "-") == 0);
+        int in = from_stdin ? STDIN_FILENO : open(paths[i], O_RDONLY|O_CLOEXEC);
+        if (in == -1) {
+            perror("smash error: open failed");
+            continue;
+        }
+        copyFd(in, out, _copyInterrupted); // a file that fails is reported, the next ones still go out
+        if (!from_stdin)
+            close(in);
+    }
+    if (out != STDOUT_FILENO)
+        close(out);
+}
+// <---------- END CatCommand ------------>
+
+// <---------- START TeeCommand ------------>
+static bool _teeFits(const char* cmd_line) {
+    return _streamBuiltinFits(cmd_line, true);
+}
+
+TeeCommand::TeeCommand(const char* cmd_line) : BuiltInCommand(cmd_line) {}
+void TeeCommand::execute() {
+    std::vector<const char*> words;
+    _lineWords(cmd_line_without_const, &words);
+    std::vector<const char*> paths;
+    bool append = false;
+    bool options = true;
+    for (size_t i = 0; i < words.size(); i++) {
+        if (options && strcmp(words[i], "-a") == 0)
+            append = true;
+        else if (options && strcmp(words[i], "--") == 0)
+            options = false;
+        else
+            paths.push_back(words[i]);
+    }
+    std::vector<int> outs;
+    int flags = O_WRONLY|O_CREAT|O_CLOEXEC|(append ? O_APPEND : O_TRUNC);
+    for (size_t i = 0; i < paths.size(); i++) {
+        int fd = open(paths[i], flags, S_IRWXU|S_IRWXG|S_IRWXO);
+        if (fd == -1)
+            perror("smash error: open failed"); // the other outputs still get the data
+        else
+            outs.push_back(fd);
+    }
+    // stdout last: it takes the data itself, the files get the tee(2) duplicates
+    int out = (IO_status == 2) ? STDOUT_FILENO : openIOFile(IO_status);
+    if (out != -1)
+        outs.push_back(out);
+    Tracer::getInstance().stamp(TRACE_FIRST_BYTE);
+    SmallShell::getInstance().takeCtrlC(); // only a ctrl-C or ctrl-Z typed from now on stops the copy
+    SmallShell::getInstance().takeStopCopy();
+    copy_interrupted = false;
+    teeFds(STDIN_FILENO, outs, _copyInterrupted);
+    for (size_t i = 0; i < outs.size(); i++) {
+        if (outs[i] != STDOUT_FILENO)
+            close(outs[i]);
+    }
+}
+// <---------- END TeeCommand ------------>
+
+// <---------- START TraceCommand ------------>
+TraceCommand::TraceCommand(const char* cmd_line) : BuiltInCommand(cmd_line) {}
+void TraceCommand::execute() {
+    Tracer& tracer = Tracer::getInstance();
+    if (args_length == 2 && strcmp(args[1], "on") == 0) {
+        tracer.setEnabled(true);
+    }
+    else if (args_length == 2 && strcmp(args[1], "off") == 0) {
+        tracer.setEnabled(false);
+    }
+    else if (args_length == 2 && strcmp(args[1], "clear") == 0) {
+        tracer.clear();
+    }
+    else if ((args_length == 2 || args_length == 3) && strcmp(args[1], "dump") == 0 &&
+             (args_length == 2 || strcmp(args[2], "json") == 0 || strcmp(args[2], "csv") == 0)) {
+        bool csv = (args_length == 3 && strcmp(args[2], "csv") == 0);
+        if (IO_status == 2) {
+            std::cout.flush();
+            tracer.dump(STDOUT_FILENO, csv);
+        }
+        else {
+            int open_fd = openIOFile(IO_status);
+            if (open_fd == -1)
+                return;
+            tracer.dump(open_fd, csv);
+            if (close(open_fd) == -1)
+                perror("smash error: close failed");
+        }
+        return;
+    }
+    else {
+        if(IO_status!=2)
+            ChangeIO(IO_status);
+        std::cerr << "smash error: trace: invalid arguments" << endl;
+    }
+}
+// <---------- END TraceCommand ------------>
+
+// <---------- START FdsCommand ------------>
+FdsCommand::FdsCommand(const char* cmd_line) : BuiltInCommand(cmd_line) {}
+void FdsCommand::execute() {
+    DIR* dir = opendir("/proc/self/fd");
+    if (dir == NULL) {
+        if(IO_status!=2)
+            ChangeIO(IO_status);
+        perror("smash error: opendir failed");
+        return;
+    }
+    std::vector<int> fds;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] != '.' && atoi(entry->d_name) != dirfd(dir))
+            fds.push_back(atoi(entry->d_name));
+    }
+    std::sort(fds.begin(), fds.end());
+    std::string out;
+    Arena* arena = SmallShell::getInstance().getArena();
+    for (size_t i = 0; i < fds.size(); i++) {
+        char target[PATH_MAX + 1];
+        ssize_t length = readlink(arena->format("/proc/self/fd/%d", fds[i]), target, PATH_MAX);
+        target[length < 0 ? 0 : length] = 0;
+        int flags = fcntl(fds[i], F_GETFD);
+        out += arena->format("%d %s%s\n", fds[i], target, (flags != -1 && (flags & FD_CLOEXEC)) ? " (cloexec)" : "");
+    }
+    if (closedir(dir) == -1)
+        perror("smash error: closedir failed");
+    if (IO_status == 2) {
+        std::cout << out;
+    }
+    else {
+        ChangeIO(IO_status, out.c_str(), out.size());
+    }
+}
+// <---------- END FdsCommand ------------>
+
+// <---------- START SetCommand ------------>
+// Accepts a byte count with an optional K/M/G (binary) suffix.
+bool _parseSize(const char* str, size_t* size) {
+    char* end;
+    errno = 0;
+    unsigned long long value = strtoull(str, &end, 10);
+    if (end == str || errno != 0 || *str == '-')
+        return false;
+    if (*end == 'K' || *end == 'k')
+        value <<= 10;
+    else if (*end == 'M' || *end == 'm')
+        value <<= 20;
+    else if (*end == 'G' || *end == 'g')
+        value <<= 30;
+    else if (*end != 0)
+        return false;
+    if (*end != 0 && end[1] != 0)
+        return false;
+    *size = (size_t)value;
+    return value <= INT_MAX; // F_SETPIPE_SZ takes an int
+}
+
+// N, Nms, Ns, Nm or Nh; a bare number is seconds, like sleep(1)
+bool _parseDuration(const char* str, long* duration_ms) {
+    char* end;
+    errno = 0;
+    long value = strtol(str, &end, 10);
+    if (end == str || errno != 0 || value < 0)
+        return false;
+    long unit;
+    if (strcmp(end, "ms") == 0)
+        unit = 1;
+    else if (*end == 0 || strcmp(end, "s") == 0)
+        unit = 1000;
+    else if (strcmp(end, "m") == 0)
+        unit = 60 * 1000;
+    else if (strcmp(end, "h") == 0)
+        unit = 60 * 60 * 1000;
+    else
+        return false;
+    if (value > LONG_MAX / unit)
+        return false;
+    *duration_ms = value * unit;
+    return true;
+}
+
+SetCommand::SetCommand(const char* cmd_line, SmallShell* smash) : BuiltInCommand(cmd_line), smash(smash) {}
+void SetCommand::execute() {
+    if (args_length == 1) {
+        JobCgroups* cgroups = smash->getCgroups();
+        LaunchOptions* background = smash->getBackgroundLaunch();
+        char* buff = smash->getArena()->format(
+                "pipesize %zu\npipemode %s\nglobcache %s\nkilltimeout %ldms\nsubreaper %s\ncgroup %s\nbgnice %s\nbgbatch %s\ncapture %s\ncontrol %s\n"
+                "ioengine %s\n",
+                smash->getPipeSize(), smash->isPipePacketMode() ? "packet" : "stream",
+                smash->getWildcards()->isCacheEnabled() ? "on" : "off", smash->getKillTimeout(),
+                smash->isSubreaper() ? "on" : "off", cgroups->isEnabled() ? cgroups->getBase().c_str() : "off",
+                background->nice == LAUNCH_NICE_UNSET ? "off" : std::to_string(background->nice).c_str(),
+                background->policy == SCHED_BATCH ? "on" : "off",
+                smash->getCaptures()->getRingSize() == 0 ? "off" : std::to_string(smash->getCaptures()->getRingSize()).c_str(),
+                smash->getControl()->isEnabled() ? smash->getControl()->getPath().c_str() : "off",
+                IoEngine::getInstance().usesUring() ? "uring" : "sync");
+        if (IO_status == 2)
+            std::cout << buff;
+        else
+            ChangeIO(IO_status, buff, strlen(buff));
+        return;
+    }
+    if(IO_status!=2)
+        ChangeIO(IO_status);
+    size_t size;
+    long duration_ms;
+    int nice;
+    if (args_length == 3 && strcmp(args[1], "pipesize") == 0 && _parseSize(args[2], &size)) {
+        smash->setPipeSize(size); // 0 restores the kernel default
+    }
+    else if (args_length == 3 && strcmp(args[1], "pipemode") == 0 &&
+             (strcmp(args[2], "stream") == 0 || strcmp(args[2], "packet") == 0)) {
+        smash->setPipePacketMode(strcmp(args[2], "packet") == 0);
+    }
+    else if (args_length == 3 && strcmp(args[1], "ioengine") == 0 &&
+             (strcmp(args[2], "uring") == 0 || strcmp(args[2], "sync") == 0)) {
+        // uring falls back to sync by itself where io_uring is missing, `set` shows which one is used
+        IoEngine::setUringAllowed(strcmp(args[2], "uring") == 0);
+    }
+    else if (args_length == 3 && strcmp(args[1], "globcache") == 0 &&
+             (strcmp(args[2], "on") == 0 || strcmp(args[2], "off") == 0)) {
+        smash->getWildcards()->setCacheEnabled(strcmp(args[2], "on") == 0);
+    }
+    else if (args_length == 3 && strcmp(args[1], "killtimeout") == 0 && _parseDuration(args[2], &duration_ms)) {
+        smash->setKillTimeout(duration_ms);
+    }
+    else if (args_length == 3 && strcmp(args[1], "subreaper") == 0 &&
+             (strcmp(args[2], "on") == 0 || strcmp(args[2], "off") == 0)) {
+        smash->setSubreaper(strcmp(args[2], "on") == 0);
+    }
+    else if (args_length == 3 && strcmp(args[1], "cgroup") == 0) {
+        if (strcmp(args[2], "off") == 0)
+            smash->getCgroups()->disable();
+        else if (!smash->getCgroups()->enable(args[2])) { // enable said why
+            smash->getCgroups()->disable(); // not the previous subtree either, jobs go without cgroups
+            std::cerr << "smash error: set: cgroup " << args[2] << " could not be enabled, cgroups are off" << endl;
+        }
+    }
+    else if (args_length == 3 && strcmp(args[1], "bgnice") == 0 &&
+             (strcmp(args[2], "off") == 0 || parseNice(args[2], &nice))) {
+        smash->getBackgroundLaunch()->nice = (strcmp(args[2], "off") == 0) ? LAUNCH_NICE_UNSET : nice;
+    }
+    else if (args_length == 3 && strcmp(args[1], "bgbatch") == 0 &&
+             (strcmp(args[2], "on") == 0 || strcmp(args[2], "off") == 0)) {
+        smash->getBackgroundLaunch()->policy = (strcmp(args[2], "on") == 0) ? SCHED_BATCH : -1;
+    }
+    else if (args_length == 3 && strcmp(args[1], "capture") == 0 &&
+             (strcmp(args[2], "on") == 0 || strcmp(args[2], "off") == 0 || _parseSize(args[2], &size))) {
+        smash->getCaptures()->setRingSize(strcmp(args[2], "on") == 0 ? CAPTURE_RING_DEFAULT :
+                                          strcmp(args[2], "off") == 0 ? 0 : size); // 0 turns it off too
+    }
+    else if (args_length == 3 && strcmp(args[1], "control") == 0) {
+        if (strcmp(args[2], "off") == 0)
+            smash->getControl()->close();
+        else
+            smash->getControl()->listen(args[2]);
+    }
+    else {
+        std::cerr << "smash error: set: invalid arguments" << endl;
+    }
+}
+// <---------- END SetCommand ------------>
+
+// <---------- START EveryCommand ------------>
+// The command after the builtin's own words, as typed: its own redirections, quotes and
+// variables are applied each time it runs, not when it is scheduled.
+static std::string _scheduledPart(const char* cmd_line, int words) {
+    const char* p = cmd_line;
+    for (int word = 0; word < words; word++) {
+        while (_isWhitespace(*p))
+            p++;
+        while (*p != 0 && !_isWhitespace(*p))
+            p++;
+    }
+    while (_isWhitespace(*p))
+        p++;
+    std::string part(p);
+    while (!part.empty() && (_isWhitespace(part.back()) || part.back() == '&'))
+        part.erase(part.size() - 1);
+    return part;
+}
+
+static void _listSchedules(Command* cmd, CommandScheduler* scheduler) {
+    std::vector<Schedule> schedules = scheduler->list();
+    int64_t now = CommandScheduler::nowMs();
+    std::string out;
+    for (size_t i = 0; i < schedules.size(); i++) {
+        const Schedule& schedule = schedules[i];
+        long next = (long)std::max<int64_t>(schedule.next_ms - now, 0);
+        if (schedule.interval_ms > 0) {
+            out += SmallShell::getInstance().getArena()->format("[%d] every %ldms (next in %ldms, %u runs, %u skipped): ",
+                    schedule.id, schedule.interval_ms, next, schedule.runs, schedule.skipped);
+        }
+        else {
+            out += SmallShell::getInstance().getArena()->format("[%d] after (in %ldms): ", schedule.id, next);
+        }
+        out += schedule.cmd_line;
+        out += '\n';
+    }
+    if (cmd->getIOStatus() == 2)
+        std::cout << out;
+    else
+        cmd->ChangeIO(cmd->getIOStatus(), out.c_str(), out.size());
+}
+
+// every/after DURATION cmd; without arguments both list what is scheduled
+static void _schedule(Command* cmd, const char* name, char** args, int args_length, bool recurring, SmallShell* smash) {
+    CommandScheduler* scheduler = smash->getScheduler();
+    if (args_length == 1) {
+        _listSchedules(cmd, scheduler);
+        return;
+    }
+    long duration_ms;
+    std::string scheduled = _scheduledPart(cmd->getCmdLine(), 2);
+    if (!_parseDuration(args[1], &duration_ms) || (recurring && duration_ms == 0) || scheduled.empty()) {
+        std::cerr << "smash error: " << name << ": invalid arguments" << endl;
+        return;
+    }
+    int id = scheduler->add(duration_ms, recurring ? duration_ms : 0, scheduled);
+    if (id != -1)
+        std::cout << "[" << id << "] " << name << " " << duration_ms << "ms: " << scheduled << endl;
+}
+
+EveryCommand::EveryCommand(const char* cmd_line, SmallShell* smash) : BuiltInCommand(cmd_line), smash(smash) {}
+bool EveryCommand::prepare() {
+    return true;
+}
+void EveryCommand::cleanup() {}
+void EveryCommand::execute() {
+    _schedule(this, "every", args, args_length, true, smash);
+}
+// <---------- END EveryCommand ------------>
+
+// <---------- START AfterCommand ------------>
+AfterCommand::AfterCommand(const char* cmd_line, SmallShell* smash) : BuiltInCommand(cmd_line), smash(smash) {}
+bool AfterCommand::prepare() {
+    return true;
+}
+void AfterCommand::cleanup() {}
+void AfterCommand::execute() {
+    if (args_length < 2 || args[1][0] != '%') {
+        _schedule(this, "after", args, args_length, false, smash);
+        return;
+    }
+    // after %N [%M..] cmd: a job that runs once all of them finished, whatever their exit codes
+    JobsList* jobs = smash->getJobsList();
+    jobs->removeFinishedJobs();
+    std::vector<int> after;
+    int exit_code = 0;
+    int words = 1;
+    for (; words < args_length && args[words][0] == '%'; words++) {
+        char* end;
+        long job_id = strtol(args[words] + 1, &end, 10);
+        int finished_code;
+        if (job_id <= 0 || *end != 0) {
+            std::cerr << "smash error: after: invalid arguments" << endl;
+            return;
+        }
+        if (jobs->getJobById((int)job_id) != NULL || smash->getJobGraph()->find((int)job_id) != NULL) {
+            after.push_back((int)job_id);
+        }
+        else if (jobs->peekFinished((int)job_id, &finished_code)) { // exited before `after` was typed
+            if (exit_code == 0)
+                exit_code = finished_code;
+        }
+        else {
+            std::cerr << "smash error: after: job-id " << job_id << " does not exist" << endl;
+            return;
+        }
+    }
+    std::string line = _scheduledPart(cmd_line, words);
+    if (line.empty()) {
+        std::cerr << "smash error: after: invalid arguments" << endl;
+        return;
+    }
+    smash->startChain(after, exit_code, line.c_str(), true);
+}
+// <---------- END AfterCommand ------------>
+
+// <---------- START CancelCommand ------------>
+CancelCommand::CancelCommand(const char* cmd_line, SmallShell* smash) : BuiltInCommand(cmd_line), smash(smash) {}
+void CancelCommand::execute() {
+    if(IO_status!=2)
+        ChangeIO(IO_status);
+    char* end;
+    bool is_job = (args_length == 2 && args[1][0] == '%');
+    long id = (args_length == 2) ? strtol(args[1] + (is_job ? 1 : 0), &end, 10) : 0;
+    if (id <= 0 || *end != 0) {
+        std::cerr << "smash error: cancel: invalid arguments" << endl;
+        return;
+    }
+    if (is_job) { // cancel %N: a job that waits on others, with whatever waits on it in turn
+        if (!smash->getJobGraph()->cancel((int)id))
+            std::cerr << "smash error: cancel: job-id " << id << " is not waiting" << endl;
+        return;
+    }
+    // a run that already started is a job like any other, cancel only stops the next ones
+    if (!smash->getScheduler()->cancel((int)id))
+        std::cerr << "smash error: cancel: schedule " << id << " does not exist" << endl;
+}
+// <---------- END CancelCommand ------------>
+
+// <---------- START ExportCommand ------------>
+ExportCommand::ExportCommand(const char* cmd_line, SmallShell* smash) : BuiltInCommand(cmd_line), smash(smash) {}
+void ExportCommand::execute() {
+    Environment* environment = smash->getEnvironment();
+    if (args_length == 1) {
+        std::string out;
+        for (const auto& var : *environment->getVars())
+            out += "export " + var.first + "=\"" + var.second + "\"\n";
+        if (IO_status == 2)
+            std::cout << out;
+        else
+            ChangeIO(IO_status, out.c_str(), out.size());
+        return;
+    }
+    if(IO_status!=2)
+        ChangeIO(IO_status);
+    // NAME=value words may be quoted, so they are read from the line rather than from args
+    const char* p = cmd_line_without_const + strspn(cmd_line_without_const, WHITESPACE.c_str());
+    p += strcspn(p, WHITESPACE.c_str());
+    char* word = (char*)smash->getArena()->allocate(strlen(p) + 1);
+    for (;;) {
+        p += strspn(p, WHITESPACE.c_str());
+        if (*p == 0)
+            break;
+        size_t length = readShellWord(&p, word);
+        if (length == 0) { // a redirection character left in the line, nothing to export
+            p++;
+            continue;
+        }
+        char* equal_sign = strchr(word, '=');
+        size_t name_length = (equal_sign != NULL) ? (size_t)(equal_sign - word) : length;
+        if (!Environment::isValidName(word, name_length)) {
+            std::cerr << "smash error: export: invalid arguments" << endl;
+            continue;
+        }
+        if (equal_sign != NULL) // `export NAME` alone: smash has no unexported variables to promote
+            environment->set(std::string(word, name_length), std::string(equal_sign + 1));
+    }
+}
+// <---------- END ExportCommand ------------>
+
+// <---------- START UnsetCommand ------------>
+UnsetCommand::UnsetCommand(const char* cmd_line, SmallShell* smash) : BuiltInCommand(cmd_line), smash(smash) {}
+void UnsetCommand::execute() {
+    if(IO_status!=2)
+        ChangeIO(IO_status);
+    for (int i = 1; i < args_length; i++) {
+        if (!Environment::isValidName(args[i], strlen(args[i])))
+            std::cerr << "smash error: unset: invalid arguments" << endl;
+        else
+            smash->getEnvironment()->unset(args[i]); // unsetting an unknown name is not an error
+    }
+}
+// <---------- END UnsetCommand ------------>
+
+// <---------- START EnvCommand ------------>
+EnvCommand::EnvCommand(const char* cmd_line, SmallShell* smash) : BuiltInCommand(cmd_line), smash(smash) {}
+void EnvCommand::execute() {
+    if (args_length > 1) {
+        if(IO_status!=2)
+            ChangeIO(IO_status);
+        std::cerr << "smash error: env: invalid arguments" << endl;
+        return;
+    }
+    std::string out;
+    for (char** var = smash->getEnvironment()->envp(); *var != NULL; var++) {
+        out += *var;
+        out += '\n';
+    }
+    if (IO_status == 2)
+        std::cout << out;
+    else
+        ChangeIO(IO_status, out.c_str(), out.size());
+}
+// <---------- END EnvCommand ------------>
+
+// <---------- START AliasCommand ------------>
+AliasCommand::AliasCommand(const char* cmd_line, SmallShell* smash) : BuiltInCommand(cmd_line), smash(smash) {}
+void AliasCommand::execute() {
+    if (args_length == 1) { // list all aliases, sorted like bash does
+        std::vector<const std::pair<const std::string, std::string>*> sorted;
+        for (const auto& alias : *smash->getAliases())
+            sorted.push_back(&alias);
+        std::sort(sorted.begin(), sorted.end(), [](const std::pair<const std::string, std::string>* a,
+                                                   const std::pair<const std::string, std::string>* b) {
+            return a->first < b->first;
+        });
+        int isAppend = IO_status;
+        for (size_t i = 0; i < sorted.size(); i++) {
+            if (IO_status == 2) {
+                std::cout << "alias " << sorted[i]->first << "='" << sorted[i]->second << "'" << endl;
+            }
+            else {
+                char* buff = smash->getArena()->format("alias %s='%s'\n", sorted[i]->first.c_str(), sorted[i]->second.c_str());
+                ChangeIO(isAppend, buff, strlen(buff));
+                isAppend = 1;
+            }
+        }
+        if (sorted.empty() && IO_status != 2)
+            ChangeIO(IO_status);
+        return;
+    }
+    // alias name='value': the value may contain spaces, so it is taken from the raw line, not from args
+    const char* definition = strstr(cmd_line_without_const, "alias") + 5;
+    while (_isWhitespace(*definition))
+        definition++;
+    const char* equal_sign = strchr(definition, '=');
+    if (equal_sign == NULL) {
+        if (IO_status != 2)
+            ChangeIO(IO_status);
+        const std::string* value = smash->findAlias(args[1], strlen(args[1]));
+        if (args_length != 2 || value == NULL) {
+            std::cerr << "smash error: alias: " << args[1] << " not found" << endl;
+        }
+        else if (IO_status == 2) {
+            std::cout << "alias " << args[1] << "='" << *value << "'" << endl;
+        }
+        else {
+            char* buff = smash->getArena()->format("alias %s='%s'\n", args[1], value->c_str());
+            ChangeIO(IO_status, buff, strlen(buff));
+        }
+        return;
+    }
+    std::string name(definition, equal_sign - definition);
+    const char* value = equal_sign + 1;
+    size_t value_length = strlen(value);
+    while (value_length > 0 && _isWhitespace(value[value_length - 1]))
+        value_length--;
+    if (value_length >= 2 && (value[0] == '\'' || value[0] == '"') && value[value_length - 1] == value[0]) {
+        value++;
+        value_length -= 2;
+    }
+    if (IO_status != 2)
+        ChangeIO(IO_status);
+    if (name.empty() || name.find_first_of(WHITESPACE + "/|&<>'\"") != std::string::npos) {
+        std::cerr << "smash error: alias: invalid arguments" << endl;
+        return;
+    }
+    smash->setAlias(name, std::string(value, value_length));
+}
+// <---------- END AliasCommand ------------>
+
+// <---------- START UnaliasCommand ------------>
+UnaliasCommand::UnaliasCommand(const char* cmd_line, SmallShell* smash) : BuiltInCommand(cmd_line), smash(smash) {}
+void UnaliasCommand::execute() {
+    if (IO_status != 2)
+        ChangeIO(IO_status);
+    if (args_length < 2) {
+        std::cerr << "smash error: unalias: invalid arguments" << endl;
+        return;
+    }
+    for (int i = 1; i < args_length; i++) {
+        if (!smash->removeAlias(args[i]))
+            std::cerr << "smash error: unalias: " << args[i] << " not found" << endl;
+    }
+}
+// <---------- END UnaliasCommand ------------>
+
 // <---------- START SmallShell ------------>
-SmallShell::SmallShell() : prompt("smash"), last_pwd(NULL), lastPwdInitialized(false), curr_process_id(getpid()), smash_pid(getpid()) {}
+const char* _firstWord(const char* cmd_line, size_t* length) {
+    while (_isWhitespace(*cmd_line))
+        cmd_line++;
+    size_t word_length = strcspn(cmd_line, " \n");
+    while (word_length > 0 && _isWhitespace(cmd_line[word_length - 1]))
+        word_length--;
+    *length = word_length;
+    return cmd_line;
+}
+SmallShell::SmallShell() : last_bg_pid(0), launch_job_id(-1), prompt("smash"), last_pwd(NULL), lastPwdInitialized(false), curr_process_id(getpid()), smash_pid(getpid()),
+        fd_soft_limit(RLIM_INFINITY), pipe_size(0), pipe_packet_mode(false), kill_timeout_ms(JOBS_KILL_TIMEOUT_MS), subreaper(false),
+        ctrl_c_pending(0), stop_copy_pending(0), stop_pending(0), alarm_pending(0) {
+    initLaunchOptions(&background_launch);
+    if (pipe2(signal_pipe, O_CLOEXEC|O_NONBLOCK) == -1) {
+        perror("smash error: pipe failed");
+        signal_pipe[0] = signal_pipe[1] = -1; // poll skips it, timeouts then wait for the next line
+    }
+}
 SmallShell::~SmallShell(){
     free(last_pwd);
 }
@@ -943,6 +2369,129 @@ std::vector<JobEntry>* SmallShell::getTimeJobVec(){
 JobsList* SmallShell::getJobsList() {
     return &this->jobs_list;
 }
+Arena* SmallShell::getArena() {
+    return &this->line_arena;
+}
+Environment* SmallShell::getEnvironment() {
+    return &this->environment;
+}
+JobCgroups* SmallShell::getCgroups() {
+    return &this->cgroups;
+}
+ControlServer* SmallShell::getControl() {
+    return &this->control;
+}
+CommandScheduler* SmallShell::getScheduler() {
+    return &this->scheduler;
+}
+JobGraph* SmallShell::getJobGraph() {
+    return &this->job_graph;
+}
+OutputCapture* SmallShell::getCaptures() {
+    return &this->captures;
+}
+LaunchOptions* SmallShell::getBackgroundLaunch() {
+    return &this->background_launch;
+}
+WildcardExpander* SmallShell::getWildcards() {
+    return &this->wildcards;
+}
+const std::unordered_map<std::string, std::string>* SmallShell::getAliases() {
+    return &this->aliases;
+}
+const std::string* SmallShell::findAlias(const char* name, size_t length) {
+    std::unordered_map<std::string, std::string>::const_iterator it = aliases.find(std::string(name, length));
+    return (it == aliases.end()) ? NULL : &it->second;
+}
+void SmallShell::setAlias(const std::string& name, const std::string& value) {
+    aliases[name] = value;
+}
+bool SmallShell::removeAlias(const char* name) {
+    return aliases.erase(name) > 0;
+}
+size_t SmallShell::getPipeSize() {
+    return this->pipe_size;
+}
+void SmallShell::setPipeSize(size_t size) {
+    this->pipe_size = size;
+}
+bool SmallShell::isPipePacketMode() {
+    return this->pipe_packet_mode;
+}
+void SmallShell::setPipePacketMode(bool packet_mode) {
+    this->pipe_packet_mode = packet_mode;
+}
+bool SmallShell::isSubreaper() {
+    return this->subreaper;
+}
+bool SmallShell::setSubreaper(bool enable) {
+    // orphaned descendants of jobs (bash -c children, pipeline stages) are re-parented to smash instead of init
+    if (prctl(PR_SET_CHILD_SUBREAPER, enable ? 1 : 0) == -1) {
+        perror("smash error: prctl failed");
+        return false;
+    }
+    this->subreaper = enable;
+    return true;
+}
+long SmallShell::getKillTimeout() {
+    return this->kill_timeout_ms;
+}
+void SmallShell::setKillTimeout(long timeout_ms) {
+    this->kill_timeout_ms = timeout_ms;
+}
+int SmallShell::openPipe(int pipe_arr[2]) {
+    // close-on-exec on both ends: only the dup2'ed copies may reach the stages' programs
+    int flags = O_CLOEXEC;
+    if (pipe_packet_mode)
+        flags |= O_DIRECT;
+    if (pipe2(pipe_arr, flags) == -1) {
+        perror("smash error: pipe failed");
+        return -1;
+    }
+    if (pipe_size > 0 && fcntl(pipe_arr[1], F_SETPIPE_SZ, (int)pipe_size) == -1) {
+        perror("smash error: fcntl failed"); // above /proc/sys/fs/pipe-max-size, keep the default
+    }
+    int capacity = fcntl(pipe_arr[1], F_GETPIPE_SZ);
+    return (capacity == -1) ? 0 : capacity;
+}
+void SmallShell::raiseFdLimit() {
+    // every job holds a pidfd, do not let a large job table run the shell out of descriptors
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == -1) {
+        perror("smash error: getrlimit failed");
+        return;
+    }
+    fd_soft_limit = limit.rlim_cur;
+    limit.rlim_cur = limit.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &limit) == -1) {
+        perror("smash error: setrlimit failed");
+        limit.rlim_cur = fd_soft_limit;
+    }
+    // half of the descriptors for jobs, the rest stays for pipes, redirections and the builtins
+    if (limit.rlim_cur != RLIM_INFINITY && limit.rlim_cur / 2 > JOBS_PIDFD_MAX)
+        jobs_list.setPidfdLimit(limit.rlim_cur / 2);
+}
+void SmallShell::restoreFdLimit() {
+    // programs that still use select() break on descriptors past 1024, give them the limit they expect
+    if (fd_soft_limit == RLIM_INFINITY)
+        return;
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != fd_soft_limit) {
+        limit.rlim_cur = fd_soft_limit;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+const char* SmallShell::expandAlias(const char* cmd_line) {
+    if (aliases.empty())
+        return cmd_line;
+    size_t length;
+    const char* word = _firstWord(cmd_line, &length);
+    const std::string* value = findAlias(word, length);
+    if (value == NULL)
+        return cmd_line;
+    // one level only: the replacement is not looked up again, so `alias ls='ls -l'` cannot loop
+    return line_arena.format("%s%s", value->c_str(), word + length);
+}
 char* SmallShell::getLastPwd(){
     return this->last_pwd;
 }
@@ -983,6 +2532,130 @@ bool SmallShell::isLastPwdInitialized() {
 void SmallShell::changeLastPwdStatus() {
     this->lastPwdInitialized = true;
 }
+void SmallShell::addTimeJob(pid_t pid, const char* cmd_line, time_t start_time, int time_up) {
+    JobEntry job(-1, std::string(cmd_line), pid, start_time, false, time_up);
+    jobs_list.setDeadline(pid, start_time + time_up);
+    if (time_up > 0 && difftime(time(NULL), start_time) >= time_up) { // ran out while no smash was watching it
+        JobEntry* bg_job = jobs_list.getJobByProcessId(pid);
+        if ((bg_job != NULL ? bg_job->sendSignal(SIGKILL) : kill(pid, SIGKILL)) == -1)
+            perror("smash error: kill failed");
+        else
+            std::cout << "smash: " << cmd_line << " timed out!" << endl;
+        return;
+    }
+    time_jobs_vec.push_back(job);
+    alarm(findMinAlarm());
+}
+void SmallShell::killTimedOut() {
+    jobs_list.removeFinishedJobs();
+    bool killed = false;
+    vector<JobEntry>::iterator it = time_jobs_vec.begin();
+    while (it != time_jobs_vec.end()) {
+        // every one that is due: this runs from the next wait after the alarm, which a long builtin may hold up
+        if (difftime(time(NULL), it->getTImeInserted()) < it->getTimeUp()) {
+            it++;
+            continue;
+        }
+        // a job still in the list is signalled through its pidfd; otherwise it is the foreground child
+        JobEntry* job = jobs_list.getJobByProcessId(it->getProcessID());
+        if ((job != NULL ? job->sendSignal(SIGKILL) : kill(it->getProcessID(), SIGKILL)) == -1) {
+            perror("smash error: kill failed");
+        } else {
+            std::cout << "smash: " << it->getCmdLine() << " timed out!" << endl;
+        }
+        it = time_jobs_vec.erase(it);
+        killed = true;
+    }
+    if (killed) {
+        int alarm_num = findMinAlarm();
+        if (alarm_num != -1)
+            alarm(alarm_num);
+        return;
+    }
+    if (curr_process_id != getpid()) {
+        if (kill(curr_process_id, 9) == -1) {
+            perror("smash error: kill failed");
+        }
+        else {
+            std::cout << "smash: " << last_cmd << " timed out!" << endl;
+        }
+    }
+}
+void SmallShell::removeTimeJob(pid_t pid) {
+    vector<JobEntry>::iterator it;
+    for (it = time_jobs_vec.begin(); it != time_jobs_vec.end(); it++) {
+        if (it->getProcessID() == pid) {
+            time_jobs_vec.erase(it);
+            return;
+        }
+    }
+}
+int SmallShell::getLastStatus() {
+    return environment.getLastStatus();
+}
+void SmallShell::setLastStatus(int status) {
+    environment.setLastStatus(status);
+}
+void SmallShell::setCtrlC() {
+    this->ctrl_c_pending = 1;
+}
+bool SmallShell::takeCtrlC() {
+    bool pending = (this->ctrl_c_pending != 0);
+    this->ctrl_c_pending = 0;
+    return pending;
+}
+void SmallShell::setStopCopy() {
+    this->stop_copy_pending = 1;
+}
+bool SmallShell::takeStopCopy() {
+    bool pending = (this->stop_copy_pending != 0);
+    this->stop_copy_pending = 0;
+    return pending;
+}
+void SmallShell::wakeWaits() {
+    int saved_errno = errno; // the interrupted code may be about to read it
+    char byte = 0;
+    if (write(signal_pipe[1], &byte, 1) == -1) {} // a full pipe wakes the waits all the same
+    errno = saved_errno;
+}
+void SmallShell::setStopPending() {
+    this->stop_pending = 1;
+    wakeWaits();
+}
+void SmallShell::setAlarmPending() {
+    this->alarm_pending = 1;
+    wakeWaits();
+}
+int SmallShell::getSignalFd() {
+    return signal_pipe[0];
+}
+void SmallShell::handleSignals() {
+    char bytes[64];
+    while (signal_pipe[0] != -1 && read(signal_pipe[0], bytes, sizeof(bytes)) > 0) {}
+    if (stop_pending) {
+        stop_pending = 0;
+        // a second ctrl-Z before the wait returned stops the same process again
+        if (curr_process_id != smash_pid && jobs_list.getJobByProcessId(curr_process_id) == NULL) {
+            jobs_list.removeFinishedJobs();
+            jobs_list.addJob(curr_job_id, curr_cmd_line.c_str(), curr_process_id, true);
+            jobs_list.updateMaxJobID();
+            jobs_list.updateMaxStoppedJobID();
+        }
+    }
+    if (alarm_pending) {
+        alarm_pending = 0;
+        killTimedOut();
+    }
+}
+long SmallShell::timeoutRemainingMs(pid_t pid, int64_t now_ms) {
+    for (size_t i = 0; i < time_jobs_vec.size(); i++) {
+        if (time_jobs_vec[i].getProcessID() == pid) {
+            int64_t left = time_jobs_vec[i].getStartMs() + (int64_t)time_jobs_vec[i].getTimeUp() * 1000 - now_ms;
+            return left < 0 ? 0 : (long)left;
+        }
+    }
+    return -1;
+}
 int SmallShell::findMinAlarm(){
     if(time_jobs_vec.empty())
         return -1;
@@ -999,98 +2672,526 @@ int SmallShell::findMinAlarm(){
 
 
 
+// <---------- START builtin table ------------>
+typedef Command* (*BuiltinFactory)(const char* cmd_line, SmallShell* smash);
+typedef bool (*BuiltinFits)(const char* cmd_line);
+struct BuiltinEntry {
+    const char* name;
+    size_t length;
+    BuiltinFactory create;
+    BuiltinFits fits; // NULL for every line; otherwise a line it rejects runs as an external command
+};
+
+template <class T> Command* _createBuiltin(const char* cmd_line, SmallShell* smash) {
+    return new (smash->getArena()) T(cmd_line);
+}
+template <class T> Command* _createWithShell(const char* cmd_line, SmallShell* smash) {
+    return new (smash->getArena()) T(cmd_line, smash);
+}
+template <class T> Command* _createWithJobs(const char* cmd_line, SmallShell* smash) {
+    return new (smash->getArena()) T(cmd_line, smash->getJobsList());
+}
+template <class T> Command* _createWithJobsAndShell(const char* cmd_line, SmallShell* smash) {
+    return new (smash->getArena()) T(cmd_line, smash->getJobsList(), smash);
+}
+
+constexpr size_t _constLength(const char* s) {
+    return (*s == 0) ? 0 : 1 + _constLength(s + 1);
+}
+constexpr int _constCompare(const char* a, const char* b) {
+    return (*a != *b || *a == 0) ? (*a - *b) : _constCompare(a + 1, b + 1);
+}
+#define BUILTIN(name, factory) {name, _constLength(name), factory, NULL}
+#define STREAM_BUILTIN(name, factory, fits) {name, _constLength(name), factory, fits}
+
+// Every builtin is registered here and nowhere else. Entries are ordered by (length, name),
+// which the static_assert below checks, so a lookup is a binary search on the length plus one memcmp.
+static constexpr BuiltinEntry BUILTINS[] = {
+    BUILTIN("bg", _createWithJobs<BackgroundCommand>),
+    BUILTIN("cd", _createWithShell<ChangeDirCommand>),
+    BUILTIN("fg", _createWithJobsAndShell<ForegroundCommand>),
+    STREAM_BUILTIN("cat", _createBuiltin<CatCommand>, _catFits),
+    BUILTIN("env", _createWithShell<EnvCommand>),
+    BUILTIN("fds", _createBuiltin<FdsCommand>),
+    BUILTIN("pwd", _createBuiltin<GetCurrDirCommand>),
+    BUILTIN("set", _createWithShell<SetCommand>),
+    STREAM_BUILTIN("tee", _createBuiltin<TeeCommand>, _teeFits),
+    BUILTIN("head", _createWithJobs<HeadCommand>),
+    BUILTIN("jobs", _createWithJobs<JobsCommand>),
+    BUILTIN("kill", _createWithJobs<KillCommand>),
+    BUILTIN("quit", _createWithJobs<QuitCommand>),
+    BUILTIN("wait", _createWithJobsAndShell<WaitCommand>),
+    BUILTIN("after", _createWithShell<AfterCommand>),
+    BUILTIN("alias", _createWithShell<AliasCommand>),
+    BUILTIN("every", _createWithShell<EveryCommand>),
+    BUILTIN("limit", _createWithJobsAndShell<LimitCommand>),
+    BUILTIN("trace", _createBuiltin<TraceCommand>),
+    BUILTIN("unset", _createWithShell<UnsetCommand>),
+    BUILTIN("cancel", _createWithShell<CancelCommand>),
+    BUILTIN("export", _createWithShell<ExportCommand>),
+    BUILTIN("output", _createWithJobsAndShell<OutputCommand>),
+    BUILTIN("renice", _createWithJobs<ReniceCommand>),
+    BUILTIN("showpid", _createWithShell<ShowPidCommand>),
+    BUILTIN("unalias", _createWithShell<UnaliasCommand>),
+    BUILTIN("chprompt", _createWithShell<ChangePromptCommand>),
+};
+#define BUILTINS_NUM (sizeof(BUILTINS) / sizeof(BUILTINS[0]))
+
+constexpr bool _isBuiltinTableSorted(size_t i) {
+    return (i + 1 >= BUILTINS_NUM) ? true :
+           (BUILTINS[i].length < BUILTINS[i + 1].length ||
+            (BUILTINS[i].length == BUILTINS[i + 1].length && _constCompare(BUILTINS[i].name, BUILTINS[i + 1].name) < 0))
+           && _isBuiltinTableSorted(i + 1);
+}
+static_assert(_isBuiltinTableSorted(0), "BUILTINS must be sorted by (length, name) without duplicates");
+
+const BuiltinEntry* _findBuiltin(const char* word, size_t length) {
+    size_t low = 0;
+    size_t high = BUILTINS_NUM;
+    while (low < high) {
+        size_t mid = (low + high) / 2;
+        int cmp = (BUILTINS[mid].length != length) ? (BUILTINS[mid].length < length ? -1 : 1) :
+                  memcmp(BUILTINS[mid].name, word, length);
+        if (cmp == 0)
+            return &BUILTINS[mid];
+        if (cmp < 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return NULL;
+}
+// <---------- END builtin table ------------>
+
 /**
 * Creates and returns a pointer to Command class which matches the given command line (cmd_line)
 */
 Command * SmallShell::CreateCommand(const char* cmd_line) {
-    string cmd_s = _trim(string(cmd_line));
-    string firstWord = cmd_s.substr(0, cmd_s.find_first_of(" \n"));
+    size_t firstWordLength;
+    const char* firstWord = _firstWord(cmd_line, &firstWordLength);
 
-    if (firstWord.compare("chprompt") == 0) {
-        return new ChangePromptCommand(cmd_line, this);
-    }
-    else if (firstWord.compare("showpid") == 0) {
-        return new ShowPidCommand(cmd_line, this);
-    }
-    else if (firstWord.compare("pwd") == 0) {
-        return new GetCurrDirCommand(cmd_line);
-    }
-    else if (firstWord.compare("cd") == 0) {
-        return new ChangeDirCommand(cmd_line, this);
-    }
-    else if (firstWord.compare("jobs") == 0) {
-        return new JobsCommand(cmd_line, &jobs_list);
-    }
-    else if (firstWord.compare("kill") == 0) {
-        return new KillCommand(cmd_line, &jobs_list);
-    }
-    else if (firstWord.compare("fg") == 0) {
-        return new ForegroundCommand(cmd_line, &jobs_list, this);
-    }
-    else if (firstWord.compare("bg") == 0) {
-        return new BackgroundCommand(cmd_line, &jobs_list);
-    }
-    else if (firstWord.compare("quit") == 0) {
-        return new QuitCommand(cmd_line, &jobs_list);
-    }
-    else if (firstWord.compare("head") == 0) {
-        return new HeadCommand(cmd_line, &jobs_list);
+    const BuiltinEntry* builtin = _findBuiltin(firstWord, firstWordLength);
+    if (builtin != NULL && (builtin->fits == NULL || builtin->fits(cmd_line))) {
+        return builtin->create(cmd_line, this);
     }
     else {
         bool isBackground = _isBackgroundComamnd(cmd_line);
+        // `run --cpus .. --nice .. cmd`: the options are taken off here, the job keeps the full line
+        LaunchOptions launch;
+        initLaunchOptions(&launch);
+        const char* line = cmd_line;
+        if (isRunCommand(cmd_line) && !parseRunPrefix(cmd_line, &launch, &line)) {
+            std::cerr << "smash error: run: invalid arguments" << endl;
+            return nullptr;
+        }
+        if (isBackground) {
+            if (launch.nice == LAUNCH_NICE_UNSET)
+                launch.nice = background_launch.nice;
+            if (launch.policy == -1)
+                launch.policy = background_launch.policy;
+        }
+        if (line != cmd_line && !isBackground && _isTimeCommand(line)) { // `run .. timeout N cmd`
+            char* tmp_args[COMMAND_MAX_ARGS];
+            int args_length = _parseCommandLine(line, tmp_args, &line_arena);
+            alarm(args_length > 1 ? atoi(tmp_args[1]) : 0);
+            last_cmd = cmd_line;
+        }
+        bool captured = isBackground && captures.prepare();
+        Tracer::getInstance().stamp(TRACE_FACTORY);
         pid_t pid = fork();
         if (pid == 0) { //child
             setpgrp();
-            if (_isTimeCommand(cmd_line)) {
+            cgroups.enterLeaf();
+            applyLaunchOptions(launch);
+            if (captured)
+                captures.redirectChild();
+            if (_isTimeCommand(line)) {
                 char* tmp_args[COMMAND_MAX_ARGS];
-                int args_length = _parseCommandLine(cmd_line,tmp_args);
-                std::string new_cmd_line = removeTimeOut(cmd_line, tmp_args[1]);
-                for(int i = 0; i < args_length; i++) {
-                    free(tmp_args[i]);
-                }
-                return new ExternalCommand(new_cmd_line.c_str(), &jobs_list);
+                int args_length = _parseCommandLine(line, tmp_args, &line_arena);
+                char* new_cmd_line = removeTimeOut(line, args_length > 1 ? tmp_args[1] : "", &line_arena);
+                return new (&line_arena) ExternalCommand(new_cmd_line, &jobs_list);
             }
-            return new ExternalCommand(cmd_line, &jobs_list);
+            return new (&line_arena) ExternalCommand(line, &jobs_list);
         } else if (pid > 0) { //parent
+            Tracer::getInstance().stamp(TRACE_FORK);
+            setpgid(pid, pid); // as the child does, so the group exists whichever of the two runs first
             if (isBackground == false) {
                 this->curr_process_id = pid;
                 this->curr_cmd_line = cmd_line;
                 this->curr_job_id = -1;
-                pid_t wait_status = waitpid(pid, NULL, WUNTRACED);
+                int status = 0;
+                pid_t wait_status = waitForeground(pid, &status);
                 if (wait_status < 0) {
                     perror("smash error: waitpid failed");
                 }
+                else {
+                    setLastStatus(WIFSTOPPED(status) ? 128 + WSTOPSIG(status) : JobsList::exitCode(status));
+                    if (!WIFSTOPPED(status))
+                        cgroups.removeLeaf(pid);
+                }
                 this->curr_process_id = getpid();
-                this->curr_cmd_line = std::string();
+                this->curr_cmd_line.clear(); // keeps the capacity for the next foreground command
                 this->curr_job_id = -1;
             } else {
                 jobs_list.removeFinishedJobs(); // if we are going to add to the vec so remove jobs from the shell process (father for all the bg commands)
-                jobs_list.addJob(-1, cmd_line, pid, false);
-                if (_isTimeCommand(cmd_line)) {
+                jobs_list.addJob(launch_job_id, cmd_line, pid, false);
+                launch_job_id = -1;
+                last_bg_pid = pid;
+                if (captured)
+                    captures.attach(jobs_list.getJobByProcessId(pid)->getJobID());
+                if (_isTimeCommand(line)) {
                     char* tmp_args[COMMAND_MAX_ARGS];
-                    int args_length = _parseCommandLine(cmd_line,tmp_args);
-                    JobEntry job(-1, std::string(cmd_line), pid, time(NULL), false, atoi(tmp_args[1]));
-                    time_jobs_vec.push_back(job);
-                    alarm(findMinAlarm());
-                    for(int i = 0; i < args_length; i++) {
-                        free(tmp_args[i]);
-                    }
+                    int args_length = _parseCommandLine(line, tmp_args, &line_arena);
+                    addTimeJob(pid, cmd_line, time(NULL), args_length > 1 ? atoi(tmp_args[1]) : 0);
                 }
             }
         } else {
             perror("smash error: fork failed");
+            captures.attach(-1);
         }
     }
     return nullptr;
 }
 
-void SmallShell::executeCommand(const char *cmd_line) {
-    int pipe_status = _isPipeCommand(cmd_line);
-    if (pipe_status > 0) { // pipe
+/**
+* Runs cmd_line in a child with its stdout on a pipe and returns what it printed, minus the
+* trailing newlines. A plain external command is exec'ed by that child directly, so `$(cat list)`
+* costs one pipe and one process.
+*/
+std::string SmallShell::captureOutput(const char* cmd_line) {
+    int pipe_arr[2];
+    if (pipe2(pipe_arr, O_CLOEXEC) == -1) {
+        perror("smash error: pipe failed");
+        return std::string();
+    }
+    std::cout.flush();
+    pid_t pid = fork();
+    if (pid == 0) { //child
+        Tracer::getInstance().detach();
+        if (dup2(pipe_arr[1], STDOUT_FILENO) == -1) {
+            perror("smash error: dup2 failed");
+            _exit(1);
+        }
+        close(pipe_arr[0]);
+        close(pipe_arr[1]);
+        const char* line = expandWords(expandAlias(cmd_line));
+        size_t first_word_length;
+        const char* first_word = _firstWord(line, &first_word_length);
+        if (first_word_length > 0 && _isPipeCommand(line) == 0 && !_isTimeCommand(line) && !isRunCommand(line) &&
+            _findBuiltin(first_word, first_word_length) == NULL) {
+            Command* cmd = new (&line_arena) ExternalCommand(line, &jobs_list);
+            if (cmd->prepare())
+                cmd->execute();
+            _exit(127);
+        }
+        executeCommand(line, false);
+        std::cout.flush();
+        _exit(0);
+    }
+    close(pipe_arr[1]);
+    std::string output;
+    if (pid == -1) {
+        perror("smash error: fork failed");
+        close(pipe_arr[0]);
+        return output;
+    }
+    char buff[4096];
+    ssize_t n;
+    while ((n = read(pipe_arr[0], buff, sizeof(buff))) != 0) {
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("smash error: read failed");
+            break;
+        }
+        output.append(buff, n);
+    }
+    close(pipe_arr[0]);
+    if (waitpid(pid, NULL, 0) == -1)
+        perror("smash error: waitpid failed");
+    while (!output.empty() && output[output.size() - 1] == '\n')
+        output.erase(output.size() - 1);
+    return output;
+}
+
+/**
+* Replaces every $(...) outside single quotes by the output of its command.
+*/
+const char* SmallShell::substituteCommands(const char* cmd_line) {
+    if (strstr(cmd_line, "$(") == NULL)
+        return cmd_line;
+    std::string out;
+    bool in_single = false;
+    bool in_double = false;
+    const char* p = cmd_line;
+    while (*p != 0) {
+        if (*p == '\'' && !in_double) {
+            in_single = !in_single;
+        }
+        else if (*p == '"' && !in_single) {
+            in_double = !in_double;
+        }
+        else if (*p == '\\' && !in_single && p[1] != 0) {
+            out += *p++;
+        }
+        else if (*p == '$' && p[1] == '(' && !in_single) {
+            const char* start = p + 2;
+            const char* end = start;
+            int depth = 1;
+            char quote = 0;
+            for (; *end != 0; end++) {
+                if (quote != 0) {
+                    if (*end == quote)
+                        quote = 0;
+                }
+                else if (*end == '\'' || *end == '"') {
+                    quote = *end;
+                }
+                else if (*end == '(') {
+                    depth++;
+                }
+                else if (*end == ')' && --depth == 0) {
+                    break;
+                }
+            }
+            if (*end == 0) { // unbalanced, leave it to the command
+                out += p;
+                break;
+            }
+            std::string output = captureOutput(line_arena.copy(start, end - start));
+            // the output is literal words: `echo $(printf 'x>c')` prints x>c; unquoted, its newlines
+            // only split words (a newline would end the line for bash)
+            size_t used = out.size();
+            out.resize(used + escapeShellText(output.data(), output.size(), in_double, NULL));
+            escapeShellText(output.data(), output.size(), in_double, &out[used]);
+            p = end + 1;
+            continue;
+        }
+        out += *p++;
+    }
+    return line_arena.copy(out.c_str(), out.size());
+}
+
+const char* SmallShell::expandWords(const char* cmd_line) {
+    cmd_line = environment.expand(cmd_line, &line_arena);
+    cmd_line = substituteCommands(cmd_line);
+    return wildcards.expand(cmd_line, &line_arena);
+}
+
+// A line stdio already read ahead would never make fd readable; glibc shows it in the FILE.
+static bool _stdinBuffered() {
+#ifdef __GLIBC__
+    return stdin->_IO_read_ptr < stdin->_IO_read_end;
+#else
+    return true; // cannot tell, do not wait
+#endif
+}
+
+void SmallShell::waitForInput(int fd) {
+    captures.drainReady(0);
+    control.serve();
+    runDueSchedules(); // what came due while a foreground command ran
+    handleSignals(); // a script's buffered lines never get to the poll below
+    runReadyJobs();
+    while (!_stdinBuffered()) {
+        int capture_fd = captures.getEventFd();
+        int control_fd = control.getEventFd();
+        int timer_fd = scheduler.getEventFd();
+        // job exits only matter to event subscribers and to jobs waiting on them
+        int exit_fd = (control_fd != -1 || job_graph.hasWaiting()) ? jobs_list.getEventFd() : -1;
+        if (capture_fd == -1 && exit_fd == -1 && timer_fd == -1 && signal_pipe[0] == -1)
+            return; // nothing to do meanwhile, getline may block
+        // poll skips the negative descriptors
+        struct pollfd pfds[6] = {{fd, POLLIN, 0}, {capture_fd, POLLIN, 0}, {control_fd, POLLIN, 0},
+                                 {exit_fd, POLLIN, 0}, {timer_fd, POLLIN, 0}, {signal_pipe[0], POLLIN, 0}};
+        // jobs tracked by pid only never wake the epoll set, those someone waits for are looked at every JOBS_PID_POLL_MS
+        int timeout = (job_graph.hasWaiting() && jobs_list.hasPidOnlyJobs()) ? JOBS_PID_POLL_MS : -1;
+        int polled = poll(pfds, 6, timeout);
+        if (polled == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("smash error: poll failed");
+            return;
+        }
+        if (pfds[5].revents != 0)
+            handleSignals();
+        if (pfds[4].revents != 0)
+            runDueSchedules();
+        if (pfds[1].revents != 0)
+            captures.drainReady(0);
+        if (pfds[3].revents != 0 || polled == 0) {
+            jobs_list.removeFinishedJobs();
+            runReadyJobs();
+        }
+        if (pfds[2].revents != 0)
+            control.serve();
+        if (pfds[0].revents != 0)
+            return;
+    }
+}
+
+static volatile sig_atomic_t child_event = 0;
+
+static void _childHandler(int sig_num) {
+    child_event = 1;
+}
+
+pid_t SmallShell::waitForeground(pid_t pid, int* status) {
+    // SIGCHLD stays blocked except inside ppoll and while jobs are forked, so an exit that comes
+    // between a check and the sleep still ends the sleep; an alarm or ctrl-Z leaves a byte in the
+    // signal pipe for the same reason
+    sigset_t child_mask;
+    sigset_t old_mask;
+    sigemptyset(&child_mask);
+    sigaddset(&child_mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &child_mask, &old_mask);
+    struct sigaction action;
+    struct sigaction old_action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = _childHandler;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGCHLD, &action, &old_action);
+    pid_t result;
+    for (;;) {
+        child_event = 0;
+        result = waitpid(pid, status, WUNTRACED|WNOHANG);
+        if (result != 0)
+            break;
+        // the programs launched here must not inherit a blocked SIGCHLD
+        sigprocmask(SIG_SETMASK, &old_mask, NULL);
+        handleSignals(); // a timeout may kill pid, the next waitpid sees it
+        if (job_graph.hasWaiting()) {
+            jobs_list.removeFinishedJobs();
+            runReadyJobs();
+        }
+        sigprocmask(SIG_BLOCK, &child_mask, NULL);
+        if (child_event)
+            continue; // something exited meanwhile, look again before sleeping
+        struct pollfd pfd = {signal_pipe[0], POLLIN, 0};
+        struct timespec pid_poll = {0, JOBS_PID_POLL_MS * 1000000L};
+        bool pid_only = job_graph.hasWaiting() && jobs_list.hasPidOnlyJobs();
+        if (ppoll(&pfd, 1, pid_only ? &pid_poll : NULL, &old_mask) == -1 && errno != EINTR) {
+            perror("smash error: ppoll failed");
+            result = waitpid(pid, status, WUNTRACED);
+            break;
+        }
+    }
+    sigaction(SIGCHLD, &old_action, NULL);
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+    handleSignals(); // a job ctrl-Z stopped is in the list by the time the caller looks for it
+    return result;
+}
+
+void SmallShell::runDueSchedules() {
+    std::vector<Schedule> due;
+    scheduler.takeDue(&due);
+    if (due.empty())
+        return;
+    jobs_list.removeFinishedJobs();
+    for (size_t i = 0; i < due.size(); i++) {
+        if (due[i].last_pid != 0 && jobs_list.getJobByProcessId(due[i].last_pid) != NULL) {
+            scheduler.recordRun(due[i].id, 0, true);
+            continue;
+        }
+        std::string line = due[i].cmd_line + " &";
+        last_bg_pid = 0;
+        executeCommand(line.c_str());
+        if (getpid() != smash_pid)
+            exit(1); // a child whose exec failed, it must not go on serving the prompt
+        scheduler.recordRun(due[i].id, last_bg_pid, false);
+    }
+}
+
+int SmallShell::launchJob(const std::string& cmd_line, int job_id, int* exit_code) {
+    std::string line = cmd_line + " &";
+    if (job_id != -1)
+        captures.forget(job_id); // what a finished job with the same id left
+    launch_job_id = job_id;
+    last_bg_pid = 0;
+    executeCommand(line.c_str(), true, false); // a stage of a chain whose alias was expanded already
+    launch_job_id = -1;
+    if (getpid() != smash_pid)
+        exit(1); // a child whose exec failed, it must not go on serving the prompt
+    JobEntry* job = (last_bg_pid != 0) ? jobs_list.getJobByProcessId(last_bg_pid) : NULL;
+    if (job == NULL) {
+        *exit_code = getLastStatus();
+        return -1;
+    }
+    return job->getJobID();
+}
+
+void SmallShell::startChain(const std::vector<int>& after, int exit_code, const char* cmd_line, bool alias) {
+    std::vector<std::string> stages;
+    std::vector<JobCondition> conditions;
+    _splitChain(cmd_line, &stages, &conditions);
+    for (size_t i = 0; alias && i < stages.size(); i++)
+        stages[i] = expandAlias(stages[i].c_str());
+    std::vector<int> predecessors(after);
+    for (size_t i = 0; i < stages.size(); i++) {
+        if (predecessors.empty()) { // what it follows finished already: it runs, or is skipped, now
+            if (JobGraph::conditionHolds(conditions[i], exit_code)) {
+                int job_id = launchJob(stages[i], -1, &exit_code);
+                if (job_id != -1)
+                    predecessors.assign(1, job_id);
+            }
+            continue;
+        }
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        WaitingJob job;
+        job.job_id = std::max(jobs_list.getMaxJobID(), job_graph.getMaxJobID()) + 1;
+        job.cmd_line = stages[i];
+        job.after = predecessors;
+        job.waits_for = predecessors;
+        job.condition = conditions[i];
+        job.exit_code = exit_code;
+        job.queued_ms = (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+        job_graph.add(job);
+        predecessors.assign(1, job.job_id);
+    }
+}
+
+void SmallShell::runReadyJobs() {
+    WaitingJob job;
+    while (job_graph.takeReady(&job)) {
+        int exit_code = 0;
+        if (launchJob(job.cmd_line, job.job_id, &exit_code) == -1)
+            job_graph.jobFinished(job.job_id, exit_code); // its dependents need not wait for anything
+    }
+}
+
+void SmallShell::executeCommand(const char *cmd_line, bool expand, bool alias) {
+    Tracer::getInstance().begin(cmd_line);
+    Arena::Mark arena_mark = line_arena.mark(); // executeCommand nests for pipes and timeout
+    // in `a && b &` every stage has an alias of its own, startChain looks them up
+    bool stage_aliases = expand && alias && _isBackgroundComamnd(cmd_line) && _isChainCommand(cmd_line);
+    if (expand && alias && !stage_aliases)
+        cmd_line = expandAlias(cmd_line);
+    size_t first_word_length;
+    const char* first_word = _firstWord(cmd_line, &first_word_length);
+    // a scheduled command is expanded each time it fires, not when every/after store it
+    bool is_scheduled = first_word_length == 5 && (memcmp(first_word, "every", 5) == 0 || memcmp(first_word, "after", 5) == 0);
+    // `a && b &`: a chain of background jobs, each stage is expanded when it starts
+    bool is_chain = !is_scheduled && !(first_word_length == 5 && memcmp(first_word, "alias", 5) == 0) &&
+                    _isBackgroundComamnd(cmd_line) && _isChainCommand(cmd_line);
+    if (expand && !is_scheduled && !is_chain) { // once per input line, the nested calls get already expanded parts
+        cmd_line = expandWords(cmd_line);
+        first_word = _firstWord(cmd_line, &first_word_length);
+    }
+    // an alias definition or a scheduled command may quote a whole pipeline, it is stored as-is rather than run
+    bool is_alias = (first_word_length == 5 && memcmp(first_word, "alias", 5) == 0);
+    int pipe_status = (is_alias || is_scheduled) ? 0 : _isPipeCommand(cmd_line);
+    if (is_chain) {
+        char* line = line_arena.copy(cmd_line);
+        _removeBackgroundSign(line);
+        startChain(std::vector<int>(), 0, line, stage_aliases);
+    }
+    else if (pipe_status > 0) { // pipe
         jobs_list.removeFinishedJobs();
-        std::string left;
-        std::string right;
-        _splitPipeCommands(cmd_line, &left, &right);
+        char* left;
+        char* right;
+        _splitPipeCommands(cmd_line, &left, &right, &line_arena);
         int pipe_write_channel;
         if (pipe_status == 1) {
             pipe_write_channel = STDOUT_FILENO;
@@ -1099,83 +3200,94 @@ void SmallShell::executeCommand(const char *cmd_line) {
             pipe_write_channel = STDERR_FILENO;
         }
         int pipe_arr[2] = {0};
-        pid_t pid = fork();
+        int pipe_capacity = openPipe(pipe_arr);
+        pid_t pid = (pipe_capacity == -1) ? -2 : fork();
         if (pid == 0) { //child
             setpgrp();
-            if (pipe(pipe_arr) == -1) {
-                perror("smash error: pipe failed");
-            }
-            else {
-                pid_t pipe_pid = fork();
-                if (pipe_pid == 0) { //child - left command - write
-                    setpgrp();
-                    if (dup2(pipe_arr[1], pipe_write_channel) == -1) {
-                        perror("smash error: dup2 failed");
-                    }
-                    else {
-                        if (close(pipe_arr[0]) == -1) {
-                            perror("smash error: close failed");
-                        } else {
-                            executeCommand(left.c_str());
-                        }
-                    }
-                    if (close(pipe_arr[1]) == -1) {
-                        perror("smash error: close failed");
-                    }
-                    if (close(pipe_write_channel) == -1) {
-                        perror("smash error: close failed");
-                    }
-                } else if (pipe_pid > 0) { //parent - right command - read
-                    if (dup2(pipe_arr[0], STDIN_FILENO) == -1) {
-                        perror("smash error: dup2 failed");
-                    }
-                    else {
-                        if (close(pipe_arr[1]) == -1) {
-                            perror("smash error: close failed");
-                        } else {
-                            executeCommand(right.c_str());
-                        }
-                    }
+            Tracer::getInstance().detach(); // every pipeline stage gets its own trace record
+            pid_t pipe_pid = fork();
+            if (pipe_pid == 0) { //child - left command - write
+                setpgrp();
+                if (dup2(pipe_arr[1], pipe_write_channel) == -1) {
+                    perror("smash error: dup2 failed");
+                }
+                else {
                     if (close(pipe_arr[0]) == -1) {
                         perror("smash error: close failed");
+                    } else {
+                        executeCommand(left, false);
                     }
-                    if (close(STDIN_FILENO) == -1) {
+                }
+                if (close(pipe_arr[1]) == -1) {
+                    perror("smash error: close failed");
+                }
+                if (close(pipe_write_channel) == -1) {
+                    perror("smash error: close failed");
+                }
+            } else if (pipe_pid > 0) { //parent - right command - read
+                if (dup2(pipe_arr[0], STDIN_FILENO) == -1) {
+                    perror("smash error: dup2 failed");
+                }
+                else {
+                    if (close(pipe_arr[1]) == -1) {
                         perror("smash error: close failed");
+                    } else {
+                        executeCommand(right, false);
                     }
-                } else {
-                    perror("smash error: fork failed");
                 }
+                if (close(pipe_arr[0]) == -1) {
+                    perror("smash error: close failed");
+                }
+                if (close(STDIN_FILENO) == -1) {
+                    perror("smash error: close failed");
+                }
+                // reap the writer too, so its usage is part of what smash gets back from wait4
+                if (waitpid(pipe_pid, NULL, 0) == -1) {
+                    perror("smash error: waitpid failed");
+                }
+            } else {
+                perror("smash error: fork failed");
             }
         } else if (pid > 0) { //parent - smash
-            pid_t wait_status1 = wait(NULL);
+            Tracer::getInstance().stamp(TRACE_FORK);
+            if (close(pipe_arr[0]) == -1 || close(pipe_arr[1]) == -1) {
+                perror("smash error: close failed");
+            }
+            struct rusage usage;
+            pid_t wait_status1 = wait4(pid, NULL, 0, &usage);
             if (wait_status1 < 0) {
                 perror("smash error: wait failed");
             }
-            wait(NULL);
-            wait(NULL);
-        } else {
+            else {
+                Tracer::getInstance().recordPipe(pipe_capacity, usage.ru_nvcsw, usage.ru_nivcsw);
+            }
+        } else if (pid == -1) {
             perror("smash error: fork failed");
+            close(pipe_arr[0]);
+            close(pipe_arr[1]);
         }
     }
     else {
         if (_isTimeCommand(cmd_line) && !_isBackgroundComamnd(cmd_line)) {
             char *tmp_args[COMMAND_MAX_ARGS];
-            int args_length = _parseCommandLine(cmd_line, tmp_args);
-            std::string new_cmd_line = removeTimeOut(cmd_line, tmp_args[1]);
-            alarm(atoi(tmp_args[1]));
-            string last_cmd_str(cmd_line);
-            last_cmd = last_cmd_str;
-            for(int i = 0; i < args_length; i++) {
-                free(tmp_args[i]);
-            }
-            executeCommand(new_cmd_line.c_str());
+            int args_length = _parseCommandLine(cmd_line, tmp_args, &line_arena);
+            char* new_cmd_line = removeTimeOut(cmd_line, args_length > 1 ? tmp_args[1] : "", &line_arena);
+            alarm(args_length > 1 ? atoi(tmp_args[1]) : 0);
+            last_cmd = cmd_line;
+            executeCommand(new_cmd_line, false);
         } else {
             Command *cmd = CreateCommand(cmd_line);
             if (cmd != NULL) {
-                cmd->execute();
-                delete cmd;
+                Tracer::getInstance().stamp(TRACE_FACTORY);
+                setLastStatus(0); // builtins report failures on stderr only; wait sets its own status
+                if (cmd->prepare())
+                    cmd->execute();
+                cmd->cleanup();
+                cmd->~Command();
             }
         }
     }
+    line_arena.release(arena_mark);
+    Tracer::getInstance().end();
     // Please note that you must fork smash process for some commands (e.g., external commands....)
 }
\ No newline at end of file
@@ -2,42 +2,127 @@
 #define SMASH_COMMAND_H_
 
 #include <string.h>
+#include <signal.h>
+#include <sys/resource.h>
 #include <vector>
+#include <string>
+#include <unordered_map>
+#include "arena.h"
+#include "redirect.h"
+#include "env.h"
+#include "wildcard.h"
+#include "jobstate.h"
+#include "cgroup.h"
+#include "launch.h"
+#include "capture.h"
+#include "control.h"
+#include "writer.h"
+#include "scheduler.h"
+#include "jobgraph.h"
 
 #define COMMAND_ARGS_MAX_LENGTH (200)
 #define COMMAND_MAX_ARGS (21)
+#define JOBS_FINISHED_MAX (64)
+#define JOBS_PIDFD_MAX (4096) // default cap on pidfds, jobs past it are tracked by pid only
+#define JOBS_EPOLL_BATCH (64)
+#define JOBS_KILL_TIMEOUT_MS (1000) // default grace period between SIGTERM and SIGKILL on `quit kill`
+#define JOBS_PID_POLL_MS (10) // how often jobs without a pidfd are checked while waiting
 
 class Command;
 class SmallShell;
+struct epoll_event;
+
+// Resources of processes smash reaped on behalf of a job (orphans re-parented to it as subreaper).
+struct JobUsage {
+    uint64_t user_us;
+    uint64_t sys_us;
+    long maxrss_kb;
+    unsigned reaped;
+};
+// One piece of a `jobs --format` string: either literal text or a field.
+enum JobField {
+    JOB_FIELD_TEXT, JOB_FIELD_ID, JOB_FIELD_PGID, JOB_FIELD_PID, JOB_FIELD_STATE, JOB_FIELD_ELAPSED_MS,
+    JOB_FIELD_TIMEOUT_REMAINING_MS, JOB_FIELD_CPU_MS, JOB_FIELD_RSS_KB, JOB_FIELD_CMD, JOB_FIELD_AFTER
+};
+struct JobFormatPart {
+    JobField field;
+    std::string text;
+};
+// "{id} {state} {cmd}": false with the offending name in bad_field when a field is unknown.
+bool parseJobFormat(const char* format, std::vector<JobFormatPart>* parts, std::string* bad_field);
+// utime, stime, cutime, cstime (clock ticks) and rss (pages) of a live process, from /proc/<pid>/stat.
+bool _liveUsage(pid_t pid, uint64_t* user_us, uint64_t* sys_us, long* rss_kb);
+
 class JobEntry {
     int job_id;
     std::string cmd_line;
     pid_t process_id;
     time_t time_inserted;
+    int64_t start_ms; // wall clock, for elapsed_ms
     bool isStopped;
     int time_up;
+    int pidfd; // owned by the JobsList holding the entry, -1 when the job is tracked by pid
+    JobUsage orphans;
 public:
-    JobEntry(int job_id, std::string cmd_line, pid_t process_id, time_t time_inserted, bool isStopped, int time_up);
+    JobEntry(int job_id, std::string cmd_line, pid_t process_id, time_t time_inserted, bool isStopped, int time_up,
+             int pidfd = -1);
     ~JobEntry();
     void printJob(Command* cmd, int IO_status);
     int getJobID();
     pid_t getProcessID();
     time_t getTImeInserted();
+    int64_t getStartMs();
     int getTimeUp();
     bool isStoppedProcess();
     void setIsStopped(bool setStopped);
     std::string getCmdLine();
+    int getPidfd();
+    JobUsage* getOrphanUsage();
+    void printStats(Command* cmd, int IO_status);
+    // Signals through the pidfd, so a recycled pid can never be hit; kill() for pid-only jobs.
+    int sendSignal(int sig);
+    // The whole process group the job leads (setpgrp in the child), falling back to the process itself.
+    int signalGroup(int sig);
+};
+
+// A job re-adopted from a state file is not our child: waitid gives ECHILD once it exits, its
+// status went to its real parent. Recorded as this wait status and exit code, never 0..255, so
+// `&&` does not follow it; `wait` says so on stderr and leaves $? at 0, as any builtin does.
+#define JOBS_EXIT_UNKNOWN (-1)
+
+struct FinishedJob {
+    int job_id;
+    pid_t process_id;
+    int exit_code; // JOBS_EXIT_UNKNOWN for a re-adopted job
 };
 
 class JobsList {
     std::vector<JobEntry>* jobs_vec;
+    std::vector<FinishedJob> finished; // reaped, but nobody waited for them yet (oldest dropped first)
     int max_job_id;
     int max_stopped_jod_id;
+    int epoll_fd; // readable pidfds of exited jobs, data.u64 is pid << 32 | pidfd
+    pid_t owner_pid; // forked smash children share epoll_fd, only the shell itself may reap or change it
+    size_t pidfd_count;
+    size_t pidfd_max;
+    JobStateFile state; // `--state FILE`, changed by the shell process only
+    JobUsage unattributed; // orphans whose job had already finished
+    int openPidfd(pid_t pid);
+    void insertJob(JobEntry job);
+    void reapReady(const struct epoll_event* events, int ready);
+    void reapPidJobs();
+    void closePidfd(JobEntry* job);
 public:
     JobsList();
     ~JobsList();
     void addJob(int job_id, const char* cmd_line, pid_t pid, bool isStopped = false);
-    void printJobsList(Command* cmd, int IO_status);
+    void printJobsList(Command* cmd, int IO_status, bool stats = false);
+    // One JSON object per line when format is NULL, else one formatted line per job; the jobs
+    // waiting on others follow the running ones.
+    void writeJobs(StreamWriter* out, const std::vector<JobFormatPart>* format);
+    // Subreaper mode: reaps exited descendants that are not jobs and charges them to the job whose
+    // process group they are in. Must not run while a foreground child is being waited for.
+    void reapOrphans();
     void removeFinishedJobs();
     void updateMaxJobID();
     void updateMaxStoppedJobID();
@@ -49,9 +134,24 @@ public:
     bool isVecEmpty();
     int getMaxJobID();
     int getMaxStoppedJobID();
+    int getEventFd(); // readable when a job with a pidfd exited
+    bool hasPidOnlyJobs(); // jobs past the pidfd limit, their exits do not make getEventFd readable
     void turnToForeground(JobEntry* bg_or_stopped_job, Command* cmd, SmallShell* smash);
     void resumesStoppedJob(JobEntry* stopped_job, Command* cmd);
-    void killAllJobs(Command* cmd);
+    // SIGTERM to every job at once, SIGKILL to whatever is left after timeout_ms; reaps them all.
+    void killAllJobs(Command* cmd, long timeout_ms);
+    bool waitAllJobs(long timeout_ms);
+    void setPidfdLimit(size_t max_pidfds);
+    void setStopped(JobEntry* job, bool stopped);
+    void setDeadline(pid_t pid, time_t deadline);
+    // Maps the state file and re-adopts the jobs recorded in it that are still running.
+    bool attachStateFile(const char* path);
+    static int exitCode(int status);
+    void recordExit(pid_t pid, int status);
+    void recordExits(const std::vector<std::pair<pid_t, int> >& exits); // (pid, wait status) pairs
+    bool takeFinished(int job_id, pid_t pid, int* exit_code);
+    bool peekFinished(int job_id, int* exit_code); // like takeFinished, but the status stays for `wait`
+    int waitJobs(std::vector<pid_t>* pids, bool any, int* exit_code);
 };
 
 class Command {
@@ -59,8 +159,9 @@ protected:
     const char* cmd_line;
     char* cmd_line_without_const;
     char* args[COMMAND_MAX_ARGS];
-    std::string file_name;
+    char* file_name; // last stdout target, written through ChangeIO by builtins
     int IO_status;
+    Redirections redirects;
     int args_length;
     bool is_time_out;
     int time_arg;
@@ -68,11 +169,15 @@ public:
     Command(const char* cmd_line);
     const char* getCmdLine();
     int getIOStatus();
+    int openIOFile(int isAppend);
     void ChangeIO(int isAppend, const char* buff, int length);
     virtual ~Command();
+    static void* operator new(size_t size, Arena* arena);
+    static void operator delete(void* ptr, Arena* arena);
+    static void operator delete(void* ptr);
     virtual void execute() = 0;
-    //virtual void prepare();
-    //virtual void cleanup();
+    virtual bool prepare();
+    virtual void cleanup();
     // TODO: Add your extra methods if needed
 };
 
@@ -87,7 +192,10 @@ class ExternalCommand : public Command {
 public:
     ExternalCommand(const char* cmd_line, JobsList* jobs);
     virtual ~ExternalCommand() {}
+    bool isSimpleCommand();
     void execute() override;
+    bool prepare() override;
+    void cleanup() override;
 };
 
 class PipeCommand : public Command {
@@ -148,6 +256,62 @@ public:
     void execute() override;
 };
 
+class LimitCommand : public BuiltInCommand {
+    JobsList* jobs;
+    SmallShell* smash;
+public:
+    LimitCommand(const char* cmd_line, JobsList* jobs, SmallShell* smash);
+    virtual ~LimitCommand() {}
+    void execute() override;
+};
+
+class OutputCommand : public BuiltInCommand {
+    JobsList* jobs;
+    SmallShell* smash;
+public:
+    OutputCommand(const char* cmd_line, JobsList* jobs, SmallShell* smash);
+    virtual ~OutputCommand() {}
+    void execute() override;
+};
+
+class ReniceCommand : public BuiltInCommand {
+    JobsList* jobs;
+public:
+    ReniceCommand(const char* cmd_line, JobsList* jobs);
+    virtual ~ReniceCommand() {}
+    void execute() override;
+};
+
+// `every DURATION cmd`, `after DURATION cmd` and `after %N.. cmd`: the rest of the line,
+// redirections included, is the scheduled command's, so these do not apply them to themselves.
+class EveryCommand : public BuiltInCommand {
+    SmallShell* smash;
+public:
+    EveryCommand(const char* cmd_line, SmallShell* smash);
+    virtual ~EveryCommand() {}
+    bool prepare() override;
+    void cleanup() override;
+    void execute() override;
+};
+
+class AfterCommand : public BuiltInCommand {
+    SmallShell* smash;
+public:
+    AfterCommand(const char* cmd_line, SmallShell* smash);
+    virtual ~AfterCommand() {}
+    bool prepare() override;
+    void cleanup() override;
+    void execute() override;
+};
+
+class CancelCommand : public BuiltInCommand {
+    SmallShell* smash;
+public:
+    CancelCommand(const char* cmd_line, SmallShell* smash);
+    virtual ~CancelCommand() {}
+    void execute() override;
+};
+
 class JobsCommand : public BuiltInCommand {
     JobsList* jobs;
 public:
@@ -181,6 +345,15 @@ public:
     void execute() override;
 };
 
+class WaitCommand : public BuiltInCommand {
+    JobsList* jobs;
+    SmallShell* smash;
+public:
+    WaitCommand(const char* cmd_line, JobsList* jobs, SmallShell* smash);
+    virtual ~WaitCommand() {}
+    void execute() override;
+};
+
 class HeadCommand : public BuiltInCommand {
     JobsList* jobs;
 public:
@@ -189,9 +362,97 @@ public:
     void execute() override;
 };
 
+class CatCommand : public BuiltInCommand {
+public:
+    CatCommand(const char* cmd_line);
+    virtual ~CatCommand() {}
+    void execute() override;
+};
+
+class TeeCommand : public BuiltInCommand {
+public:
+    TeeCommand(const char* cmd_line);
+    virtual ~TeeCommand() {}
+    void execute() override;
+};
+
+class TraceCommand : public BuiltInCommand {
+public:
+    TraceCommand(const char* cmd_line);
+    virtual ~TraceCommand() {}
+    void execute() override;
+};
+
+class FdsCommand : public BuiltInCommand {
+public:
+    FdsCommand(const char* cmd_line);
+    virtual ~FdsCommand() {}
+    void execute() override;
+};
+
+class SetCommand : public BuiltInCommand {
+    SmallShell* smash;
+public:
+    SetCommand(const char* cmd_line, SmallShell* smash);
+    virtual ~SetCommand() {}
+    void execute() override;
+};
+
+class ExportCommand : public BuiltInCommand {
+    SmallShell* smash;
+public:
+    ExportCommand(const char* cmd_line, SmallShell* smash);
+    virtual ~ExportCommand() {}
+    void execute() override;
+};
+
+class UnsetCommand : public BuiltInCommand {
+    SmallShell* smash;
+public:
+    UnsetCommand(const char* cmd_line, SmallShell* smash);
+    virtual ~UnsetCommand() {}
+    void execute() override;
+};
+
+class EnvCommand : public BuiltInCommand {
+    SmallShell* smash;
+public:
+    EnvCommand(const char* cmd_line, SmallShell* smash);
+    virtual ~EnvCommand() {}
+    void execute() override;
+};
+
+class AliasCommand : public BuiltInCommand {
+    SmallShell* smash;
+public:
+    AliasCommand(const char* cmd_line, SmallShell* smash);
+    virtual ~AliasCommand() {}
+    void execute() override;
+};
+
+class UnaliasCommand : public BuiltInCommand {
+    SmallShell* smash;
+public:
+    UnaliasCommand(const char* cmd_line, SmallShell* smash);
+    virtual ~UnaliasCommand() {}
+    void execute() override;
+};
+
 class SmallShell {
 private:
     JobsList jobs_list;
+    Arena line_arena; // per-line scratch space, released when executeCommand returns
+    std::unordered_map<std::string, std::string> aliases;
+    Environment environment;
+    WildcardExpander wildcards;
+    JobCgroups cgroups;
+    OutputCapture captures;
+    ControlServer control;
+    LaunchOptions background_launch; // nice and scheduling policy `&` jobs start with
+    CommandScheduler scheduler;
+    pid_t last_bg_pid; // the last job CreateCommand started in the background
+    JobGraph job_graph;
+    int launch_job_id; // the id CreateCommand gives the next background job, -1 for a new one
     std::vector<JobEntry> time_jobs_vec;
     std::string prompt;
     char* last_pwd;
@@ -201,10 +462,47 @@ private:
     std::string curr_cmd_line;
     pid_t curr_process_id;
     pid_t smash_pid;
+    rlim_t fd_soft_limit; // RLIMIT_NOFILE soft limit smash was started with, restored for exec'ed programs
+    size_t pipe_size; // F_SETPIPE_SZ for pipelines, 0 = kernel default
+    bool pipe_packet_mode; // O_DIRECT pipes
+    long kill_timeout_ms; // `quit kill` grace period before SIGKILL
+    bool subreaper; // PR_SET_CHILD_SUBREAPER is set
+    volatile sig_atomic_t ctrl_c_pending; // set by the ctrl-C handler, for builtins that block
+    volatile sig_atomic_t stop_copy_pending; // set by ctrl-Z with nothing in the foreground, only cat and tee read it
+    volatile sig_atomic_t stop_pending; // ctrl-Z stopped the foreground process, handleSignals adds its job
+    volatile sig_atomic_t alarm_pending; // SIGALRM came, handleSignals kills what timed out
+    int signal_pipe[2]; // the handlers write a byte here, the waits poll the read end
+    void wakeWaits();
+    void killTimedOut(); // what SIGALRM is for, run by handleSignals
     SmallShell();
 public:
     Command *CreateCommand(const char* cmd_line);
     JobsList* getJobsList();
+    Arena* getArena();
+    Environment* getEnvironment();
+    WildcardExpander* getWildcards();
+    JobCgroups* getCgroups();
+    LaunchOptions* getBackgroundLaunch();
+    OutputCapture* getCaptures();
+    ControlServer* getControl();
+    CommandScheduler* getScheduler();
+    JobGraph* getJobGraph();
+    const std::unordered_map<std::string, std::string>* getAliases();
+    const std::string* findAlias(const char* name, size_t length);
+    void setAlias(const std::string& name, const std::string& value);
+    bool removeAlias(const char* name);
+    const char* expandAlias(const char* cmd_line);
+    size_t getPipeSize();
+    void setPipeSize(size_t size);
+    bool isPipePacketMode();
+    void setPipePacketMode(bool packet_mode);
+    long getKillTimeout();
+    void setKillTimeout(long timeout_ms);
+    bool isSubreaper();
+    bool setSubreaper(bool enable);
+    int openPipe(int pipe_arr[2]);
+    void raiseFdLimit();
+    void restoreFdLimit();
     const char* getPrompt();
     char* getLastPwd();
     const char* getLastCmd();
@@ -214,6 +512,22 @@ public:
     int getSmashPid();
     std::string getCurrCmdLine();
     int findMinAlarm();
+    long timeoutRemainingMs(pid_t pid, int64_t now_ms); // -1 when pid has no timeout
+    void addTimeJob(pid_t pid, const char* cmd_line, time_t start_time, int time_up);
+    void removeTimeJob(pid_t pid);
+    int getLastStatus();
+    void setLastStatus(int status);
+    void setCtrlC();
+    bool takeCtrlC();
+    void setStopCopy();
+    bool takeStopCopy();
+    // For the ctrl-Z and alarm handlers: the jobs list may be in use where the signal came, so they
+    // only leave a flag and wake the waits up; handleSignals does the work from the main loop.
+    void setStopPending();
+    void setAlarmPending();
+    int getSignalFd(); // readable once a handler left work for handleSignals
+    // Adds the job ctrl-Z stopped to the list and kills the commands whose timeout expired.
+    void handleSignals();
     std::vector<JobEntry>* getTimeJobVec();
     bool isLastPwdInitialized();
     void setPrompt(std::string prompt);
@@ -231,7 +545,32 @@ public:
         return instance;
     }
     ~SmallShell();
-    void executeCommand(const char* cmd_line);
+    std::string captureOutput(const char* cmd_line);
+    const char* substituteCommands(const char* cmd_line);
+    const char* expandWords(const char* cmd_line);
+    // expand: fresh input, its words and alias are expanded once here; the nested calls for pipe
+    // halves and timeout get already expanded parts. alias is false for the stages of a line whose
+    // alias was expanded already, so an alias that runs itself cannot recurse.
+    void executeCommand(const char* cmd_line, bool expand = true, bool alias = true);
+    // The main loop's wait for the next line: drains captured output, serves the control socket
+    // and reaps jobs (so their exits reach event subscribers) until fd (stdin) is readable.
+    void waitForInput(int fd);
+    // Starts the due `every`/`after` commands as background jobs; a firing is skipped while the
+    // job of the previous one is still running.
+    void runDueSchedules();
+    // `a && b || c &`, or `after %N ..`: the stages run as background jobs one after the other, each
+    // once the one before finished with the exit code its condition asks for. The first stage waits
+    // for the jobs in after (exit_code is what those that finished already exited with). With alias
+    // each stage's first word is looked up once here, the stages are then launched without it.
+    void startChain(const std::vector<int>& after, int exit_code, const char* cmd_line, bool alias);
+    // Runs cmd_line as a background job under job_id (-1 for a new id); returns the job's id, or
+    // -1 with its status in exit_code when it did not become a job (a builtin, a pipeline).
+    int launchJob(const std::string& cmd_line, int job_id, int* exit_code);
+    // Launches the waiting jobs whose predecessors finished.
+    void runReadyJobs();
+    // waitpid(pid, status, WUNTRACED) for a foreground command. While jobs wait on others, the
+    // background exits that come meanwhile (SIGCHLD) start their successors right away.
+    pid_t waitForeground(pid_t pid, int* status);
     // TODO: add extra methods as needed
 };
 
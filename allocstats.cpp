@@ -0,0 +1,33 @@
+#include <atomic>
+#include <stddef.h>
+#include "arena.h"
+
+// Counts heap allocations by interposing malloc/calloc/realloc in front of glibc's own
+// implementation. Linked into bench_smash, and into smash only when built with ALLOC_STATS=1,
+// so the steady-state "no malloc for builtins" property can be checked (BM_BuiltinLine, trace
+// dump) without routing every allocation of the shipped shell through glibc's private entry points.
+
+static std::atomic<uint64_t> malloc_calls(0);
+
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t num, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+
+void* malloc(size_t size) {
+    malloc_calls.fetch_add(1, std::memory_order_relaxed);
+    return __libc_malloc(size);
+}
+void* calloc(size_t num, size_t size) {
+    malloc_calls.fetch_add(1, std::memory_order_relaxed);
+    return __libc_calloc(num, size);
+}
+void* realloc(void* ptr, size_t size) {
+    malloc_calls.fetch_add(1, std::memory_order_relaxed);
+    return __libc_realloc(ptr, size);
+}
+}
+
+uint64_t Arena::mallocCount() {
+    return malloc_calls.load(std::memory_order_relaxed);
+}
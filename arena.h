@@ -0,0 +1,45 @@
+#ifndef SMASH_ARENA_H_
+#define SMASH_ARENA_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ARENA_INLINE_SIZE (16 * 1024)
+#define ARENA_BLOCK_SIZE (64 * 1024)
+#define ARENA_ALIGNMENT (16)
+
+// Bump allocator for everything that lives only as long as one command line: the Command
+// object, its argv and the parsing scratch strings. Nothing is freed individually; the owner
+// releases back to a mark (or resets) in O(1) once the line was executed. Overflow blocks are
+// kept for the next lines, so a warmed-up arena never calls malloc again.
+class Arena {
+    struct Block {
+        Block* next;
+        size_t size;
+        char* data;
+    };
+    char inline_data[ARENA_INLINE_SIZE];
+    Block inline_block;
+    Block* curr;
+    size_t used;
+public:
+    struct Mark {
+        Block* block;
+        size_t used;
+    };
+    Arena();
+    ~Arena();
+    Arena(Arena const&)          = delete;
+    void operator=(Arena const&) = delete;
+    void* allocate(size_t size);
+    char* copy(const char* s, size_t length);
+    char* copy(const char* s);
+    char* format(const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+    Mark mark();
+    void release(Mark mark);
+    void reset();
+    // Number of malloc/calloc/realloc calls made by this process so far (see allocstats.cpp).
+    static uint64_t mallocCount();
+};
+
+#endif //SMASH_ARENA_H_
@@ -0,0 +1,544 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+#include "Commands.h"
+#include "ioengine.h"
+
+// Self-contained microbenchmarks for smash's hot paths. The flags and the JSON schema follow
+// Google Benchmark (--benchmark_filter, --benchmark_min_time, --benchmark_out), so the output
+// can be fed to its compare.py without pulling the library in.
+
+using namespace std;
+
+// helpers from Commands.cpp that are not exported through Commands.h
+int _parseCommandLine(const char* cmd_line, char** args, Arena* arena);
+int _isPipeCommand(const char* cmd_line);
+void _splitPipeCommands(const char* cmd_line, char** left, char** right, Arena* arena);
+
+static uint64_t _clockNs(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+class BenchState {
+    uint64_t max_iterations;
+    uint64_t iteration;
+    uint64_t real_start;
+    uint64_t cpu_start;
+    bool paused;
+public:
+    long arg;
+    uint64_t real_ns;
+    uint64_t cpu_ns;
+    uint64_t items;
+    uint64_t bytes;
+    uint64_t mallocs; // malloc calls made while timing was running
+    uint64_t mallocs_start;
+    BenchState(uint64_t max_iterations, long arg) : max_iterations(max_iterations), iteration(0),
+        real_start(0), cpu_start(0), paused(true), arg(arg), real_ns(0), cpu_ns(0), items(0), bytes(0),
+        mallocs(0), mallocs_start(0) {}
+    bool keepRunning() {
+        if (iteration == 0)
+            resumeTiming();
+        if (iteration++ < max_iterations)
+            return true;
+        pauseTiming();
+        return false;
+    }
+    void pauseTiming() {
+        if (paused)
+            return;
+        real_ns += _clockNs(CLOCK_MONOTONIC) - real_start;
+        cpu_ns += _clockNs(CLOCK_PROCESS_CPUTIME_ID) - cpu_start;
+        mallocs += Arena::mallocCount() - mallocs_start;
+        paused = true;
+    }
+    void resumeTiming() {
+        if (!paused)
+            return;
+        mallocs_start = Arena::mallocCount();
+        real_start = _clockNs(CLOCK_MONOTONIC);
+        cpu_start = _clockNs(CLOCK_PROCESS_CPUTIME_ID);
+        paused = false;
+    }
+    uint64_t iterations() {
+        return max_iterations;
+    }
+};
+
+struct Benchmark {
+    std::string name;
+    void (*fn)(BenchState&);
+    long arg;
+    bool large; // only run with --large
+};
+
+struct BenchResult {
+    std::string name;
+    uint64_t iterations;
+    double real_ns;
+    double cpu_ns;
+    double items_per_second;
+    double bytes_per_second;
+    double mallocs_per_iteration;
+};
+
+static std::vector<Benchmark>& _registry() {
+    static std::vector<Benchmark> benchmarks;
+    return benchmarks;
+}
+
+static void _register(const char* name, void (*fn)(BenchState&), long arg = -1, bool large = false) {
+    Benchmark b;
+    b.name = name;
+    if (arg >= 0)
+        b.name += "/" + std::to_string(arg);
+    b.fn = fn;
+    b.arg = arg;
+    b.large = large;
+    _registry().push_back(b);
+}
+
+static std::string bench_dir;
+static pid_t bench_pid;
+
+static std::string _makeFile(const char* name, size_t size, size_t line_length) {
+    std::string path = bench_dir + "/" + name;
+    if (access(path.c_str(), F_OK) == 0)
+        return path;
+    int fd = open(path.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if (fd == -1) {
+        perror("bench: open failed");
+        exit(1);
+    }
+    std::string line(line_length - 1, 'x');
+    line += '\n';
+    for (size_t written = 0; written < size; written += line.size()) {
+        if (write(fd, line.c_str(), line.size()) == -1) {
+            perror("bench: write failed");
+            exit(1);
+        }
+    }
+    close(fd);
+    return path;
+}
+
+static void _fillJobs(JobsList* jobs, long num_jobs) {
+    // tracked by pid only, as past the pidfd limit: a pidfd per fake job runs out of descriptors
+    // long before 100k, and waitpid on our own pid never reaps one
+    jobs->setPidfdLimit(0);
+    for (long i = 0; i < num_jobs; i++)
+        jobs->addJob(-1, "sleep 100", getpid(), false); // our own pid, so every job looks alive
+}
+
+// Filled lists are shared between benchmarks and growth rounds: filling goes through addJob,
+// which is itself measured by BM_JobsList_addJob and is far too slow to repeat at 100k jobs.
+static JobsList* _filledJobs(long num_jobs) {
+    static std::vector<std::pair<long, JobsList*> > cache;
+    for (size_t i = 0; i < cache.size(); i++)
+        if (cache[i].first == num_jobs)
+            return cache[i].second;
+    JobsList* jobs = new JobsList();
+    _fillJobs(jobs, num_jobs);
+    cache.push_back(std::make_pair(num_jobs, jobs));
+    return jobs;
+}
+
+// <---------- START parsing benchmarks ------------>
+static void BM_parseCommandLine(BenchState& state) {
+    Arena arena;
+    char* args[COMMAND_MAX_ARGS];
+    const char* line = "  ls -l --color=auto /usr/include /usr/lib /tmp  ";
+    while (state.keepRunning()) {
+        _parseCommandLine(line, args, &arena);
+        arena.reset();
+    }
+    state.items = state.iterations();
+}
+
+static void BM_parseRedirections(BenchState& state) {
+    Arena arena;
+    const char* line = "sort -r < /tmp/input.txt >> /tmp/some/output/file.txt 2>&1";
+    while (state.keepRunning()) {
+        Redirections redirects;
+        char* file_name;
+        redirects.parse(line, &arena);
+        redirects.stdoutStatus(&file_name);
+        arena.reset();
+    }
+    state.items = state.iterations();
+}
+
+static void BM_expandVariables(BenchState& state) {
+    Arena arena;
+    Environment environment;
+    environment.set("BENCH_DIR", "/tmp/bench");
+    const char* line = "ls -l $HOME ${BENCH_DIR}/out '$NOT_EXPANDED' \"$BENCH_DIR\"";
+    while (state.keepRunning()) {
+        environment.expand(line, &arena);
+        arena.reset();
+    }
+    state.items = state.iterations();
+}
+
+// arg: 0 = directory cache off, 1 = on; globs a 1000 entry directory
+static void BM_expandWildcards(BenchState& state) {
+    std::string dir = bench_dir + "/glob";
+    if (access(dir.c_str(), F_OK) != 0) {
+        mkdir(dir.c_str(), 0755);
+        for (int i = 0; i < 1000; i++)
+            close(open((dir + "/file" + std::to_string(i) + (i % 10 == 0 ? ".log" : ".txt")).c_str(), O_WRONLY|O_CREAT, 0644));
+    }
+    Arena arena;
+    WildcardExpander wildcards;
+    wildcards.setCacheEnabled(state.arg == 1);
+    std::string line = "ls -l " + dir + "/*.log";
+    while (state.keepRunning()) {
+        wildcards.expand(line.c_str(), &arena);
+        arena.reset();
+    }
+    state.items = state.iterations();
+}
+
+static void BM_splitPipeCommands(BenchState& state) {
+    Arena arena;
+    const char* line = "cat /var/log/syslog |& grep -i error";
+    while (state.keepRunning()) {
+        char* left;
+        char* right;
+        if (_isPipeCommand(line) > 0)
+            _splitPipeCommands(line, &left, &right, &arena);
+        arena.reset();
+    }
+    state.items = state.iterations();
+}
+// <---------- END parsing benchmarks ------------>
+
+// <---------- START JobsList benchmarks ------------>
+static void BM_JobsList_addJob(BenchState& state) {
+    while (state.keepRunning()) {
+        state.pauseTiming();
+        JobsList* jobs = new JobsList();
+        state.resumeTiming();
+        _fillJobs(jobs, state.arg);
+        state.pauseTiming();
+        delete jobs;
+        state.resumeTiming();
+    }
+    state.items = state.iterations() * state.arg;
+}
+
+static void BM_JobsList_getJobById(BenchState& state) {
+    JobsList* jobs = _filledJobs(state.arg);
+    long job_id = 0;
+    while (state.keepRunning()) {
+        job_id = job_id * 1103515245 % state.arg + 1; // spread lookups over the whole list
+        if (jobs->getJobById(job_id) == NULL)
+            abort();
+    }
+    state.items = state.iterations();
+}
+
+static void BM_JobsList_removeFinishedJobs(BenchState& state) {
+    JobsList* jobs = _filledJobs(state.arg);
+    while (state.keepRunning()) {
+        jobs->removeFinishedJobs();
+    }
+    state.items = state.iterations() * state.arg;
+}
+
+static void BM_JobsList_printJobsList(BenchState& state) {
+    JobsList* jobs = _filledJobs(state.arg);
+    std::string line = "jobs > " + bench_dir + "/jobs_output.txt";
+    Arena* arena = SmallShell::getInstance().getArena();
+    Arena::Mark mark = arena->mark();
+    JobsCommand cmd(line.c_str(), jobs);
+    Arena::Mark cmd_mark = arena->mark();
+    while (state.keepRunning()) {
+        jobs->printJobsList(&cmd, cmd.getIOStatus());
+        arena->release(cmd_mark);
+    }
+    arena->release(mark);
+    state.items = state.iterations() * state.arg;
+}
+
+static void BM_JobsList_writeJobs(BenchState& state) {
+    JobsList* jobs = _filledJobs(state.arg);
+    std::string path = bench_dir + "/jobs_json.txt";
+    while (state.keepRunning()) {
+        int fd = open(path.c_str(), O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+        {
+            StreamWriter out(fd);
+            jobs->writeJobs(&out, NULL);
+        }
+        close(fd);
+    }
+    state.items = state.iterations() * state.arg;
+}
+// <---------- END JobsList benchmarks ------------>
+
+// <---------- START command benchmarks ------------>
+static void BM_HeadCommand(BenchState& state) {
+    size_t size = (size_t)state.arg << 20;
+    std::string path = _makeFile(state.arg == 1 ? "head_1m.txt" : "head_large.txt", size, 100);
+    std::string line = "head -" + std::to_string(size / 100) + " " + path + " > /dev/null";
+    Arena* arena = SmallShell::getInstance().getArena();
+    while (state.keepRunning()) {
+        Arena::Mark mark = arena->mark();
+        HeadCommand cmd(line.c_str(), NULL);
+        cmd.execute();
+        arena->release(mark);
+    }
+    state.bytes = state.iterations() * size;
+}
+
+// The same through plain read/write syscalls, against the io_uring engine above.
+static void BM_HeadCommandSync(BenchState& state) {
+    IoEngine::setUringAllowed(false);
+    BM_HeadCommand(state);
+    IoEngine::setUringAllowed(true);
+}
+
+// head -50 over 200 files of 64KiB, on state.arg worker threads (1 is the sequential path).
+static void BM_HeadManyFiles(BenchState& state) {
+    std::string line = "head -50 -P " + std::to_string(state.arg);
+    for (int i = 0; i < 200; i++) {
+        std::string name = "head_many_" + std::to_string(i) + ".txt";
+        line += " " + _makeFile(name.c_str(), 64 << 10, 100);
+    }
+    line += " > /dev/null";
+    Arena* arena = SmallShell::getInstance().getArena();
+    while (state.keepRunning()) {
+        Arena::Mark mark = arena->mark();
+        HeadCommand cmd(line.c_str(), NULL);
+        cmd.execute();
+        arena->release(mark);
+    }
+    state.items = state.iterations() * 200;
+}
+
+// cat of a state.arg MB file into another file: the builtin in-process against /usr/bin/cat,
+// which smash forks and execs.
+static std::string _catInput(long megabytes) {
+    std::string name = "cat_" + std::to_string(megabytes) + "m.txt";
+    return _makeFile(name.c_str(), (size_t)megabytes << 20, 4096);
+}
+
+static void BM_CatCommand(BenchState& state) {
+    std::string line = "cat " + _catInput(state.arg) + " > " + bench_dir + "/cat_output.txt";
+    SmallShell& smash = SmallShell::getInstance();
+    while (state.keepRunning()) {
+        smash.executeCommand(line.c_str());
+    }
+    state.bytes = state.iterations() * ((uint64_t)state.arg << 20);
+}
+
+static void BM_CatCoreutils(BenchState& state) {
+    std::string line = "/usr/bin/cat " + _catInput(state.arg) + " > " + bench_dir + "/cat_output.txt";
+    SmallShell& smash = SmallShell::getInstance();
+    while (state.keepRunning()) {
+        smash.executeCommand(line.c_str());
+        if (getpid() != bench_pid)
+            _exit(1);
+    }
+    state.bytes = state.iterations() * ((uint64_t)state.arg << 20);
+}
+
+// cat | tee into two files and /dev/null; the stages are forked either way, the builtins skip the exec.
+static void BM_TeePipeline(BenchState& state) {
+    std::string out = bench_dir + "/tee_output";
+    std::string line = "cat " + _catInput(state.arg) + " | tee " + out + "1.txt " + out + "2.txt > /dev/null";
+    SmallShell& smash = SmallShell::getInstance();
+    while (state.keepRunning()) {
+        smash.executeCommand(line.c_str());
+        if (getpid() != bench_pid)
+            _exit(0);
+    }
+    state.bytes = state.iterations() * ((uint64_t)state.arg << 20);
+}
+
+static void BM_TeeCoreutils(BenchState& state) {
+    std::string out = bench_dir + "/tee_output";
+    std::string line = "/usr/bin/cat " + _catInput(state.arg) + " | /usr/bin/tee " + out + "1.txt " + out + "2.txt > /dev/null";
+    SmallShell& smash = SmallShell::getInstance();
+    while (state.keepRunning()) {
+        smash.executeCommand(line.c_str());
+        if (getpid() != bench_pid)
+            _exit(0);
+    }
+    state.bytes = state.iterations() * ((uint64_t)state.arg << 20);
+}
+
+// Whole executeCommand path for a builtin line; mallocs_per_iteration should stay at 0.
+static void BM_BuiltinLine(BenchState& state) {
+    static const char* const lines[] = {"pwd > /dev/null", "showpid > /dev/null", "jobs > /dev/null", "chprompt smash"};
+    SmallShell& smash = SmallShell::getInstance();
+    smash.executeCommand(lines[state.arg]); // warm-up, the first line may grow the arena
+    while (state.keepRunning()) {
+        smash.executeCommand(lines[state.arg]);
+    }
+    state.items = state.iterations();
+}
+
+static void BM_ExternalLaunch(BenchState& state) {
+    SmallShell& smash = SmallShell::getInstance();
+    while (state.keepRunning()) {
+        smash.executeCommand("/bin/true");
+        if (getpid() != bench_pid)
+            _exit(1); // exec failed in the forked child, never run the rest of the suite twice
+    }
+    state.items = state.iterations();
+}
+// <---------- END command benchmarks ------------>
+
+static BenchResult _run(const Benchmark& b, double min_time) {
+    uint64_t iterations = 1;
+    for (;;) {
+        BenchState state(iterations, b.arg);
+        b.fn(state);
+        double seconds = state.real_ns / 1e9;
+        if (seconds >= min_time || iterations >= 1000000000ULL) {
+            BenchResult r;
+            r.name = b.name;
+            r.iterations = iterations;
+            r.real_ns = (double)state.real_ns / iterations;
+            r.cpu_ns = (double)state.cpu_ns / iterations;
+            r.items_per_second = (seconds > 0) ? state.items / seconds : 0;
+            r.bytes_per_second = (seconds > 0) ? state.bytes / seconds : 0;
+            r.mallocs_per_iteration = (double)state.mallocs / iterations;
+            return r;
+        }
+        // same growth rule as Google Benchmark: aim for min_time with 40% headroom, at most 10x per step
+        double multiplier = (seconds > 0) ? min_time * 1.4 / seconds : 10;
+        if (multiplier > 10)
+            multiplier = 10;
+        if (multiplier < 2)
+            multiplier = 2;
+        iterations = (uint64_t)(iterations * multiplier);
+    }
+}
+
+static void _writeJson(FILE* out, const std::vector<BenchResult>& results) {
+    char date[64];
+    time_t now = time(NULL);
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S%z", localtime(&now));
+    struct utsname uts;
+    uname(&uts);
+    fprintf(out, "{\n  \"context\": {\n    \"date\": \"%s\",\n    \"host_name\": \"%s\",\n"
+            "    \"executable\": \"bench_smash\",\n    \"num_cpus\": %ld,\n    \"library_build_type\": \"release\"\n  },\n"
+            "  \"benchmarks\": [", date, uts.nodename, sysconf(_SC_NPROCESSORS_ONLN));
+    for (size_t i = 0; i < results.size(); i++) {
+        const BenchResult& r = results[i];
+        fprintf(out, "%s\n    {\n      \"name\": \"%s\",\n      \"run_name\": \"%s\",\n      \"run_type\": \"iteration\",\n"
+                "      \"iterations\": %llu,\n      \"real_time\": %.3f,\n      \"cpu_time\": %.3f,\n      \"time_unit\": \"ns\"",
+                i == 0 ? "" : ",", r.name.c_str(), r.name.c_str(), (unsigned long long)r.iterations, r.real_ns, r.cpu_ns);
+        if (r.items_per_second > 0)
+            fprintf(out, ",\n      \"items_per_second\": %.3f", r.items_per_second);
+        if (r.bytes_per_second > 0)
+            fprintf(out, ",\n      \"bytes_per_second\": %.3f", r.bytes_per_second);
+        fprintf(out, ",\n      \"mallocs_per_iteration\": %.3f", r.mallocs_per_iteration);
+        fprintf(out, "\n    }");
+    }
+    fprintf(out, "\n  ]\n}\n");
+}
+
+int main(int argc, char* argv[]) {
+    std::string filter;
+    std::string out_path;
+    double min_time = 0.5;
+    bool large = false;
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--benchmark_filter=", 19) == 0)
+            filter = argv[i] + 19;
+        else if (strncmp(argv[i], "--benchmark_out=", 16) == 0)
+            out_path = argv[i] + 16;
+        else if (strncmp(argv[i], "--benchmark_min_time=", 21) == 0)
+            min_time = atof(argv[i] + 21);
+        else if (strcmp(argv[i], "--large") == 0)
+            large = true;
+        else {
+            std::cerr << "usage: " << argv[0] << " [--benchmark_filter=SUBSTR] [--benchmark_out=FILE]"
+                      << " [--benchmark_min_time=SECS] [--large]" << endl;
+            return 1;
+        }
+    }
+    char dir_template[] = "/tmp/smash_bench.XXXXXX";
+    if (mkdtemp(dir_template) == NULL) {
+        perror("bench: mkdtemp failed");
+        return 1;
+    }
+    bench_dir = dir_template;
+    bench_pid = getpid();
+
+    _register("BM_parseCommandLine", BM_parseCommandLine);
+    _register("BM_parseRedirections", BM_parseRedirections);
+    _register("BM_expandVariables", BM_expandVariables);
+    _register("BM_expandWildcards", BM_expandWildcards, 0);
+    _register("BM_expandWildcards", BM_expandWildcards, 1);
+    _register("BM_splitPipeCommands", BM_splitPipeCommands);
+    const long job_counts[] = {10, 1000, 100000};
+    for (long num_jobs : job_counts) {
+        bool slow_fill = (num_jobs > 1000); // addJob is O(n), a 100k fill takes minutes
+        _register("BM_JobsList_addJob", BM_JobsList_addJob, num_jobs, slow_fill);
+        _register("BM_JobsList_getJobById", BM_JobsList_getJobById, num_jobs, slow_fill);
+        _register("BM_JobsList_removeFinishedJobs", BM_JobsList_removeFinishedJobs, num_jobs, slow_fill);
+    }
+    _register("BM_JobsList_printJobsList", BM_JobsList_printJobsList, 10);
+    _register("BM_JobsList_printJobsList", BM_JobsList_printJobsList, 1000);
+    _register("BM_JobsList_printJobsList", BM_JobsList_printJobsList, 100000, true);
+    _register("BM_JobsList_writeJobs", BM_JobsList_writeJobs, 1000);
+    _register("BM_JobsList_writeJobs", BM_JobsList_writeJobs, 100000, true);
+    _register("BM_HeadCommand_MB", BM_HeadCommand, 1);
+    _register("BM_HeadCommand_MB", BM_HeadCommand, 100, true);
+    _register("BM_HeadCommandSync_MB", BM_HeadCommandSync, 1);
+    _register("BM_HeadCommandSync_MB", BM_HeadCommandSync, 100, true);
+    _register("BM_HeadManyFiles_threads", BM_HeadManyFiles, 1);
+    _register("BM_HeadManyFiles_threads", BM_HeadManyFiles, 4);
+    _register("BM_CatCommand_MB", BM_CatCommand, 64);
+    _register("BM_CatCommand_MB", BM_CatCommand, 4096, true);
+    _register("BM_CatCoreutils_MB", BM_CatCoreutils, 64);
+    _register("BM_CatCoreutils_MB", BM_CatCoreutils, 4096, true);
+    _register("BM_TeePipeline_MB", BM_TeePipeline, 64);
+    _register("BM_TeePipeline_MB", BM_TeePipeline, 4096, true);
+    _register("BM_TeeCoreutils_MB", BM_TeeCoreutils, 64);
+    _register("BM_TeeCoreutils_MB", BM_TeeCoreutils, 4096, true);
+    for (long line = 0; line < 4; line++)
+        _register("BM_BuiltinLine", BM_BuiltinLine, line);
+    _register("BM_ExternalLaunch", BM_ExternalLaunch);
+
+    std::vector<BenchResult> results;
+    printf("%-44s %15s %15s %12s %10s\n", "Benchmark", "Time (ns)", "CPU (ns)", "Iterations", "Mallocs");
+    for (const Benchmark& b : _registry()) {
+        if (b.large && !large)
+            continue;
+        if (!filter.empty() && b.name.find(filter) == std::string::npos)
+            continue;
+        BenchResult r = _run(b, min_time);
+        printf("%-44s %15.1f %15.1f %12llu %10.2f\n", r.name.c_str(), r.real_ns, r.cpu_ns,
+               (unsigned long long)r.iterations, r.mallocs_per_iteration);
+        fflush(stdout);
+        results.push_back(r);
+    }
+    if (!out_path.empty()) {
+        FILE* out = fopen(out_path.c_str(), "w");
+        if (out == NULL) {
+            perror("bench: fopen failed");
+            return 1;
+        }
+        _writeJson(out, results);
+        fclose(out);
+    }
+    std::string cleanup = "rm -rf " + bench_dir;
+    if (system(cleanup.c_str()) != 0)
+        perror("bench: cleanup failed");
+    return 0;
+}
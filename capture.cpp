@@ -0,0 +1,295 @@
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "capture.h"
+
+OutputRing::OutputRing() : memfd(-1), data(NULL), capacity(0), total(0), pipe_fd(-1) {}
+
+OutputRing::~OutputRing() {
+    if (data != NULL)
+        munmap(data, capacity);
+    if (memfd != -1)
+        close(memfd);
+    closePipe();
+}
+
+bool OutputRing::create(size_t capacity, int pipe_fd) {
+    this->pipe_fd = pipe_fd;
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    capacity = (capacity + page - 1) / page * page;
+    memfd = memfd_create("smash-output", MFD_CLOEXEC);
+    if (memfd == -1) {
+        perror("smash error: memfd_create failed");
+        return false;
+    }
+    if (ftruncate(memfd, capacity) == -1) {
+        perror("smash error: ftruncate failed");
+        return false;
+    }
+    void* mapping = mmap(NULL, capacity, PROT_READ|PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (mapping == MAP_FAILED) {
+        perror("smash error: mmap failed");
+        return false;
+    }
+    data = (char*)mapping;
+    this->capacity = capacity;
+    return true;
+}
+
+int OutputRing::getPipeFd() {
+    return this->pipe_fd;
+}
+
+bool OutputRing::isOpen() {
+    return this->pipe_fd != -1;
+}
+
+uint64_t OutputRing::getTotal() {
+    return this->total;
+}
+
+bool OutputRing::drain() {
+    if (pipe_fd == -1)
+        return false;
+    // bounded, a job writing as fast as smash reads must not keep it here
+    for (size_t budget = CAPTURE_DRAIN_MAX; budget > 0;) {
+        size_t pos = total % capacity;
+        ssize_t n = read(pipe_fd, data + pos, std::min(capacity - pos, budget));
+        if (n > 0) {
+            total += n;
+            budget -= n;
+        }
+        else if (n == 0) {
+            return false;
+        }
+        else if (errno != EINTR) {
+            if (errno == EAGAIN)
+                return true;
+            perror("smash error: read failed");
+            return false;
+        }
+    }
+    return true;
+}
+
+void OutputRing::closePipe() {
+    if (pipe_fd != -1)
+        close(pipe_fd);
+    pipe_fd = -1;
+}
+
+uint64_t OutputRing::writeTo(int fd, uint64_t from) {
+    if (total > capacity && from < total - capacity)
+        from = total - capacity; // overwritten already
+    struct stat st;
+    bool zero_copy = fstat(fd, &st) == 0 && (S_ISREG(st.st_mode) || S_ISFIFO(st.st_mode));
+    while (from < total) {
+        size_t pos = from % capacity;
+        size_t length = std::min((size_t)(total - from), capacity - pos);
+        ssize_t n;
+        if (zero_copy) {
+            off_t offset = pos;
+            n = sendfile(fd, memfd, &offset, length);
+            if (n == -1 && (errno == EINVAL || errno == ENOSYS)) { // e.g. an O_APPEND file on an older kernel
+                zero_copy = false;
+                continue;
+            }
+        }
+        else {
+            n = write(fd, data + pos, length);
+        }
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("smash error: write failed");
+            break;
+        }
+        from += n;
+    }
+    return from;
+}
+
+OutputCapture::OutputCapture() : ring_size(0), epoll_fd(-1), pending(NULL), pending_write_fd(-1), open_pipes(0) {}
+
+OutputCapture::~OutputCapture() {
+    attach(-1);
+    for (std::map<int, OutputRing*>::iterator it = rings.begin(); it != rings.end(); ++it)
+        delete it->second;
+    if (epoll_fd != -1)
+        close(epoll_fd);
+}
+
+size_t OutputCapture::getRingSize() {
+    return this->ring_size;
+}
+
+void OutputCapture::setRingSize(size_t size) {
+    this->ring_size = size; // jobs started from now on, running ones keep their ring
+}
+
+bool OutputCapture::prepare() {
+    if (ring_size == 0)
+        return false;
+    if (epoll_fd == -1 && (epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        perror("smash error: epoll_create1 failed");
+        return false;
+    }
+    int pipe_arr[2];
+    if (pipe2(pipe_arr, O_CLOEXEC) == -1) {
+        perror("smash error: pipe failed");
+        return false;
+    }
+    // only smash's end: the job gets an ordinary blocking pipe
+    if (fcntl(pipe_arr[0], F_SETFL, O_NONBLOCK) == -1)
+        perror("smash error: fcntl failed");
+    OutputRing* ring = new OutputRing();
+    if (!ring->create(ring_size, pipe_arr[0])) {
+        delete ring;
+        close(pipe_arr[1]);
+        return false;
+    }
+    pending = ring;
+    pending_write_fd = pipe_arr[1];
+    return true;
+}
+
+void OutputCapture::redirectChild() {
+    if (pending == NULL)
+        return;
+    if (dup2(pending_write_fd, STDOUT_FILENO) == -1 || dup2(pending_write_fd, STDERR_FILENO) == -1)
+        perror("smash error: dup2 failed");
+    close(pending_write_fd);
+}
+
+void OutputCapture::attach(int job_id) {
+    if (pending == NULL)
+        return;
+    OutputRing* ring = pending;
+    pending = NULL;
+    close(pending_write_fd);
+    pending_write_fd = -1;
+    if (job_id == -1) {
+        delete ring;
+        return;
+    }
+    forget(job_id); // of an earlier job that had the same id
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = ring;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, ring->getPipeFd(), &event) == -1) {
+        perror("smash error: epoll_ctl failed");
+        ring->closePipe();
+    }
+    else {
+        open_pipes++;
+    }
+    rings[job_id] = ring;
+}
+
+OutputRing* OutputCapture::find(int job_id) {
+    std::map<int, OutputRing*>::iterator it = rings.find(job_id);
+    return (it != rings.end()) ? it->second : NULL;
+}
+
+void OutputCapture::closeRing(OutputRing* ring) {
+    if (!ring->isOpen())
+        return;
+    // removed explicitly: a forked pipeline stage may still hold a copy of the read end, and epoll
+    // only forgets a descriptor by itself once every copy is closed
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, ring->getPipeFd(), NULL);
+    ring->closePipe();
+    open_pipes--;
+}
+
+void OutputCapture::drainRing(OutputRing* ring) {
+    if (ring->isOpen() && !ring->drain())
+        closeRing(ring);
+}
+
+void OutputCapture::forget(int job_id) {
+    std::map<int, OutputRing*>::iterator it = rings.find(job_id);
+    if (it == rings.end())
+        return;
+    closeRing(it->second);
+    delete it->second;
+    rings.erase(it);
+    std::deque<int>::iterator done = std::find(finished.begin(), finished.end(), job_id);
+    if (done != finished.end())
+        finished.erase(done);
+}
+
+void OutputCapture::jobFinished(int job_id) {
+    OutputRing* ring = find(job_id);
+    if (ring == NULL)
+        return;
+    drainRing(ring);
+    if (std::find(finished.begin(), finished.end(), job_id) == finished.end())
+        finished.push_back(job_id);
+    // the oldest finished rings go first; one still open (something the job started keeps
+    // writing) is kept capturing
+    for (size_t i = 0; finished.size() > CAPTURE_FINISHED_MAX && i < finished.size();) {
+        OutputRing* old = find(finished[i]);
+        if (old != NULL && old->isOpen())
+            i++;
+        else
+            forget(finished[i]);
+    }
+}
+
+void OutputCapture::drainReady(int timeout_ms) {
+    if (open_pipes == 0)
+        return;
+    struct epoll_event events[CAPTURE_EPOLL_BATCH];
+    int ready = epoll_wait(epoll_fd, events, CAPTURE_EPOLL_BATCH, timeout_ms);
+    for (int i = 0; i < ready; i++)
+        drainRing((OutputRing*)events[i].data.ptr);
+}
+
+int OutputCapture::getEventFd() {
+    return (open_pipes > 0) ? epoll_fd : -1;
+}
+
+uint64_t OutputCapture::relay(int job_id, int fd, uint64_t from) {
+    OutputRing* ring = find(job_id);
+    if (ring == NULL || !ring->isOpen())
+        return from;
+    struct pollfd pfd = {epoll_fd, POLLIN, 0};
+    if (poll(&pfd, 1, -1) == -1) {
+        if (errno != EINTR)
+            perror("smash error: poll failed");
+        return from;
+    }
+    drainReady(0);
+    ring = find(job_id); // a finished job's ring may have been dropped meanwhile
+    return (ring != NULL) ? ring->writeTo(fd, from) : from;
+}
+
+pid_t OutputCapture::waitForeground(int job_id, pid_t pid, int pidfd, int signal_fd, void (*on_signal)(), int* status) {
+    OutputRing* ring = find(job_id);
+    uint64_t shown = (ring != NULL) ? ring->getTotal() : 0; // what it wrote before stays for `output`
+    while ((ring = find(job_id)) != NULL && ring->isOpen()) {
+        pid_t result = waitpid(pid, status, WUNTRACED|WNOHANG);
+        if (result != 0) {
+            drainRing(ring);
+            ring->writeTo(STDOUT_FILENO, shown);
+            return result;
+        }
+        // poll skips a negative pidfd
+        struct pollfd pfds[3] = {{ring->getPipeFd(), POLLIN, 0}, {signal_fd, POLLIN, 0}, {pidfd, POLLIN, 0}};
+        poll(pfds, 3, CAPTURE_STOP_POLL_MS);
+        if (pfds[1].revents != 0)
+            on_signal(); // a timeout may kill the job meanwhile
+        drainRing(ring);
+        shown = ring->writeTo(STDOUT_FILENO, shown);
+    }
+    return 0; // nothing left to relay
+}
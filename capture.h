@@ -0,0 +1,84 @@
+#ifndef SMASH_CAPTURE_H_
+#define SMASH_CAPTURE_H_
+
+#include <deque>
+#include <map>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define CAPTURE_RING_DEFAULT (1 << 20) // `set capture on`
+#define CAPTURE_FINISHED_MAX (16) // rings of finished jobs kept for `output %N`
+#define CAPTURE_EPOLL_BATCH (16)
+#define CAPTURE_DRAIN_MAX (1 << 20) // read from one pipe per drain, however small its ring
+#define CAPTURE_STOP_POLL_MS (100) // a foreground job's stop is seen by waitpid, not by poll
+
+// The last `capacity` bytes a job wrote to stdout and stderr, in a memfd mapped into smash: a
+// large log lives in shmem pages the kernel may swap, not on smash's heap. The job writes into
+// a pipe that smash reads straight into the mapping.
+class OutputRing {
+    int memfd;
+    char* data;
+    size_t capacity;
+    uint64_t total;   // bytes ever written; byte i is at data[i % capacity] while i >= total - capacity
+    int pipe_fd;      // read end, -1 once the job and everything it started closed the write end
+public:
+    OutputRing();
+    ~OutputRing();
+    OutputRing(OutputRing const&)      = delete;
+    void operator=(OutputRing const&)  = delete;
+    bool create(size_t capacity, int pipe_fd);
+    int getPipeFd();
+    bool isOpen();
+    uint64_t getTotal();
+    // Reads what the pipe holds without blocking, at most CAPTURE_DRAIN_MAX; false at EOF.
+    bool drain();
+    void closePipe();
+    // Writes the bytes from `from` (or the oldest still held) up to getTotal() to fd and returns
+    // where it stopped. A file or a pipe gets them by sendfile, without copying them through smash.
+    uint64_t writeTo(int fd, uint64_t from);
+};
+
+// Optional capture of `&` jobs' output (`set capture on|SIZE|off`). The pipes of running jobs
+// sit in one epoll set, which the main loop waits on together with stdin (SmallShell::waitForInput),
+// so output is drained while smash sits at the prompt.
+class OutputCapture {
+    size_t ring_size; // 0 = off
+    int epoll_fd;
+    OutputRing* pending; // created before the fork, handed to the job by attach()
+    int pending_write_fd;
+    size_t open_pipes;
+    std::map<int, OutputRing*> rings; // by job id
+    std::deque<int> finished; // job ids whose job is gone, oldest first
+    void drainRing(OutputRing* ring);
+    void closeRing(OutputRing* ring);
+public:
+    OutputCapture();
+    ~OutputCapture();
+    OutputCapture(OutputCapture const&)  = delete;
+    void operator=(OutputCapture const&) = delete;
+    size_t getRingSize();
+    void setRingSize(size_t size);
+    // Before forking a background job; false when capture is off or the ring could not be made.
+    bool prepare();
+    // In the child: stdout and stderr to the ring's pipe.
+    void redirectChild();
+    // In smash after the fork; job_id -1 when the fork failed.
+    void attach(int job_id);
+    OutputRing* find(int job_id);
+    void jobFinished(int job_id);
+    // Drops the ring kept under job_id, before the id is given to a new job.
+    void forget(int job_id);
+    // Drains every pipe with data waiting, blocking at most timeout_ms for the first.
+    void drainReady(int timeout_ms);
+    // Readable while a job's pipe has data; -1 when no captured job is running.
+    int getEventFd();
+    // Waits for more output from any job, then writes what job_id's ring gained since from to fd
+    // and returns the new position. Returns early on a signal, so the caller can check for ctrl-C.
+    uint64_t relay(int job_id, int fd, uint64_t from);
+    // waitpid(pid, WUNTRACED) for a captured job brought to the foreground, relaying its output
+    // to the terminal meanwhile; pidfd (-1 if none) wakes the wait up when the job exits, and
+    // on_signal runs whenever signal_fd is readable. 0 when the output ended before the job did.
+    pid_t waitForeground(int job_id, pid_t pid, int pidfd, int signal_fd, void (*on_signal)(), int* status);
+};
+
+#endif //SMASH_CAPTURE_H_
@@ -0,0 +1,243 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include "cgroup.h"
+
+static bool _writeCgroupFile(const std::string& dir, const char* name, const char* value) {
+    std::string path = dir + "/" + name;
+    int fd = open(path.c_str(), O_WRONLY|O_CLOEXEC);
+    if (fd == -1 || write(fd, value, strlen(value)) == -1) {
+        fprintf(stderr, "smash error: cgroup: %s: %s\n", name, strerror(errno));
+        if (fd != -1)
+            close(fd);
+        return false;
+    }
+    close(fd);
+    return true;
+}
+
+static bool _readCgroupFile(const std::string& dir, const char* name, char* buff, size_t size) {
+    std::string path = dir + "/" + name;
+    int fd = open(path.c_str(), O_RDONLY|O_CLOEXEC);
+    if (fd == -1)
+        return false;
+    ssize_t length = read(fd, buff, size - 1);
+    close(fd);
+    if (length < 0)
+        return false;
+    buff[length] = 0;
+    return true;
+}
+
+bool parseJobLimits(char** words, int count, JobLimits* limits) {
+    limits->cpu_percent = limits->mem_bytes = limits->pids = -1;
+    for (int i = 0; i < count; i++) {
+        char* value = strchr(words[i], '=');
+        if (value == NULL)
+            return false;
+        value++;
+        char* end;
+        errno = 0;
+        long long number = strtoll(value, &end, 10);
+        if (end == value || errno != 0 || number < 0)
+            return false;
+        if (strncmp(words[i], "cpu=", 4) == 0 && strcmp(end, "%") == 0 && number > 0) {
+            limits->cpu_percent = (long)number;
+        }
+        else if (strncmp(words[i], "mem=", 4) == 0) {
+            int shift = (*end == 0) ? 0 : (*end == 'K' || *end == 'k') ? 10 : (*end == 'M' || *end == 'm') ? 20 :
+                        (*end == 'G' || *end == 'g') ? 30 : -1;
+            if (shift == -1 || (*end != 0 && end[1] != 0) || number > (LLONG_MAX >> shift))
+                return false;
+            limits->mem_bytes = number << shift;
+        }
+        else if (strncmp(words[i], "pids=", 5) == 0 && *end == 0 && number > 0) {
+            limits->pids = (long)number;
+        }
+        else {
+            return false;
+        }
+    }
+    return true;
+}
+
+JobCgroups::JobCgroups() : owner_pid(0) {
+    defaults.cpu_percent = defaults.mem_bytes = defaults.pids = -1;
+}
+
+JobCgroups::~JobCgroups() {
+    disable();
+}
+
+std::string JobCgroups::leafPath(pid_t pgid) {
+    char name[32];
+    snprintf(name, sizeof(name), "/job-%d", (int)pgid);
+    return base + name;
+}
+
+bool JobCgroups::isEnabled() {
+    return !base.empty();
+}
+
+const std::string& JobCgroups::getBase() {
+    return this->base;
+}
+
+JobLimits* JobCgroups::getDefaults() {
+    return &this->defaults;
+}
+
+bool JobCgroups::enable(const char* parent) {
+    struct stat st;
+    std::string controllers_path = std::string(parent) + "/cgroup.controllers";
+    if (stat(controllers_path.c_str(), &st) == -1) {
+        fprintf(stderr, "smash error: cgroup: %s is not a cgroup v2 directory\n", parent);
+        return false;
+    }
+    disable();
+    char name[32];
+    snprintf(name, sizeof(name), "/smash-%d", (int)getpid());
+    std::string dir = std::string(parent) + name;
+    if (mkdir(dir.c_str(), 0755) == -1 && errno != EEXIST) {
+        perror("smash error: mkdir failed");
+        return false;
+    }
+    base = dir;
+    // hand the controllers the subtree was delegated down to the job leaves; smash itself stays
+    // where it is, so this directory has no processes and may enable them
+    char available[256];
+    if (_readCgroupFile(base, "cgroup.controllers", available, sizeof(available))) {
+        for (char* word = strtok(available, " \n"); word != NULL; word = strtok(NULL, " \n")) {
+            if (strcmp(word, "cpu") == 0 || strcmp(word, "memory") == 0 || strcmp(word, "pids") == 0)
+                _writeCgroupFile(base, "cgroup.subtree_control", (std::string("+") + word).c_str());
+        }
+    }
+    owner_pid = getpid();
+    return true;
+}
+
+void JobCgroups::disable() {
+    if (base.empty() || getpid() != owner_pid) // forked stages exit through here too
+        return;
+    // leaves of finished jobs that could not be removed earlier (an orphan was still inside)
+    DIR* dir = opendir(base.c_str());
+    if (dir != NULL) {
+        struct dirent* entry;
+        while ((entry = readdir(dir)) != NULL) {
+            if (strncmp(entry->d_name, "job-", 4) == 0)
+                rmdir((base + "/" + entry->d_name).c_str());
+        }
+        closedir(dir);
+    }
+    rmdir(base.c_str());
+    base.clear();
+}
+
+// Lowers the soft limit only, the hard one stays so the job may still be given more later.
+static bool _setLimit(pid_t pid, __rlimit_resource resource, rlim_t value) {
+    struct rlimit limit;
+    if (prlimit(pid, resource, NULL, &limit) == -1) {
+        perror("smash error: prlimit failed");
+        return false;
+    }
+    limit.rlim_cur = (limit.rlim_max != RLIM_INFINITY && value > limit.rlim_max) ? limit.rlim_max : value;
+    if (prlimit(pid, resource, &limit, NULL) == -1) {
+        perror("smash error: prlimit failed");
+        return false;
+    }
+    return true;
+}
+
+static bool _hasCgroupFile(const std::string& dir, const char* name) {
+    struct stat st;
+    return stat((dir + "/" + name).c_str(), &st) == 0;
+}
+
+bool JobCgroups::writeLimits(const std::string& leaf, const JobLimits& limits, pid_t pid) {
+    char value[64];
+    bool ok = true;
+    if (limits.cpu_percent != -1) {
+        if (leaf.empty() || !_hasCgroupFile(leaf, "cpu.max")) {
+            fprintf(stderr, "smash error: cgroup: no cpu controller for %s\n", leaf.empty() ? "the job" : leaf.c_str());
+            ok = false;
+        }
+        else {
+            snprintf(value, sizeof(value), "%ld %d", limits.cpu_percent * CGROUP_CPU_PERIOD_US / 100, CGROUP_CPU_PERIOD_US);
+            ok = _writeCgroupFile(leaf, "cpu.max", value) && ok;
+        }
+    }
+    // a controller the subtree was not given degrades to the rlimit of the job's leader
+    if (limits.mem_bytes != -1) {
+        snprintf(value, sizeof(value), "%lld", limits.mem_bytes);
+        if (!leaf.empty() && _hasCgroupFile(leaf, "memory.max"))
+            ok = _writeCgroupFile(leaf, "memory.max", value) && ok;
+        else
+            ok = _setLimit(pid, RLIMIT_AS, (rlim_t)limits.mem_bytes) && ok;
+    }
+    if (limits.pids != -1) {
+        snprintf(value, sizeof(value), "%ld", limits.pids);
+        if (!leaf.empty() && _hasCgroupFile(leaf, "pids.max"))
+            ok = _writeCgroupFile(leaf, "pids.max", value) && ok;
+        else
+            ok = _setLimit(pid, RLIMIT_NPROC, (rlim_t)limits.pids) && ok;
+    }
+    return ok;
+}
+
+
+void JobCgroups::enterLeaf() {
+    bool has_defaults = (defaults.cpu_percent != -1 || defaults.mem_bytes != -1 || defaults.pids != -1);
+    if (base.empty()) {
+        if (has_defaults)
+            writeLimits(std::string(), defaults, 0);
+        return;
+    }
+    std::string leaf = leafPath(getpid()); // the child leads its process group, its pid is the pgid
+    if (mkdir(leaf.c_str(), 0755) == -1 && errno != EEXIST) {
+        perror("smash error: mkdir failed");
+        return;
+    }
+    if (has_defaults)
+        writeLimits(leaf, defaults, 0);
+    _writeCgroupFile(leaf, "cgroup.procs", "0");
+}
+
+bool JobCgroups::applyLimits(pid_t pgid, const JobLimits& limits) {
+    // rlimits reach the leader only: its children started from now on inherit them, earlier ones keep theirs
+    return writeLimits(base.empty() ? std::string() : leafPath(pgid), limits, pgid);
+}
+
+bool JobCgroups::killAll(pid_t pgid) {
+    if (base.empty())
+        return false;
+    std::string leaf = leafPath(pgid);
+    struct stat st;
+    if (stat((leaf + "/cgroup.kill").c_str(), &st) == -1)
+        return false; // before Linux 5.14, or the job was started while cgroups were off
+    return _writeCgroupFile(leaf, "cgroup.kill", "1");
+}
+
+bool JobCgroups::readUsage(pid_t pgid, uint64_t* cpu_us, long* mem_kb) {
+    if (base.empty())
+        return false;
+    std::string leaf = leafPath(pgid);
+    char buff[512];
+    if (!_readCgroupFile(leaf, "cpu.stat", buff, sizeof(buff)))
+        return false;
+    const char* usage = strstr(buff, "usage_usec ");
+    *cpu_us = (usage != NULL) ? strtoull(usage + 11, NULL, 10) : 0;
+    *mem_kb = _readCgroupFile(leaf, "memory.current", buff, sizeof(buff)) ? (long)(strtoull(buff, NULL, 10) / 1024) : -1;
+    return true;
+}
+
+void JobCgroups::removeLeaf(pid_t pgid) {
+    if (!base.empty())
+        rmdir(leafPath(pgid).c_str()); // EBUSY while an orphan lives on in it, disable() retries
+}
@@ -0,0 +1,50 @@
+#ifndef SMASH_CGROUP_H_
+#define SMASH_CGROUP_H_
+
+#include <string>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define CGROUP_CPU_PERIOD_US (100000)
+
+// -1 in a field leaves that resource alone.
+struct JobLimits {
+    long cpu_percent;   // of one CPU, may exceed 100
+    long long mem_bytes;
+    long pids;
+};
+
+// Parses "cpu=50% mem=2G pids=100" words into limits; false on anything it does not understand.
+bool parseJobLimits(char** words, int count, JobLimits* limits);
+
+// One cgroup v2 leaf per job under a delegated subtree: <parent>/smash-<pid>/job-<pgid>. The
+// child moves itself into its leaf before exec, so nothing the job starts escapes it. Without
+// cgroups the limits degrade to setrlimit/prlimit on the job's leader (memory and process count
+// only, a CPU share has no rlimit counterpart).
+class JobCgroups {
+    std::string base; // smash's own directory in the subtree, empty when cgroups are off
+    JobLimits defaults;
+    pid_t owner_pid;
+    std::string leafPath(pid_t pgid);
+    // leaf is empty without cgroups; pid (0 = the caller) gets the rlimit fallbacks
+    bool writeLimits(const std::string& leaf, const JobLimits& limits, pid_t pid);
+public:
+    JobCgroups();
+    ~JobCgroups();
+    JobCgroups(JobCgroups const&)     = delete;
+    void operator=(JobCgroups const&) = delete;
+    bool enable(const char* parent);
+    void disable();
+    bool isEnabled();
+    const std::string& getBase();
+    JobLimits* getDefaults();
+    // In the forked child, right before exec.
+    void enterLeaf();
+    bool applyLimits(pid_t pgid, const JobLimits& limits);
+    // Kills every process in the job's leaf with one write to cgroup.kill.
+    bool killAll(pid_t pgid);
+    bool readUsage(pid_t pgid, uint64_t* cpu_us, long* mem_kb);
+    void removeLeaf(pid_t pgid);
+};
+
+#endif //SMASH_CGROUP_H_
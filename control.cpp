@@ -0,0 +1,319 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sstream>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "control.h"
+#include "Commands.h"
+
+ControlServer::ControlServer() : listen_fd(-1), epoll_fd(-1), owner_pid(0) {}
+
+ControlServer::~ControlServer() {
+    close();
+}
+
+bool ControlServer::isEnabled() {
+    return this->listen_fd != -1;
+}
+
+const std::string& ControlServer::getPath() {
+    return this->path;
+}
+
+int ControlServer::getEventFd() {
+    return this->epoll_fd;
+}
+
+bool ControlServer::listen(const char* path) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "smash error: control: %s: path too long\n", path);
+        return false;
+    }
+    strcpy(address.sun_path, path);
+    close();
+    int fd = socket(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        perror("smash error: socket failed");
+        return false;
+    }
+    mode_t old_mask = umask(077); // the socket file is the only access control there is
+    int bound = bind(fd, (struct sockaddr*)&address, sizeof(address));
+    if (bound == -1 && errno == EADDRINUSE) {
+        // left behind by a smash that died; one that still listens answers the connect. Only a socket
+        // is ever removed: connect() refuses a regular file the same way
+        struct stat st;
+        bool is_socket = lstat(path, &st) == 0 && S_ISSOCK(st.st_mode);
+        int probe = is_socket ? socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0) : -1;
+        if (probe != -1 && connect(probe, (struct sockaddr*)&address, sizeof(address)) == -1 && errno == ECONNREFUSED) {
+            unlink(path);
+            bound = bind(fd, (struct sockaddr*)&address, sizeof(address));
+        }
+        else {
+            errno = EADDRINUSE;
+        }
+        if (probe != -1)
+            ::close(probe);
+    }
+    umask(old_mask);
+    if (bound == -1 || ::listen(fd, CONTROL_CLIENTS_MAX) == -1) {
+        perror("smash error: bind failed");
+        ::close(fd);
+        return false;
+    }
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    if (epoll_fd == -1 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+        perror("smash error: epoll_ctl failed");
+        if (epoll_fd != -1)
+            ::close(epoll_fd);
+        epoll_fd = -1;
+        ::close(fd);
+        unlink(path);
+        return false;
+    }
+    listen_fd = fd;
+    this->path = path;
+    owner_pid = getpid();
+    return true;
+}
+
+void ControlServer::close() {
+    if (listen_fd == -1 || getpid() != owner_pid) // forked stages exit through here too
+        return;
+    while (!clients.empty())
+        closeClient(clients.back().fd);
+    ::close(listen_fd);
+    ::close(epoll_fd);
+    listen_fd = epoll_fd = -1;
+    unlink(path.c_str());
+    path.clear();
+}
+
+ControlServer::Client* ControlServer::findClient(int fd) {
+    for (size_t i = 0; i < clients.size(); i++) {
+        if (clients[i].fd == fd)
+            return &clients[i];
+    }
+    return NULL;
+}
+
+void ControlServer::closeClient(int fd) {
+    for (size_t i = 0; i < clients.size(); i++) {
+        if (clients[i].fd == fd) {
+            clients.erase(clients.begin() + i);
+            break;
+        }
+    }
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    ::close(fd);
+}
+
+void ControlServer::accept() {
+    int fd;
+    while ((fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC)) != -1) {
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.fd = fd;
+        if (clients.size() >= CONTROL_CLIENTS_MAX || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+            ::close(fd);
+            continue;
+        }
+        Client client;
+        client.fd = fd;
+        client.events = false;
+        client.dead = false;
+        clients.push_back(client);
+    }
+    if (errno != EAGAIN && errno != EINTR && errno != ECONNABORTED)
+        perror("smash error: accept failed");
+}
+
+bool ControlServer::flush(Client* client) {
+    size_t sent = 0;
+    while (sent < client->out.size()) {
+        ssize_t n = send(client->fd, client->out.data() + sent, client->out.size() - sent, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN)
+                return false;
+            break;
+        }
+        sent += n;
+    }
+    client->out.erase(0, sent);
+    // wait for room only while something is left, a writable socket would wake the loop for nothing
+    struct epoll_event event;
+    event.events = client->out.empty() ? EPOLLIN : (EPOLLIN|EPOLLOUT);
+    event.data.fd = client->fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client->fd, &event);
+    return true;
+}
+
+static bool _parseJobId(const std::string& word, int* job_id) {
+    char* end;
+    long value = strtol(word.c_str(), &end, 10);
+    if (word.empty() || *end != 0 || value <= 0 || value > INT_MAX)
+        return false;
+    *job_id = (int)value;
+    return true;
+}
+
+void ControlServer::handle(Client* client, const std::string& request) {
+    SmallShell& smash = SmallShell::getInstance();
+    JobsList* jobs = smash.getJobsList();
+    std::istringstream words(request);
+    std::string verb, first, second, extra;
+    words >> verb >> first >> second >> extra;
+    char line[256];
+    std::string& out = client->out;
+    int job_id;
+    if (verb == "jobs" && first.empty()) {
+        jobs->removeFinishedJobs();
+        time_t now = time(NULL);
+        std::vector<JobEntry>* timed = smash.getTimeJobVec();
+        for (size_t i = 0; i < jobs->getJobsVec()->size(); i++) {
+            JobEntry& job = (*jobs->getJobsVec())[i];
+            long left = -1;
+            for (size_t t = 0; t < timed->size(); t++) {
+                if ((*timed)[t].getProcessID() == job.getProcessID())
+                    left = (*timed)[t].getTimeUp() - (long)(now - (*timed)[t].getTImeInserted());
+            }
+            snprintf(line, sizeof(line), "job %d %ld %s %ld %s ", job.getJobID(), (long)job.getProcessID(),
+                     job.isStoppedProcess() ? "stopped" : "running", (long)(now - job.getTImeInserted()),
+                     left == -1 ? "-" : std::to_string(left < 0 ? 0 : left).c_str());
+            out += line + job.getCmdLine() + "\n";
+        }
+        // a timed command smash is running in the foreground has no job id
+        for (size_t t = 0; t < timed->size(); t++) {
+            JobEntry& entry = (*timed)[t];
+            if (jobs->getJobByProcessId(entry.getProcessID()) != NULL)
+                continue;
+            long left = entry.getTimeUp() - (long)(now - entry.getTImeInserted());
+            snprintf(line, sizeof(line), "job - %ld foreground %ld %ld ", (long)entry.getProcessID(),
+                     (long)(now - entry.getTImeInserted()), left < 0 ? 0 : left);
+            out += line + entry.getCmdLine() + "\n";
+        }
+        out += "ok\n";
+    }
+    else if (verb == "kill" && extra.empty() && _parseJobId(first, &job_id) && !second.empty()) {
+        char* end;
+        long sig = strtol(second.c_str() + (second[0] == '-' ? 1 : 0), &end, 10);
+        JobEntry* job = jobs->getJobById(job_id);
+        if (*end != 0 || sig <= 0 || sig >= NSIG) {
+            out += "error invalid arguments\n";
+        }
+        else if (job == NULL) {
+            out += "error job-id " + first + " does not exist\n";
+        }
+        else if ((sig == SIGKILL && smash.getCgroups()->killAll(job->getProcessID())) || job->sendSignal((int)sig) != -1) {
+            if (sig == SIGSTOP || sig == SIGTSTP || sig == SIGTTIN || sig == SIGTTOU || sig == SIGCONT)
+                jobs->setStopped(job, sig != SIGCONT);
+            out += "ok\n";
+        }
+        else {
+            out += std::string("error ") + strerror(errno) + "\n";
+        }
+    }
+    else if (verb == "stats" && second.empty() && _parseJobId(first, &job_id)) {
+        JobEntry* job = jobs->getJobById(job_id);
+        if (job == NULL) {
+            out += "error job-id " + first + " does not exist\n";
+        }
+        else {
+            uint64_t user_us = 0, sys_us = 0, cgroup_cpu_us = 0;
+            long rss_kb = 0, cgroup_mem_kb = -1;
+            _liveUsage(job->getProcessID(), &user_us, &sys_us, &rss_kb);
+            bool in_cgroup = smash.getCgroups()->readUsage(job->getProcessID(), &cgroup_cpu_us, &cgroup_mem_kb);
+            JobUsage* orphans = job->getOrphanUsage();
+            snprintf(line, sizeof(line), "stats %d %llu %llu %ld %u %llu %llu %ld %lld %ld\nok\n", job_id,
+                     (unsigned long long)user_us, (unsigned long long)sys_us, rss_kb, orphans->reaped,
+                     (unsigned long long)orphans->user_us, (unsigned long long)orphans->sys_us, orphans->maxrss_kb,
+                     in_cgroup ? (long long)cgroup_cpu_us : -1LL, in_cgroup ? cgroup_mem_kb : -1L);
+            out += line;
+        }
+    }
+    else if (verb == "events" && first.empty()) {
+        client->events = true;
+        out += "ok\n";
+    }
+    else {
+        out += "error unknown request\n";
+    }
+}
+
+void ControlServer::closeDeadClients() {
+    for (size_t i = clients.size(); i > 0; i--) {
+        if (clients[i - 1].dead)
+            closeClient(clients[i - 1].fd);
+    }
+}
+
+void ControlServer::serve() {
+    if (epoll_fd == -1)
+        return;
+    closeDeadClients();
+    struct epoll_event events[CONTROL_EPOLL_BATCH];
+    int ready = epoll_wait(epoll_fd, events, CONTROL_EPOLL_BATCH, 0);
+    for (int i = 0; i < ready; i++) {
+        int fd = events[i].data.fd;
+        if (fd == listen_fd) {
+            accept();
+            continue;
+        }
+        Client* client = findClient(fd);
+        if (client == NULL)
+            continue;
+        bool alive = true;
+        if (events[i].events & (EPOLLIN|EPOLLHUP|EPOLLERR)) {
+            char buff[CONTROL_LINE_MAX];
+            ssize_t n;
+            while ((n = read(fd, buff, sizeof(buff))) > 0)
+                client->in.append(buff, n);
+            // a client may send its request and shut down its side at once: it still gets the answer
+            alive = (n == -1 && (errno == EAGAIN || errno == EINTR));
+            size_t newline;
+            while ((newline = client->in.find('\n')) != std::string::npos) {
+                std::string request = client->in.substr(0, newline);
+                client->in.erase(0, newline + 1);
+                if (!request.empty() && request[request.size() - 1] == '\r')
+                    request.erase(request.size() - 1);
+                handle(client, request);
+            }
+            if (client->in.size() > CONTROL_LINE_MAX)
+                alive = false;
+        }
+        if (!client->dead && (!flush(client) || !alive))
+            client->dead = true;
+        closeDeadClients();
+    }
+}
+
+void ControlServer::publishExit(int job_id, pid_t pid, int exit_code) {
+    if (listen_fd == -1 || getpid() != owner_pid)
+        return;
+    char line[64];
+    snprintf(line, sizeof(line), "exit %d %ld %d\n", job_id, (long)pid, exit_code);
+    for (size_t i = 0; i < clients.size(); i++) {
+        if (!clients[i].events || clients[i].dead)
+            continue;
+        clients[i].out += line;
+        // closed by the next serve(): this may run from inside handle(), which holds a client pointer
+        if (clients[i].out.size() > CONTROL_OUTPUT_MAX || !flush(&clients[i]))
+            clients[i].dead = true;
+    }
+}
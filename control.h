@@ -0,0 +1,57 @@
+#ifndef SMASH_CONTROL_H_
+#define SMASH_CONTROL_H_
+
+#include <string>
+#include <vector>
+#include <sys/types.h>
+
+#define CONTROL_CLIENTS_MAX (64)
+#define CONTROL_LINE_MAX (4096)        // a longer request drops the client
+#define CONTROL_OUTPUT_MAX (1 << 20)   // an event subscriber this far behind is dropped
+#define CONTROL_EPOLL_BATCH (16)
+
+// Opt-in Unix-domain control socket (`smash --control PATH`, `set control PATH|off`) served from
+// the main loop. The protocol is one request per line; every response ends with a line "ok" or
+// "error <reason>":
+//   jobs            job <id> <pid> <running|stopped|foreground> <elapsed s> <timeout left s|-> <cmd>
+//   kill <id> <sig> signals the job like the kill builtin
+//   stats <id>      stats <id> <user us> <sys us> <rss kB> <orphans> <orphan user us> <orphan sys us>
+//                   <orphan maxrss kB> <cgroup cpu us|-1> <cgroup mem kB|-1>
+//   events          "ok", then one "exit <id> <pid> <code>" line per finished job until disconnect;
+//                   <code> is -1 for a job re-adopted from a state file, its status is unknown
+class ControlServer {
+    struct Client {
+        int fd;
+        std::string in;
+        std::string out; // not yet accepted by the socket
+        bool events;
+        bool dead; // to be closed once no request is being handled
+    };
+    int listen_fd;
+    int epoll_fd; // listen_fd and the clients; data.fd is the descriptor
+    std::string path;
+    pid_t owner_pid;
+    std::vector<Client> clients;
+    void accept();
+    Client* findClient(int fd);
+    void closeClient(int fd);
+    void closeDeadClients();
+    void handle(Client* client, const std::string& request);
+    bool flush(Client* client);
+public:
+    ControlServer();
+    ~ControlServer();
+    ControlServer(ControlServer const&)  = delete;
+    void operator=(ControlServer const&) = delete;
+    bool listen(const char* path);
+    void close();
+    bool isEnabled();
+    const std::string& getPath();
+    // Readable when a client connected or sent something; -1 when the socket is off.
+    int getEventFd();
+    // Accepts and answers whatever is ready, without blocking.
+    void serve();
+    void publishExit(int job_id, pid_t pid, int exit_code);
+};
+
+#endif //SMASH_CONTROL_H_
@@ -0,0 +1,82 @@
+#include <iostream>
+#include <string>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Client for smash's control socket (`smash --control PATH`):
+//   smash_ctl PATH jobs | kill ID SIG | stats ID | events
+// Sends one request and prints the response; exits 1 when smash answered "error ...". `events`
+// keeps printing job exits until smash goes away or the client is interrupted.
+
+using namespace std;
+
+static int _connect(const char* path) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        cerr << "smash_ctl: " << path << ": path too long" << endl;
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+    if (fd == -1 || connect(fd, (struct sockaddr*)&address, sizeof(address)) == -1) {
+        perror("smash_ctl: connect failed");
+        if (fd != -1)
+            close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 3) {
+        cerr << "usage: smash_ctl PATH jobs | kill ID SIG | stats ID | events" << endl;
+        return 2;
+    }
+    string request;
+    for (int i = 2; i < argc; i++)
+        request += string(i > 2 ? " " : "") + argv[i];
+    request += "\n";
+    bool stream = (strcmp(argv[2], "events") == 0);
+    int fd = _connect(argv[1]);
+    if (fd == -1)
+        return 2;
+    if (send(fd, request.data(), request.size(), MSG_NOSIGNAL) != (ssize_t)request.size()) {
+        perror("smash_ctl: send failed");
+        return 2;
+    }
+    string pending;
+    char buff[4096];
+    ssize_t n;
+    while ((n = read(fd, buff, sizeof(buff))) != 0) {
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("smash_ctl: read failed");
+            return 2;
+        }
+        pending.append(buff, n);
+        size_t newline;
+        while ((newline = pending.find('\n')) != string::npos) {
+            string line = pending.substr(0, newline);
+            pending.erase(0, newline + 1);
+            if (line.compare(0, 6, "error ") == 0) {
+                cerr << "smash_ctl: " << line.substr(6) << endl;
+                return 1;
+            }
+            if (line == "ok") {
+                if (!stream)
+                    return 0;
+                continue; // the events follow
+            }
+            cout << line << endl;
+        }
+    }
+    close(fd);
+    return stream ? 0 : 2; // smash went away before answering
+}
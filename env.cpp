@@ -0,0 +1,143 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "env.h"
+#include "redirect.h"
+
+extern char** environ;
+
+Environment::Environment() : dirty(true), shell_pid(getpid()), last_status(0) {
+    for (char** var = environ; var != NULL && *var != NULL; var++) {
+        const char* equal_sign = strchr(*var, '=');
+        if (equal_sign != NULL)
+            vars[std::string(*var, equal_sign - *var)] = std::string(equal_sign + 1);
+    }
+}
+
+bool Environment::isValidName(const char* name, size_t length) {
+    if (length == 0 || isdigit((unsigned char)name[0]))
+        return false;
+    for (size_t i = 0; i < length; i++) {
+        if (!isalnum((unsigned char)name[i]) && name[i] != '_')
+            return false;
+    }
+    return true;
+}
+
+const std::string* Environment::get(const char* name, size_t length) {
+    std::map<std::string, std::string>::const_iterator it = vars.find(std::string(name, length));
+    return (it == vars.end()) ? NULL : &it->second;
+}
+
+void Environment::set(const std::string& name, const std::string& value) {
+    vars[name] = value;
+    dirty = true;
+}
+
+bool Environment::unset(const std::string& name) {
+    if (vars.erase(name) == 0)
+        return false;
+    dirty = true;
+    return true;
+}
+
+const std::map<std::string, std::string>* Environment::getVars() {
+    return &this->vars;
+}
+
+void Environment::rebuild() {
+    size_t size = 0;
+    for (const auto& var : vars)
+        size += var.first.size() + var.second.size() + 2;
+    block.resize(size);
+    envp_.clear();
+    char* p = block.data();
+    for (const auto& var : vars) {
+        envp_.push_back(p);
+        memcpy(p, var.first.data(), var.first.size());
+        p += var.first.size();
+        *p++ = '=';
+        memcpy(p, var.second.data(), var.second.size());
+        p += var.second.size();
+        *p++ = 0;
+    }
+    envp_.push_back(NULL);
+    dirty = false;
+}
+
+char** Environment::envp() {
+    if (dirty)
+        rebuild();
+    return envp_.data();
+}
+
+int Environment::getLastStatus() {
+    return this->last_status;
+}
+
+void Environment::setLastStatus(int status) {
+    this->last_status = status;
+}
+
+const char* Environment::expand(const char* cmd_line, Arena* arena) {
+    if (strchr(cmd_line, '$') == NULL)
+        return cmd_line;
+    // first pass sizes the result, second one writes it, both straight into the line arena
+    char* out = NULL;
+    size_t used = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        if (pass == 1)
+            out = (char*)arena->allocate(used + 1);
+        used = 0;
+        bool in_single = false;
+        bool in_double = false;
+        for (const char* p = cmd_line; *p != 0; p++) {
+            const char* value = NULL;
+            size_t value_length = 0;
+            char special[16]; // $$ or $?
+            if (*p == '\'' && !in_double) {
+                in_single = !in_single;
+            }
+            else if (*p == '"' && !in_single) {
+                in_double = !in_double;
+            }
+            else if (*p == '\\' && !in_single && p[1] != 0) {
+                if (pass == 1)
+                    out[used] = *p;
+                used++;
+                p++;
+            }
+            else if (*p == '$' && !in_single) {
+                const char* name = p + 1;
+                size_t name_length = 0;
+                bool braces = (*name == '{');
+                if (braces)
+                    name++;
+                while (isalnum((unsigned char)name[name_length]) || name[name_length] == '_')
+                    name_length++;
+                if (name_length == 0 && (*name == '$' || *name == '?')) {
+                    value_length = snprintf(special, sizeof(special), "%d", (*name == '$') ? (int)shell_pid : last_status);
+                    value = special;
+                    name_length = 1;
+                }
+                if (name_length > 0 && (!braces || name[name_length] == '}')) {
+                    if (value == NULL) {
+                        const std::string* var = get(name, name_length);
+                        value = (var != NULL) ? var->c_str() : "";
+                        value_length = (var != NULL) ? var->size() : 0;
+                    }
+                    // the value is text, not syntax: `X='a>b'; echo $X` prints a>b
+                    used += escapeShellText(value, value_length, in_double, (pass == 1) ? out + used : NULL);
+                    p = name + name_length + (braces ? 1 : 0) - 1;
+                    continue;
+                }
+            }
+            if (pass == 1)
+                out[used] = *p;
+            used++;
+        }
+    }
+    out[used] = 0;
+    return out;
+}
@@ -0,0 +1,38 @@
+#ifndef SMASH_ENV_H_
+#define SMASH_ENV_H_
+
+#include <map>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+#include "arena.h"
+
+// The variables smash passes to the programs it launches. Starts as a copy of the environment
+// smash was started with. The envp handed to exec is one contiguous block that is only rebuilt
+// after a variable changed, so launching a command never formats the environment.
+class Environment {
+    std::map<std::string, std::string> vars;
+    std::vector<char> block;  // "NAME=value\0NAME=value\0..."
+    std::vector<char*> envp_; // pointers into block, NULL terminated
+    bool dirty;
+    pid_t shell_pid; // $$ is smash's pid, also inside forked pipeline stages
+    int last_status; // $?
+    void rebuild();
+public:
+    Environment();
+    Environment(Environment const&)     = delete;
+    void operator=(Environment const&)  = delete;
+    static bool isValidName(const char* name, size_t length);
+    const std::string* get(const char* name, size_t length);
+    void set(const std::string& name, const std::string& value);
+    bool unset(const std::string& name);
+    const std::map<std::string, std::string>* getVars();
+    char** envp();
+    int getLastStatus();
+    void setLastStatus(int status);
+    // Replaces $NAME, ${NAME}, $$ and $? outside single quotes, escaping what the values hold that the
+    // line's parsers would take for syntax; returns cmd_line itself when it has no $.
+    const char* expand(const char* cmd_line, Arena* arena);
+};
+
+#endif //SMASH_ENV_H_
@@ -0,0 +1,148 @@
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include "head.h"
+
+StringSink::StringSink(std::string* text) : text(text) {}
+
+bool StringSink::put(const char* data, size_t length) {
+    text->append(data, length);
+    return true;
+}
+
+bool headFile(IoEngine* engine, const char* path, long lines, const std::string& header, HeadSink* sink,
+              const char** failed) {
+    IoFile in;
+    const char* data;
+    ssize_t length;
+    // open, readahead hint and the first chunk in one go; most heads never need a second read
+    if (!engine->openRead(path, &in, &data, &length, failed)) {
+        engine->flush();
+        return false;
+    }
+    bool ok = header.empty() || sink->put(header.data(), header.size());
+    long seen = 0;
+    while (ok && length > 0 && seen < lines) {
+        const char* end = data;
+        const char* chunk_end = data + length;
+        while (seen < lines && (end = (const char*)memchr(end, '\n', chunk_end - end)) != NULL) {
+            end++;
+            seen++;
+        }
+        ok = sink->put(data, (seen == lines) ? end - data : length);
+        if (ok && seen < lines)
+            length = engine->read(&in, &data);
+    }
+    int saved_errno = errno;
+    engine->close(&in);
+    engine->flush();
+    if (length == -1) {
+        errno = saved_errno;
+        *failed = "read";
+        return false;
+    }
+    return true;
+}
+
+static std::string _header(const std::vector<const char*>& paths, size_t i) {
+    if (paths.size() < 2)
+        return std::string();
+    return std::string(i == 0 ? "==> " : "\n==> ") + paths[i] + " <==\n";
+}
+
+static void _reportFailure(const char* failed, int error) {
+    std::string message = std::string("smash error: ") + failed + " failed";
+    errno = error;
+    perror(message.c_str());
+}
+
+struct HeadResult {
+    std::string text;
+    const char* failed; // NULL when the head was read
+    int error;
+    bool done;
+};
+
+// What the workers share with the thread writing the heads out.
+struct HeadPool {
+    const std::vector<const char*>* paths;
+    long lines;
+    std::vector<HeadResult> results;
+    size_t next; // the next file a worker takes
+    std::mutex lock;
+    std::condition_variable finished;
+};
+
+static void _headWorker(HeadPool* pool) {
+    sigset_t all;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, NULL); // ctrl-C and the alarms stay with the shell's thread
+    IoEngine engine;
+    for (;;) {
+        size_t i;
+        {
+            std::lock_guard<std::mutex> guard(pool->lock);
+            if (pool->next == pool->paths->size())
+                return;
+            i = pool->next++;
+        }
+        std::string text;
+        StringSink sink(&text);
+        const char* failed = NULL;
+        bool read = headFile(&engine, (*pool->paths)[i], pool->lines, _header(*pool->paths, i), &sink, &failed);
+        int error = errno;
+        std::lock_guard<std::mutex> guard(pool->lock);
+        pool->results[i].text.swap(text);
+        pool->results[i].failed = read ? NULL : failed;
+        pool->results[i].error = error;
+        pool->results[i].done = true;
+        pool->finished.notify_all();
+    }
+}
+
+void headFiles(const std::vector<const char*>& paths, long lines, int threads, HeadSink* sink) {
+    if (threads > (int)paths.size())
+        threads = (int)paths.size();
+    if (threads <= 1) {
+        IoEngine& engine = IoEngine::getInstance();
+        for (size_t i = 0; i < paths.size(); i++) {
+            const char* failed;
+            if (!headFile(&engine, paths[i], lines, _header(paths, i), sink, &failed))
+                _reportFailure(failed, errno);
+        }
+        return;
+    }
+    HeadPool pool;
+    pool.paths = &paths;
+    pool.lines = lines;
+    HeadResult empty = {std::string(), NULL, 0, false};
+    pool.results.assign(paths.size(), empty);
+    pool.next = 0;
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; t++)
+        workers.push_back(std::thread(_headWorker, &pool));
+    // out in argument order: file i goes as soon as it and everything before it are done
+    for (size_t i = 0; i < paths.size(); i++) {
+        std::string text;
+        const char* failed;
+        int error;
+        {
+            std::unique_lock<std::mutex> guard(pool.lock);
+            while (!pool.results[i].done)
+                pool.finished.wait(guard);
+            text.swap(pool.results[i].text);
+            failed = pool.results[i].failed;
+            error = pool.results[i].error;
+        }
+        if (!text.empty())
+            sink->put(text.data(), text.size());
+        if (failed != NULL)
+            _reportFailure(failed, error);
+    }
+    for (size_t t = 0; t < workers.size(); t++)
+        workers[t].join();
+}
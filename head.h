@@ -0,0 +1,37 @@
+#ifndef SMASH_HEAD_H_
+#define SMASH_HEAD_H_
+
+#include <string>
+#include <vector>
+#include "ioengine.h"
+
+#define HEAD_THREADS_MAX (64)
+
+// Where the lines go: the terminal or a redirection for the command itself, a string for a
+// file read on a worker thread.
+class HeadSink {
+public:
+    virtual ~HeadSink() {}
+    virtual bool put(const char* data, size_t length) = 0;
+};
+
+class StringSink : public HeadSink {
+    std::string* text;
+public:
+    explicit StringSink(std::string* text);
+    bool put(const char* data, size_t length) override;
+};
+
+// Copies the first `lines` lines of path to sink, after header once the file could be opened.
+// false with errno set and *failed naming the step when the file could not be read; a failed
+// put stops the copy and returns true, the sink reported it.
+bool headFile(IoEngine* engine, const char* path, long lines, const std::string& header, HeadSink* sink,
+              const char** failed);
+
+// The heads of all paths, each after a `==> path <==` header when there are several, in argument
+// order. With threads > 1 the files are read on that many worker threads, each with its own
+// engine, and every head is held until those before it went out; a file that cannot be read is
+// reported on stderr at its turn.
+void headFiles(const std::vector<const char*>& paths, long lines, int threads, HeadSink* sink);
+
+#endif //SMASH_HEAD_H_
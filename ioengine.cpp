@@ -0,0 +1,535 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/utsname.h>
+#include <linux/io_uring.h>
+#include "ioengine.h"
+
+#define IO_TAG_CLOSE (1000) // + slot; the results of one operation are tagged 0, 1, 2
+
+bool IoEngine::uring_allowed = true;
+
+// The kernel never tries an OPENAT that may create or truncate inline: it goes to an io-wq worker
+// thread, and the wake-up costs more than the open, write and close syscalls it would save.
+static bool _punted(int open_flags) {
+    return (open_flags & (O_CREAT|O_TRUNC)) != 0;
+}
+
+IoEngine::IoEngine() : state(0), unavailable(false), owner_pid(0), ring_fd(-1), sq_ring(MAP_FAILED), cq_ring(MAP_FAILED), sq_ring_size(0),
+        cq_ring_size(0), sqes((struct io_uring_sqe*)MAP_FAILED), sq_entries(0), local_tail(0), unsubmitted(0), closing(0),
+        fixed_buffer(false) {
+    memset(slot_state, 0, sizeof(slot_state));
+    void* memory = NULL;
+    errno = posix_memalign(&memory, 4096, IO_ENGINE_CHUNK); // page aligned for the registration
+    if (errno != 0)
+        perror("smash error: posix_memalign failed");
+    buffer = (char*)memory;
+}
+
+IoEngine::~IoEngine() {
+    if (state == 1 && owner_pid == getpid())
+        flush();
+    teardown();
+    free(buffer);
+}
+
+IoEngine& IoEngine::getInstance() {
+    static IoEngine instance;
+    return instance;
+}
+
+void IoEngine::setUringAllowed(bool allowed) {
+    uring_allowed = allowed;
+}
+
+bool IoEngine::isUringAllowed() {
+    return uring_allowed;
+}
+
+bool IoEngine::usesUring() {
+    return ready();
+}
+
+void IoEngine::teardown() {
+    if (sqes != MAP_FAILED)
+        munmap(sqes, sq_entries * sizeof(struct io_uring_sqe));
+    if (cq_ring != MAP_FAILED && cq_ring != sq_ring)
+        munmap(cq_ring, cq_ring_size);
+    if (sq_ring != MAP_FAILED)
+        munmap(sq_ring, sq_ring_size);
+    if (ring_fd != -1)
+        ::close(ring_fd);
+    sqes = (struct io_uring_sqe*)MAP_FAILED;
+    sq_ring = cq_ring = MAP_FAILED;
+    ring_fd = -1;
+    local_tail = unsubmitted = closing = 0;
+    memset(slot_state, 0, sizeof(slot_state));
+}
+
+// OPENAT into a registered slot (file_index) came with 5.15. Older kernels, io_uring or not, read
+// the field as padding and install a plain fd, so the fixed-file SQEs after it would fail with
+// EBADF instead of taking the syscall fallback.
+static bool _directOpenSupported() {
+    struct utsname name;
+    int major = 0;
+    int minor = 0;
+    if (uname(&name) == -1 || sscanf(name.release, "%d.%d", &major, &minor) != 2)
+        return false;
+    return major > 5 || (major == 5 && minor >= 15);
+}
+
+// Every opcode the engine submits, as IORING_REGISTER_PROBE reports it; a kernel may be new enough
+// and still have some of them disabled.
+static bool _opcodesSupported(int ring_fd) {
+    static const int OPCODES[] = {IORING_OP_OPENAT, IORING_OP_FADVISE, IORING_OP_READ, IORING_OP_READ_FIXED,
+                                  IORING_OP_WRITE, IORING_OP_CLOSE};
+    union {
+        struct io_uring_probe probe;
+        char bytes[sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op)];
+    } memory;
+    memset(&memory, 0, sizeof(memory));
+    if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, &memory.probe, 256) == -1)
+        return false;
+    for (size_t i = 0; i < sizeof(OPCODES) / sizeof(OPCODES[0]); i++) {
+        if (OPCODES[i] > memory.probe.last_op || (memory.probe.ops[OPCODES[i]].flags & IO_URING_OP_SUPPORTED) == 0)
+            return false;
+    }
+    return true;
+}
+
+bool IoEngine::setup() {
+    if (!_directOpenSupported())
+        return false;
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring_fd = (int)syscall(__NR_io_uring_setup, IO_ENGINE_ENTRIES, &params);
+    if (ring_fd == -1)
+        return false; // no io_uring here (old kernel, seccomp, kernel.io_uring_disabled)
+    if (!_opcodesSupported(ring_fd))
+        return false;
+    sq_entries = params.sq_entries;
+    sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_mmap)
+        sq_ring_size = cq_ring_size = (sq_ring_size > cq_ring_size) ? sq_ring_size : cq_ring_size;
+    sq_ring = mmap(NULL, sq_ring_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ring == MAP_FAILED)
+        return false;
+    cq_ring = single_mmap ? sq_ring :
+              mmap(NULL, cq_ring_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+    if (cq_ring == MAP_FAILED)
+        return false;
+    sqes = (struct io_uring_sqe*)mmap(NULL, sq_entries * sizeof(struct io_uring_sqe), PROT_READ|PROT_WRITE,
+                                      MAP_SHARED|MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED)
+        return false;
+    char* sq = (char*)sq_ring;
+    char* cq = (char*)cq_ring;
+    sq_head = (unsigned*)(sq + params.sq_off.head);
+    sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    sq_array = (unsigned*)(sq + params.sq_off.array);
+    cq_head = (unsigned*)(cq + params.cq_off.head);
+    cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    cqes = cq + params.cq_off.cqes;
+    local_tail = *sq_tail;
+    int files[IO_ENGINE_FILES];
+    for (int i = 0; i < IO_ENGINE_FILES; i++)
+        files[i] = -1; // sparse, OPENAT fills the slots
+    if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_FILES, files, IO_ENGINE_FILES) == -1)
+        return false;
+    struct iovec iov = {buffer, IO_ENGINE_CHUNK};
+    // may fail on RLIMIT_MEMLOCK with older kernels; plain READ into the same buffer then
+    fixed_buffer = (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_BUFFERS, &iov, 1) == 0);
+    return true;
+}
+
+bool IoEngine::ready() {
+    if (state != 0 && owner_pid != getpid()) { // forked: the ring is shared with the parent
+        teardown();
+        state = 0;
+    }
+    if (state == 1 && !uring_allowed) { // `set ioengine sync` after the ring was set up
+        flush();
+        teardown();
+        state = 0;
+    }
+    if (state == -1 && uring_allowed && !unavailable) // `set ioengine uring` again
+        state = 0;
+    if (state == 0) {
+        owner_pid = getpid();
+        if (uring_allowed && setup()) {
+            state = 1;
+        }
+        else {
+            unavailable = uring_allowed; // not tried again in this process
+            teardown();
+            state = -1;
+        }
+    }
+    return state == 1;
+}
+
+int IoEngine::allocSlot() {
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < IO_ENGINE_FILES; i++) {
+            if (slot_state[i] == 0) {
+                slot_state[i] = 1;
+                return i;
+            }
+        }
+        if (closing == 0)
+            break;
+        flush(); // the slots being closed are free once the closes completed
+    }
+    return -1;
+}
+
+struct io_uring_sqe* IoEngine::nextSqe(unsigned tag) {
+    if (local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries) { // full: hand what is queued over
+        __atomic_store_n(sq_tail, local_tail, __ATOMIC_RELEASE);
+        int submitted = (int)syscall(__NR_io_uring_enter, ring_fd, unsubmitted, 0, 0, NULL, 0);
+        if (submitted > 0)
+            unsubmitted -= submitted;
+    }
+    unsigned index = local_tail & *sq_mask;
+    struct io_uring_sqe* sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = tag;
+    sq_array[index] = index;
+    local_tail++;
+    unsubmitted++;
+    return sqe;
+}
+
+void IoEngine::reap(unsigned wanted, int* results, unsigned* seen) {
+    unsigned head = *cq_head;
+    unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    struct io_uring_cqe* ring = (struct io_uring_cqe*)cqes;
+    for (; head != tail; head++) {
+        struct io_uring_cqe* cqe = &ring[head & *cq_mask];
+        if (cqe->user_data >= IO_TAG_CLOSE) {
+            slot_state[cqe->user_data - IO_TAG_CLOSE] = 0;
+            closing--;
+        }
+        else if (cqe->user_data < wanted) {
+            results[cqe->user_data] = cqe->res;
+            (*seen)++;
+        }
+    }
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+}
+
+// Submits everything queued and waits for the completions tagged 0 .. wanted-1.
+bool IoEngine::submitAndWait(unsigned wanted, int* results) {
+    __atomic_store_n(sq_tail, local_tail, __ATOMIC_RELEASE);
+    unsigned seen = 0;
+    while (seen < wanted || unsubmitted > 0) {
+        unsigned min_complete = (seen < wanted) ? 1 : 0;
+        int submitted = (int)syscall(__NR_io_uring_enter, ring_fd, unsubmitted, min_complete,
+                                     min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (submitted == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("smash error: io_uring_enter failed");
+            return false;
+        }
+        unsubmitted -= submitted;
+        reap(wanted, results, &seen);
+    }
+    return true;
+}
+
+bool IoEngine::openRead(const char* path, IoFile* file, const char** data, ssize_t* length, const char** failed) {
+    file->fd = -1;
+    file->slot = ready() ? allocSlot() : -1;
+    if (file->slot == -1) {
+        file->fd = open(path, O_RDONLY|O_CLOEXEC);
+        if (file->fd == -1) {
+            *failed = "open";
+            return false;
+        }
+        posix_fadvise(file->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        *length = read(file, data, IO_ENGINE_FIRST_READ);
+        if (*length == -1) {
+            *failed = "read";
+            int saved_errno = errno;
+            close(file);
+            errno = saved_errno;
+            return false;
+        }
+        return true;
+    }
+    struct io_uring_sqe* sqe = nextSqe(0);
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (unsigned long)path;
+    sqe->open_flags = O_RDONLY;
+    sqe->file_index = file->slot + 1;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe = nextSqe(1);
+    sqe->opcode = IORING_OP_FADVISE;
+    sqe->fd = file->slot;
+    sqe->fadvise_advice = POSIX_FADV_SEQUENTIAL;
+    sqe->flags = IOSQE_FIXED_FILE|IOSQE_IO_HARDLINK; // a pipe refuses the hint, the read still happens
+    sqe = nextSqe(2);
+    sqe->opcode = fixed_buffer ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    sqe->fd = file->slot;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->addr = (unsigned long)buffer;
+    sqe->len = IO_ENGINE_FIRST_READ;
+    sqe->off = (uint64_t)-1; // the file position, so pipes and FIFOs read like files
+    int results[3] = {0, 0, 0};
+    if (!submitAndWait(3, results)) {
+        errno = EIO;
+        *failed = "read";
+        return false;
+    }
+    if (results[0] < 0) {
+        slot_state[file->slot] = 0; // nothing was installed
+        file->slot = -1;
+        errno = -results[0];
+        *failed = "open";
+        return false;
+    }
+    if (results[2] < 0) {
+        close(file);
+        errno = -results[2];
+        *failed = "read";
+        return false;
+    }
+    *data = buffer;
+    *length = results[2];
+    return true;
+}
+
+ssize_t IoEngine::read(IoFile* file, const char** data, size_t length) {
+    *data = buffer;
+    if (length > IO_ENGINE_CHUNK)
+        length = IO_ENGINE_CHUNK;
+    if (file->slot == -1) {
+        ssize_t n;
+        while ((n = ::read(file->fd, buffer, length)) == -1 && errno == EINTR) {}
+        return n;
+    }
+    struct io_uring_sqe* sqe = nextSqe(0);
+    sqe->opcode = fixed_buffer ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    sqe->fd = file->slot;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->addr = (unsigned long)buffer;
+    sqe->len = (unsigned)length;
+    sqe->off = (uint64_t)-1;
+    int result = 0;
+    if (!submitAndWait(1, &result)) {
+        errno = EIO;
+        return -1;
+    }
+    if (result < 0) {
+        errno = -result;
+        return -1;
+    }
+    return result;
+}
+
+bool IoEngine::write(IoFile* file, const char* data, size_t length) {
+    while (length > 0) {
+        ssize_t n;
+        if (file->slot == -1) {
+            n = ::write(file->fd, data, length);
+            if (n == -1 && errno == EINTR)
+                continue;
+        }
+        else {
+            struct io_uring_sqe* sqe = nextSqe(0);
+            sqe->opcode = IORING_OP_WRITE;
+            sqe->fd = file->slot;
+            sqe->flags = IOSQE_FIXED_FILE;
+            sqe->addr = (unsigned long)data;
+            sqe->len = (length > 0x7ffff000) ? 0x7ffff000 : (unsigned)length;
+            sqe->off = (uint64_t)-1;
+            int result = 0;
+            if (!submitAndWait(1, &result)) {
+                errno = EIO;
+                return false;
+            }
+            n = result;
+            if (result < 0) {
+                errno = -result;
+                n = -1;
+            }
+        }
+        if (n == -1)
+            return false;
+        data += n;
+        length -= n;
+    }
+    return true;
+}
+
+bool IoEngine::openWrite(const char* path, int flags, mode_t mode, const char* data, size_t length, IoFile* file,
+                         const char** failed) {
+    file->fd = -1;
+    file->slot = (ready() && !_punted(flags)) ? allocSlot() : -1;
+    if (file->slot == -1) {
+        file->fd = open(path, flags|O_CLOEXEC, mode);
+        if (file->fd == -1) {
+            *failed = "open";
+            return false;
+        }
+    }
+    else {
+        struct io_uring_sqe* sqe = nextSqe(0);
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (unsigned long)path;
+        sqe->len = mode;
+        sqe->open_flags = flags & ~O_CLOEXEC; // a direct descriptor is never in the fd table anyway
+        sqe->file_index = file->slot + 1;
+        unsigned wanted = 1;
+        if (length > 0) {
+            sqe->flags = IOSQE_IO_LINK;
+            sqe = nextSqe(1);
+            sqe->opcode = IORING_OP_WRITE;
+            sqe->fd = file->slot;
+            sqe->flags = IOSQE_FIXED_FILE;
+            sqe->addr = (unsigned long)data;
+            sqe->len = (length > 0x7ffff000) ? 0x7ffff000 : (unsigned)length;
+            sqe->off = (uint64_t)-1;
+            wanted = 2;
+        }
+        int results[2] = {0, 0};
+        if (!submitAndWait(wanted, results)) {
+            errno = EIO;
+            *failed = "open";
+            return false;
+        }
+        if (results[0] < 0) {
+            slot_state[file->slot] = 0;
+            file->slot = -1;
+            errno = -results[0];
+            *failed = "open";
+            return false;
+        }
+        if (wanted == 2 && results[1] < 0) {
+            errno = -results[1];
+            *failed = "write";
+            return false;
+        }
+        if (wanted == 2) { // short: the rest one write at a time
+            data += results[1];
+            length -= results[1];
+        }
+        else {
+            length = 0;
+        }
+    }
+    if (!write(file, data, length)) {
+        *failed = "write";
+        return false;
+    }
+    return true;
+}
+
+void IoEngine::close(IoFile* file) {
+    if (file->slot == -1) {
+        if (file->fd != -1 && ::close(file->fd) == -1)
+            perror("smash error: close failed");
+    }
+    else {
+        struct io_uring_sqe* sqe = nextSqe(IO_TAG_CLOSE + file->slot);
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->file_index = file->slot + 1;
+        slot_state[file->slot] = 2; // reused only once the close completed
+        closing++;
+    }
+    file->fd = -1;
+    file->slot = -1;
+}
+
+bool IoEngine::writeFile(const char* path, int flags, mode_t mode, const char* data, size_t length, const char** failed) {
+    IoFile file = {-1, -1};
+    if (!ready() || _punted(flags) || length > 0x7ffff000 || (file.slot = allocSlot()) == -1) {
+        bool written = openWrite(path, flags, mode, data, length, &file, failed);
+        int saved_errno = errno;
+        close(&file);
+        flush();
+        errno = saved_errno;
+        return written;
+    }
+    struct io_uring_sqe* sqe = nextSqe(0);
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (unsigned long)path;
+    sqe->len = mode;
+    sqe->open_flags = flags & ~O_CLOEXEC;
+    sqe->file_index = file.slot + 1;
+    sqe->flags = IOSQE_IO_LINK; // nothing else runs if the open fails
+    sqe = nextSqe(1);
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = file.slot;
+    sqe->flags = IOSQE_FIXED_FILE|IOSQE_IO_HARDLINK; // the close runs even when the write failed
+    sqe->addr = (unsigned long)data;
+    sqe->len = (unsigned)length;
+    sqe->off = (uint64_t)-1;
+    sqe = nextSqe(2);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->file_index = file.slot + 1;
+    int results[3] = {0, 0, 0};
+    bool submitted = submitAndWait(3, results);
+    slot_state[file.slot] = 0;
+    if (!submitted) {
+        errno = EIO;
+        *failed = "write";
+        return false;
+    }
+    if (results[0] < 0) {
+        errno = -results[0];
+        *failed = "open";
+        return false;
+    }
+    if (results[1] < 0) {
+        errno = -results[1];
+        *failed = "write";
+        return false;
+    }
+    if ((size_t)results[1] < length) { // short write, rare on files: append the rest
+        int fd = open(path, O_WRONLY|O_APPEND|O_CLOEXEC);
+        IoFile rest = {fd, -1};
+        bool written = (fd != -1 && write(&rest, data + results[1], length - results[1]));
+        if (fd != -1)
+            ::close(fd);
+        if (!written) {
+            *failed = "write";
+            return false;
+        }
+    }
+    if (results[2] < 0) {
+        errno = -results[2];
+        *failed = "close";
+        return false;
+    }
+    return true;
+}
+
+void IoEngine::flush() {
+    if (state != 1 || owner_pid != getpid())
+        return;
+    submitAndWait(0, NULL);
+    while (closing > 0) {
+        unsigned seen = 0;
+        if (syscall(__NR_io_uring_enter, ring_fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) == -1 && errno != EINTR) {
+            perror("smash error: io_uring_enter failed");
+            return;
+        }
+        reap(0, NULL, &seen);
+    }
+}
@@ -0,0 +1,84 @@
+#ifndef SMASH_IOENGINE_H_
+#define SMASH_IOENGINE_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define IO_ENGINE_ENTRIES (64)
+#define IO_ENGINE_FILES (64)           // direct descriptor slots of the ring
+#define IO_ENGINE_CHUNK (256 * 1024)   // one read, into the registered buffer
+#define IO_ENGINE_FIRST_READ (16 * 1024) // what openRead reads: a few lines need no more than the first pages
+
+struct io_uring_sqe;
+
+// A file opened through an IoEngine: a direct descriptor slot of its ring, or a plain fd.
+struct IoFile {
+    int fd;
+    int slot;
+};
+
+// File I/O for the builtins. On io_uring the steps of one operation go in one submission, linked
+// (open, readahead hint and first read; open, write and close), files are direct descriptors
+// that never enter smash's fd table, and reads land in one registered buffer. Where io_uring is
+// missing, disabled or off (`set ioengine sync`) the same calls are plain syscalls.
+// Not thread-safe: a thread that reads files on its own has its own engine.
+class IoEngine {
+    int state; // 0 not set up yet, 1 ring, -1 plain syscalls
+    bool unavailable; // io_uring_setup or the registration failed in this process
+    pid_t owner_pid; // a forked child sets up its own ring, the inherited one is the parent's
+    int ring_fd;
+    void* sq_ring;
+    void* cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    struct io_uring_sqe* sqes;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    void* cqes;
+    unsigned sq_entries;
+    unsigned local_tail;  // filled in, not yet published to the kernel
+    unsigned unsubmitted;
+    unsigned closing;     // CLOSE submitted, completion not seen yet
+    bool fixed_buffer;    // the buffer is registered, READ_FIXED can be used
+    char* buffer;
+    unsigned char slot_state[IO_ENGINE_FILES]; // 0 free, 1 open, 2 closing
+    static bool uring_allowed;
+    bool ready();
+    bool setup();
+    void teardown();
+    int allocSlot();
+    struct io_uring_sqe* nextSqe(unsigned tag);
+    bool submitAndWait(unsigned wanted, int* results);
+    void reap(unsigned wanted, int* results, unsigned* seen);
+public:
+    IoEngine();
+    ~IoEngine();
+    IoEngine(IoEngine const&)       = delete;
+    void operator=(IoEngine const&) = delete;
+    static IoEngine& getInstance(); // the shell's own
+    static void setUringAllowed(bool allowed);
+    static bool isUringAllowed();
+    bool usesUring();
+    // Opens path for a sequential read (POSIX_FADV_SEQUENTIAL) and reads the first
+    // IO_ENGINE_FIRST_READ bytes into *data. On failure errno is set and *failed names the step ("open", "read").
+    bool openRead(const char* path, IoFile* file, const char** data, ssize_t* length, const char** failed);
+    // The next chunk (at most length bytes), 0 at the end, -1 with errno set. *data stays valid
+    // until the next read.
+    ssize_t read(IoFile* file, const char** data, size_t length = IO_ENGINE_CHUNK);
+    // Opens path and writes data to it in the same submission.
+    bool openWrite(const char* path, int flags, mode_t mode, const char* data, size_t length, IoFile* file,
+                   const char** failed);
+    bool write(IoFile* file, const char* data, size_t length);
+    // On io_uring the close goes out with the next submission, or with flush().
+    void close(IoFile* file);
+    // open, write and close in one submission
+    bool writeFile(const char* path, int flags, mode_t mode, const char* data, size_t length, const char** failed);
+    void flush();
+};
+
+#endif //SMASH_IOENGINE_H_
@@ -0,0 +1,96 @@
+#include <algorithm>
+#include "jobgraph.h"
+
+static bool _byJobId(const WaitingJob& a, const WaitingJob& b) {
+    return a.job_id < b.job_id;
+}
+
+void JobGraph::add(const WaitingJob& job) {
+    waiting.insert(std::upper_bound(waiting.begin(), waiting.end(), job, _byJobId), job);
+}
+
+WaitingJob* JobGraph::find(int job_id) {
+    for (size_t i = 0; i < waiting.size(); i++) {
+        if (waiting[i].job_id == job_id)
+            return &waiting[i];
+    }
+    return NULL;
+}
+
+bool JobGraph::hasWaiting() {
+    return !waiting.empty();
+}
+
+int JobGraph::getMaxJobID() {
+    int max_job_id = waiting.empty() ? 0 : waiting.back().job_id;
+    for (size_t i = 0; i < ready.size(); i++)
+        max_job_id = std::max(max_job_id, ready[i].job_id);
+    return max_job_id;
+}
+
+const std::vector<WaitingJob>* JobGraph::getWaiting() {
+    return &waiting;
+}
+
+bool JobGraph::conditionHolds(JobCondition condition, int exit_code) {
+    return condition == JOB_AFTER_ANY || (condition == JOB_AFTER_SUCCESS) == (exit_code == 0);
+}
+
+void JobGraph::jobFinished(int job_id, int exit_code) {
+    std::vector<std::pair<int, int> > finished(1, std::make_pair(job_id, exit_code));
+    while (!finished.empty()) {
+        std::pair<int, int> done = finished.back();
+        finished.pop_back();
+        for (size_t i = 0; i < waiting.size();) {
+            WaitingJob& job = waiting[i];
+            std::vector<int>::iterator edge = std::find(job.waits_for.begin(), job.waits_for.end(), done.first);
+            if (edge == job.waits_for.end()) {
+                i++;
+                continue;
+            }
+            job.waits_for.erase(edge);
+            if (job.exit_code == 0)
+                job.exit_code = done.second;
+            if (!job.waits_for.empty()) {
+                i++;
+                continue;
+            }
+            if (conditionHolds(job.condition, job.exit_code))
+                ready.push_back(job);
+            else
+                finished.push_back(std::make_pair(job.job_id, job.exit_code)); // skipped
+            waiting.erase(waiting.begin() + i);
+        }
+    }
+}
+
+bool JobGraph::takeReady(WaitingJob* job) {
+    if (ready.empty())
+        return false;
+    *job = ready.front();
+    ready.erase(ready.begin());
+    return true;
+}
+
+bool JobGraph::cancel(int job_id) {
+    if (find(job_id) == NULL)
+        return false;
+    std::vector<int> dropped(1, job_id);
+    while (!dropped.empty()) {
+        int dropped_id = dropped.back();
+        dropped.pop_back();
+        for (size_t i = 0; i < waiting.size();) {
+            std::vector<int>& waits_for = waiting[i].waits_for;
+            if (waiting[i].job_id == dropped_id ||
+                std::find(waits_for.begin(), waits_for.end(), dropped_id) != waits_for.end()) {
+                if (waiting[i].job_id != dropped_id)
+                    dropped.push_back(waiting[i].job_id);
+                waiting.erase(waiting.begin() + i);
+            }
+            else {
+                i++;
+            }
+        }
+    }
+    return true;
+}
@@ -0,0 +1,44 @@
+#ifndef SMASH_JOBGRAPH_H_
+#define SMASH_JOBGRAPH_H_
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+// What a waiting job needs from its predecessors before it runs: `after %N` (any), `&&`, `||`.
+enum JobCondition {
+    JOB_AFTER_ANY, JOB_AFTER_SUCCESS, JOB_AFTER_FAILURE
+};
+
+// A background job that has its id already but waits for other jobs to finish.
+struct WaitingJob {
+    int job_id;            // reserved: no new job gets it while this one waits
+    std::string cmd_line;  // not expanded yet, like a line typed at the prompt
+    std::vector<int> after;     // every predecessor, for `jobs`
+    std::vector<int> waits_for; // the predecessors still running or waiting
+    JobCondition condition;
+    int exit_code;         // the first non-zero exit code among the finished predecessors
+    int64_t queued_ms;     // wall clock
+};
+
+// The dependency edges between background jobs. Jobs are nodes by job id; when the last
+// predecessor of a waiting job finishes, it is either ready to run or, when its condition does
+// not hold, skipped and finished in turn with its predecessors' exit code, as `a && b || c` does.
+class JobGraph {
+    std::vector<WaitingJob> waiting; // by job id
+    std::vector<WaitingJob> ready;
+public:
+    void add(const WaitingJob& job);
+    WaitingJob* find(int job_id);
+    bool hasWaiting();
+    int getMaxJobID(); // 0 when none is reserved
+    const std::vector<WaitingJob>* getWaiting();
+    // A job, or a skipped waiting one, finished with exit_code.
+    void jobFinished(int job_id, int exit_code);
+    bool takeReady(WaitingJob* job);
+    // Drops the waiting job and everything that waits on it, directly or not.
+    bool cancel(int job_id);
+    static bool conditionHolds(JobCondition condition, int exit_code);
+};
+
+#endif //SMASH_JOBGRAPH_H_
@@ -0,0 +1,177 @@
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "jobstate.h"
+
+JobStateFile::JobStateFile() : fd(-1), header(NULL), mapped_size(0) {}
+
+JobStateFile::~JobStateFile() {
+    if (header != NULL)
+        munmap(header, mapped_size);
+    if (fd != -1)
+        close(fd);
+}
+
+JobStateRecord* JobStateFile::record(uint32_t slot) {
+    return (JobStateRecord*)((char*)header + sizeof(JobStateHeader)) + slot;
+}
+
+bool JobStateFile::isOpen() {
+    return this->header != NULL;
+}
+
+bool JobStateFile::open(const char* path, std::vector<JobStateRecord>* records) {
+    fd = ::open(path, O_RDWR|O_CREAT|O_CLOEXEC, S_IRUSR|S_IWUSR);
+    if (fd == -1) {
+        perror("smash error: open failed");
+        return false;
+    }
+    if (flock(fd, LOCK_EX|LOCK_NB) == -1) {
+        if (errno == EWOULDBLOCK)
+            fprintf(stderr, "smash error: state file %s is used by another smash\n", path);
+        else
+            perror("smash error: flock failed");
+        close(fd);
+        fd = -1;
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        perror("smash error: fstat failed");
+        close(fd);
+        fd = -1;
+        return false;
+    }
+    JobStateHeader found;
+    bool fresh = (st.st_size == 0);
+    if (!fresh && (pread(fd, &found, sizeof(found), 0) != sizeof(found) ||
+                   memcmp(found.magic, JOBSTATE_MAGIC, sizeof(JOBSTATE_MAGIC)) != 0 ||
+                   found.record_size != sizeof(JobStateRecord) || found.slot_count == 0 ||
+                   (size_t)st.st_size < sizeof(JobStateHeader) + (size_t)found.slot_count * sizeof(JobStateRecord))) {
+        fprintf(stderr, "smash error: %s is not a smash state file\n", path);
+        close(fd);
+        fd = -1;
+        return false;
+    }
+    uint32_t slot_count = fresh ? JOBSTATE_SLOTS_MIN : found.slot_count;
+    mapped_size = sizeof(JobStateHeader) + (size_t)slot_count * sizeof(JobStateRecord);
+    if (fresh && ftruncate(fd, mapped_size) == -1) {
+        perror("smash error: ftruncate failed");
+        close(fd);
+        fd = -1;
+        return false;
+    }
+    void* mapping = mmap(NULL, mapped_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED) {
+        perror("smash error: mmap failed");
+        close(fd);
+        fd = -1;
+        return false;
+    }
+    header = (JobStateHeader*)mapping;
+    if (fresh) {
+        memcpy(header->magic, JOBSTATE_MAGIC, sizeof(JOBSTATE_MAGIC));
+        header->record_size = sizeof(JobStateRecord);
+        header->slot_count = slot_count;
+    }
+    // hand the old records out and start over empty: the caller adds back the jobs that survived
+    for (uint32_t slot = slot_count; slot > 0; slot--) {
+        JobStateRecord* r = record(slot - 1);
+        if (r->pid != 0) {
+            records->push_back(*r);
+            records->back().cmd_line[JOBSTATE_CMD_LENGTH - 1] = 0;
+            __atomic_store_n(&r->pid, 0, __ATOMIC_RELEASE);
+        }
+        free_slots.push_back(slot - 1);
+    }
+    return true;
+}
+
+bool JobStateFile::grow() {
+    uint32_t old_count = header->slot_count;
+    uint32_t new_count = old_count * 2;
+    size_t new_size = sizeof(JobStateHeader) + (size_t)new_count * sizeof(JobStateRecord);
+    if (ftruncate(fd, new_size) == -1) {
+        perror("smash error: ftruncate failed");
+        return false;
+    }
+    void* mapping = mremap(header, mapped_size, new_size, MREMAP_MAYMOVE);
+    if (mapping == MAP_FAILED) {
+        perror("smash error: mremap failed");
+        return false;
+    }
+    header = (JobStateHeader*)mapping;
+    mapped_size = new_size;
+    header->slot_count = new_count; // the new slots are zero, that is free, before this is seen
+    for (uint32_t slot = new_count; slot > old_count; slot--)
+        free_slots.push_back(slot - 1);
+    return true;
+}
+
+void JobStateFile::add(int job_id, pid_t pid, time_t start_time, bool stopped, const std::string& cmd_line) {
+    if (header == NULL || (free_slots.empty() && !grow()))
+        return;
+    uint32_t slot = free_slots.back();
+    free_slots.pop_back();
+    JobStateRecord* r = record(slot);
+    r->pgid = pid; // background jobs call setpgrp, each one leads its own group
+    r->job_id = job_id;
+    r->stopped = stopped;
+    r->start_time = start_time;
+    r->deadline = 0;
+    r->start_ticks = processStartTicks(pid);
+    size_t length = std::min(cmd_line.size(), (size_t)JOBSTATE_CMD_LENGTH - 1);
+    memcpy(r->cmd_line, cmd_line.c_str(), length);
+    r->cmd_line[length] = 0;
+    __atomic_store_n(&r->pid, pid, __ATOMIC_RELEASE);
+    slots[pid] = slot;
+}
+
+void JobStateFile::remove(pid_t pid) {
+    std::unordered_map<pid_t, uint32_t>::iterator it = slots.find(pid);
+    if (it == slots.end())
+        return;
+    __atomic_store_n(&record(it->second)->pid, 0, __ATOMIC_RELEASE);
+    free_slots.push_back(it->second);
+    slots.erase(it);
+}
+
+void JobStateFile::setStopped(pid_t pid, bool stopped) {
+    std::unordered_map<pid_t, uint32_t>::iterator it = slots.find(pid);
+    if (it != slots.end())
+        record(it->second)->stopped = stopped;
+}
+
+void JobStateFile::setDeadline(pid_t pid, time_t deadline) {
+    std::unordered_map<pid_t, uint32_t>::iterator it = slots.find(pid);
+    if (it != slots.end())
+        record(it->second)->deadline = deadline;
+}
+
+uint64_t JobStateFile::processStartTicks(pid_t pid) {
+    char path[32];
+    char buff[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    int stat_fd = ::open(path, O_RDONLY|O_CLOEXEC);
+    if (stat_fd == -1)
+        return 0;
+    ssize_t length = read(stat_fd, buff, sizeof(buff) - 1);
+    close(stat_fd);
+    if (length <= 0)
+        return 0;
+    buff[length] = 0;
+    // the command name may hold spaces and parentheses, the fields are counted from its last ')'
+    const char* p = strrchr(buff, ')');
+    if (p == NULL)
+        return 0;
+    for (int field = 2; field < 22 && p != NULL; field++)
+        p = strchr(p + 1, ' ');
+    return (p == NULL) ? 0 : strtoull(p + 1, NULL, 10);
+}
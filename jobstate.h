@@ -0,0 +1,60 @@
+#ifndef SMASH_JOBSTATE_H_
+#define SMASH_JOBSTATE_H_
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define JOBSTATE_MAGIC "SMJOBS1"
+#define JOBSTATE_CMD_LENGTH (216) // longer command lines are cut, they are only shown by `jobs`
+#define JOBSTATE_SLOTS_MIN (64)
+
+// One job in the state file. A slot is in use while pid != 0; pid is written last and
+// cleared first, so a smash killed half-way through an update never leaves a torn record.
+struct JobStateRecord {
+    int32_t pid;
+    int32_t pgid;
+    int32_t job_id;
+    uint8_t stopped;
+    uint8_t reserved[3];
+    int64_t start_time;   // time(NULL) when the job was added, `jobs` counts seconds from it
+    int64_t deadline;     // time(NULL) the job times out at, 0 = no timeout
+    uint64_t start_ticks; // /proc/<pid>/stat starttime: tells the job from a later process reusing its pid
+    char cmd_line[JOBSTATE_CMD_LENGTH];
+};
+
+struct JobStateHeader {
+    char magic[8];
+    uint32_t record_size;
+    uint32_t slot_count;
+};
+
+// The jobs table mirrored into an mmap'ed file (`smash --state FILE`). Every change touches
+// only its own slot in the shared mapping, there is no write() or fsync on the command path;
+// the page cache keeps the data when smash itself dies. The file is flock'ed, one smash at a time.
+class JobStateFile {
+    int fd;
+    JobStateHeader* header;
+    size_t mapped_size;
+    std::unordered_map<pid_t, uint32_t> slots; // pid -> slot
+    std::vector<uint32_t> free_slots;
+    JobStateRecord* record(uint32_t slot);
+    bool grow();
+public:
+    JobStateFile();
+    ~JobStateFile();
+    JobStateFile(JobStateFile const&)   = delete;
+    void operator=(JobStateFile const&) = delete;
+    // Maps path, creating it if needed; the records found in it are returned for re-adoption.
+    bool open(const char* path, std::vector<JobStateRecord>* records);
+    bool isOpen();
+    void add(int job_id, pid_t pid, time_t start_time, bool stopped, const std::string& cmd_line);
+    void remove(pid_t pid);
+    void setStopped(pid_t pid, bool stopped);
+    void setDeadline(pid_t pid, time_t deadline);
+    static uint64_t processStartTicks(pid_t pid); // 0 when the process is gone
+};
+
+#endif //SMASH_JOBSTATE_H_
@@ -0,0 +1,172 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include "launch.h"
+
+#define IOPRIO_CLASS_SHIFT (13)
+#define IOPRIO_WHO_PROCESS (1)
+
+static bool _isSpace(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f' || c == '\v';
+}
+
+void initLaunchOptions(LaunchOptions* options) {
+    options->has_cpus = false;
+    CPU_ZERO(&options->cpus);
+    options->nice = LAUNCH_NICE_UNSET;
+    options->io_class = -1;
+    options->io_level = -1;
+    options->policy = -1;
+}
+
+bool parseCpuList(const char* list, cpu_set_t* cpus) {
+    CPU_ZERO(cpus);
+    const char* p = list;
+    while (true) {
+        char* end;
+        errno = 0;
+        long first = strtol(p, &end, 10);
+        if (end == p || errno != 0 || first < 0 || first >= CPU_SETSIZE)
+            return false;
+        long last = first;
+        p = end;
+        if (*p == '-') {
+            last = strtol(p + 1, &end, 10);
+            if (end == p + 1 || errno != 0 || last < first || last >= CPU_SETSIZE)
+                return false;
+            p = end;
+        }
+        for (long cpu = first; cpu <= last; cpu++)
+            CPU_SET(cpu, cpus);
+        if (*p == 0)
+            return true;
+        if (*p++ != ',')
+            return false;
+    }
+}
+
+bool parseIoClass(const char* value, int* io_class, int* io_level) {
+    const char* colon = strchr(value, ':');
+    size_t length = (colon != NULL) ? (size_t)(colon - value) : strlen(value);
+    if (length == 4 && strncmp(value, "idle", 4) == 0)
+        *io_class = IOPRIO_CLASS_IDLE;
+    else if ((length == 11 && strncmp(value, "best-effort", 11) == 0) || (length == 2 && strncmp(value, "be", 2) == 0))
+        *io_class = IOPRIO_CLASS_BE;
+    else if ((length == 8 && strncmp(value, "realtime", 8) == 0) || (length == 2 && strncmp(value, "rt", 2) == 0))
+        *io_class = IOPRIO_CLASS_RT;
+    else
+        return false;
+    *io_level = (*io_class == IOPRIO_CLASS_IDLE) ? 0 : 4; // the kernel's default level
+    if (colon == NULL)
+        return true;
+    if (*io_class == IOPRIO_CLASS_IDLE || colon[1] < '0' || colon[1] > '7' || colon[2] != 0)
+        return false; // the idle class has no levels
+    *io_level = colon[1] - '0';
+    return true;
+}
+
+bool parseNice(const char* value, int* nice) {
+    char* end;
+    errno = 0;
+    long number = strtol(value, &end, 10);
+    if (end == value || *end != 0 || errno != 0 || number < -20 || number > 19)
+        return false;
+    *nice = (int)number;
+    return true;
+}
+
+bool isRunCommand(const char* cmd_line) {
+    while (_isSpace(*cmd_line))
+        cmd_line++;
+    return strncmp(cmd_line, "run", 3) == 0 && (cmd_line[3] == 0 || _isSpace(cmd_line[3]));
+}
+
+// next whitespace separated word of *p into word; false when there is none or it does not fit
+static bool _nextWord(const char** p, char* word, size_t size) {
+    while (_isSpace(**p))
+        (*p)++;
+    const char* start = *p;
+    while (**p != 0 && !_isSpace(**p))
+        (*p)++;
+    size_t length = *p - start;
+    if (length == 0 || length >= size)
+        return false;
+    memcpy(word, start, length);
+    word[length] = 0;
+    return true;
+}
+
+bool parseRunPrefix(const char* cmd_line, LaunchOptions* options, const char** rest) {
+    const char* p = cmd_line;
+    char option[16];
+    char value[256];
+    _nextWord(&p, option, sizeof(option)); // "run"
+    while (true) {
+        while (_isSpace(*p))
+            p++;
+        if (strncmp(p, "--", 2) != 0)
+            break;
+        if (!_nextWord(&p, option, sizeof(option)))
+            return false;
+        if (strcmp(option, "--") == 0)
+            break;
+        if (!_nextWord(&p, value, sizeof(value)))
+            return false;
+        if (strcmp(option, "--cpus") == 0) {
+            if (!parseCpuList(value, &options->cpus))
+                return false;
+            options->has_cpus = true;
+        }
+        else if (strcmp(option, "--nice") == 0) {
+            if (!parseNice(value, &options->nice))
+                return false;
+        }
+        else if (strcmp(option, "--io") == 0) {
+            if (!parseIoClass(value, &options->io_class, &options->io_level))
+                return false;
+        }
+        else if (strcmp(option, "--sched") == 0) {
+            if (strcmp(value, "batch") == 0)
+                options->policy = SCHED_BATCH;
+            else if (strcmp(value, "other") == 0)
+                options->policy = SCHED_OTHER;
+            else
+                return false;
+        }
+        else {
+            return false;
+        }
+    }
+    while (_isSpace(*p))
+        p++;
+    *rest = p;
+    return *p != 0 && *p != '&';
+}
+
+void applyLaunchOptions(const LaunchOptions& options) {
+    if (options.has_cpus && sched_setaffinity(0, sizeof(options.cpus), &options.cpus) == -1)
+        perror("smash error: sched_setaffinity failed");
+    if (options.policy != -1) {
+        struct sched_param param;
+        param.sched_priority = 0;
+        if (sched_setscheduler(0, options.policy, &param) == -1)
+            perror("smash error: sched_setscheduler failed");
+    }
+    if (options.nice != LAUNCH_NICE_UNSET && setpriority(PRIO_PROCESS, 0, options.nice) == -1)
+        perror("smash error: setpriority failed");
+    if (options.io_class != -1 &&
+        syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, (options.io_class << IOPRIO_CLASS_SHIFT) | options.io_level) == -1)
+        perror("smash error: ioprio_set failed");
+}
+
+bool reniceGroup(pid_t pgid, int nice) {
+    if (setpriority(PRIO_PGRP, pgid, nice) == -1) {
+        perror("smash error: setpriority failed");
+        return false;
+    }
+    return true;
+}
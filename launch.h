@@ -0,0 +1,40 @@
+#ifndef SMASH_LAUNCH_H_
+#define SMASH_LAUNCH_H_
+
+#include <sched.h>
+#include <sys/types.h>
+
+#define LAUNCH_NICE_UNSET (-100) // outside -20..19
+
+// ioprio classes, as in linux/ioprio.h
+#define IOPRIO_CLASS_RT (1)
+#define IOPRIO_CLASS_BE (2)
+#define IOPRIO_CLASS_IDLE (3)
+
+// CPU placement and priorities a job gets in the child, between fork and exec, so the program
+// starts with them and everything it forks inherits them. -1 / LAUNCH_NICE_UNSET leaves a field alone.
+struct LaunchOptions {
+    bool has_cpus;
+    cpu_set_t cpus;
+    int nice;
+    int io_class;
+    int io_level;
+    int policy; // SCHED_OTHER or SCHED_BATCH
+};
+
+void initLaunchOptions(LaunchOptions* options);
+// "4-7", "0,2,5-6"
+bool parseCpuList(const char* list, cpu_set_t* cpus);
+// "idle", "best-effort[:0-7]", "realtime[:0-7]" ("be" and "rt" for short)
+bool parseIoClass(const char* value, int* io_class, int* io_level);
+bool parseNice(const char* value, int* nice);
+// Takes `run --cpus LIST --nice N --io CLASS --sched batch|other` off the front of cmd_line;
+// *rest points at the command after the options. False on an unknown option or a missing command.
+bool parseRunPrefix(const char* cmd_line, LaunchOptions* options, const char** rest);
+bool isRunCommand(const char* cmd_line);
+// In the forked child; failures are reported and the command still runs.
+void applyLaunchOptions(const LaunchOptions& options);
+// nice of every process in the group, like renice -g
+bool reniceGroup(pid_t pgid, int nice);
+
+#endif //SMASH_LAUNCH_H_
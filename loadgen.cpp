@@ -0,0 +1,386 @@
+#include <iostream>
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <dirent.h>
+#include <errno.h>
+#include <poll.h>
+#include <pty.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+// End-to-end load generator: drives ./smash through a pty with synthetic workloads, records a
+// latency histogram per workload (line written -> next prompt seen) and smash's peak RSS, and
+// compares the run against a stored baseline file. The baseline is per machine and stays out of
+// git; without one (or with --update-baseline) the run records it instead of comparing.
+
+using namespace std;
+
+#define PROMPT "smash> "
+#define HISTOGRAM_BUCKETS (32)
+
+static uint64_t _nowUs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+struct Workload {
+    std::string name;
+    std::vector<std::string> lines;
+    bool check_fds; // fail when smash holds more descriptors after the workload than before it
+    Workload() : check_fds(false) {}
+};
+
+class Histogram {
+    uint64_t buckets[HISTOGRAM_BUCKETS]; // bucket i counts samples in [2^i, 2^(i+1)) us
+    std::vector<uint64_t> samples;
+public:
+    Histogram() {
+        memset(buckets, 0, sizeof(buckets));
+    }
+    void add(uint64_t us) {
+        int bucket = 0;
+        while (bucket < HISTOGRAM_BUCKETS - 1 && (us >> (bucket + 1)) != 0)
+            bucket++;
+        buckets[bucket]++;
+        samples.push_back(us);
+    }
+    uint64_t percentile(double p) {
+        if (samples.empty())
+            return 0;
+        std::vector<uint64_t> sorted(samples);
+        std::sort(sorted.begin(), sorted.end());
+        size_t idx = (size_t)(p / 100.0 * (sorted.size() - 1) + 0.5);
+        return sorted[idx];
+    }
+    size_t count() {
+        return samples.size();
+    }
+    void print(const std::string& name) {
+        printf("%s: %zu commands, p50 %llu us, p90 %llu us, p99 %llu us, max %llu us\n", name.c_str(), count(),
+               (unsigned long long)percentile(50), (unsigned long long)percentile(90),
+               (unsigned long long)percentile(99), (unsigned long long)percentile(100));
+        uint64_t max_bucket = 1;
+        for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+            max_bucket = std::max(max_bucket, buckets[i]);
+        for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+            if (buckets[i] == 0)
+                continue;
+            printf("  %9llu us | %-40s %llu\n", 1ULL << i,
+                   std::string((size_t)(40 * buckets[i] / max_bucket) + 1, '#').c_str(), (unsigned long long)buckets[i]);
+        }
+    }
+};
+
+class SmashDriver {
+    int master_fd;
+    pid_t pid;
+    std::string pending; // pty output not consumed yet
+public:
+    SmashDriver() : master_fd(-1), pid(-1) {}
+    bool start(const char* smash_path) {
+        pid = forkpty(&master_fd, NULL, NULL, NULL);
+        if (pid == -1) {
+            perror("load: forkpty failed");
+            return false;
+        }
+        if (pid == 0) {
+            // default cooked terminal, minus echo so the typed lines do not show up as output
+            struct termios tio;
+            if (tcgetattr(STDIN_FILENO, &tio) == 0) {
+                tio.c_lflag &= ~ECHO;
+                tcsetattr(STDIN_FILENO, TCSANOW, &tio);
+            }
+            execl(smash_path, smash_path, (char*)NULL);
+            perror("load: exec smash failed");
+            _exit(127);
+        }
+        return waitPrompt(10000) >= 0;
+    }
+    pid_t getPid() {
+        return pid;
+    }
+    // Consumes output up to and including the next prompt, handing what came before it to output.
+    // Returns -1 on timeout/EOF.
+    int waitPrompt(int timeout_ms, std::string* output = NULL) {
+        uint64_t deadline = _nowUs() + (uint64_t)timeout_ms * 1000;
+        for (;;) {
+            size_t pos = pending.find(PROMPT);
+            if (pos != std::string::npos) {
+                if (output != NULL)
+                    *output = pending.substr(0, pos);
+                pending.erase(0, pos + strlen(PROMPT));
+                return 0;
+            }
+            uint64_t now = _nowUs();
+            if (now >= deadline)
+                return -1;
+            struct pollfd pfd = {master_fd, POLLIN, 0};
+            int ready = poll(&pfd, 1, (int)((deadline - now) / 1000) + 1);
+            if (ready == -1 && errno == EINTR)
+                continue;
+            if (ready <= 0)
+                return -1;
+            char buff[4096];
+            ssize_t n = read(master_fd, buff, sizeof(buff));
+            if (n <= 0)
+                return -1;
+            pending.append(buff, n);
+        }
+    }
+    // Returns the latency in us, or -1 when smash did not come back to the prompt.
+    int64_t run(const std::string& line, std::string* output = NULL) {
+        pending.clear(); // asynchronous job output printed while idle is not part of this command
+        std::string with_newline = line + "\n";
+        uint64_t start = _nowUs();
+        if (write(master_fd, with_newline.c_str(), with_newline.size()) == -1) {
+            perror("load: write failed");
+            return -1;
+        }
+        if (waitPrompt(30000, output) < 0)
+            return -1;
+        return (int64_t)(_nowUs() - start);
+    }
+    int openFds() {
+        DIR* dir = opendir(("/proc/" + std::to_string(pid) + "/fd").c_str());
+        if (dir == NULL)
+            return -1;
+        int count = 0;
+        struct dirent* entry;
+        while ((entry = readdir(dir)) != NULL) {
+            if (entry->d_name[0] != '.')
+                count++;
+        }
+        closedir(dir);
+        return count;
+    }
+    long peakRssKb() {
+        std::ifstream status(("/proc/" + std::to_string(pid) + "/status").c_str());
+        std::string line;
+        while (std::getline(status, line)) {
+            if (line.compare(0, 6, "VmHWM:") == 0)
+                return atol(line.c_str() + 6);
+        }
+        return -1;
+    }
+    int stop() {
+        std::string quit = "quit kill\n";
+        if (write(master_fd, quit.c_str(), quit.size()) == -1)
+            perror("load: write failed");
+        int status = 0;
+        for (int i = 0; i < 100; i++) {
+            char buff[4096];
+            while (read(master_fd, buff, sizeof(buff)) > 0) {}
+            pid_t done = waitpid(pid, &status, WNOHANG);
+            if (done == pid) {
+                close(master_fd);
+                return status;
+            }
+            usleep(100000);
+        }
+        kill(pid, SIGKILL);
+        waitpid(pid, &status, 0);
+        close(master_fd);
+        return -1;
+    }
+};
+
+// <---------- START workloads ------------>
+static Workload _backgroundJobs(int scale, const std::string&) {
+    Workload w;
+    w.name = "bg_jobs";
+    for (int i = 0; i < 1000 * scale; i++) {
+        w.lines.push_back("sleep 5&");
+        if (i % 100 == 99)
+            w.lines.push_back("jobs > /dev/null");
+    }
+    w.lines.push_back("jobs > /dev/null");
+    return w;
+}
+
+static Workload _deepPipelines(int scale, const std::string&) {
+    Workload w;
+    w.name = "pipelines";
+    std::string line = "echo load";
+    for (int depth = 0; depth < 8; depth++)
+        line += " | cat";
+    for (int i = 0; i < 50 * scale; i++)
+        w.lines.push_back(line);
+    return w;
+}
+
+static Workload _concurrentTimeouts(int scale, const std::string&) {
+    Workload w;
+    w.name = "timeouts";
+    for (int i = 0; i < 20 * scale; i++)
+        w.lines.push_back("timeout " + std::to_string(1 + i % 3) + " sleep 10&");
+    w.lines.push_back("jobs > /dev/null");
+    return w;
+}
+
+static Workload _redirectBuiltins(int scale, const std::string& dir) {
+    Workload w;
+    w.name = "redirects";
+    for (int i = 0; i < 500 * scale; i++) {
+        w.lines.push_back("pwd > " + dir + "/pwd.txt");
+        w.lines.push_back("showpid >> " + dir + "/pid.txt");
+        w.lines.push_back("jobs > " + dir + "/jobs.txt");
+        w.lines.push_back("head -5 " + dir + "/pid.txt > " + dir + "/head.txt");
+    }
+    return w;
+}
+
+// 100k short commands over every path that opens a descriptor in smash itself; the fd count
+// must come back to where it started.
+static Workload _fdLeak(int scale, const std::string& dir) {
+    Workload w;
+    w.name = "fd_leak";
+    w.check_fds = true;
+    const std::string lines[] = {
+        "pwd > " + dir + "/fd.txt",
+        "kill >> " + dir + "/fd_err.txt",
+        "showpid 2> " + dir + "/fd_err.txt",
+        "jobs < " + dir + "/fd.txt",
+        "head -0 " + dir + "/fd.txt",
+        "pwd &> " + dir + "/fd.txt",
+        "set pipesize 128K",
+        "fds > /dev/null",
+        "head -1 /nonexistent 2>&1",
+        "showpid <<< input",
+    };
+    const size_t lines_num = sizeof(lines) / sizeof(lines[0]);
+    for (int i = 0; i < 100000 * scale; i++) {
+        if (i % 1000 == 999)
+            w.lines.push_back(i % 2000 == 999 ? "echo fd | cat" : "true > " + dir + "/fd_ext.txt 2>&1");
+        else
+            w.lines.push_back(lines[i % lines_num]);
+    }
+    return w;
+}
+// <---------- END workloads ------------>
+
+static std::map<std::string, double> _readBaseline(const std::string& path) {
+    std::map<std::string, double> baseline;
+    std::ifstream in(path.c_str());
+    std::string key;
+    double value;
+    while (in >> key >> value)
+        baseline[key] = value;
+    return baseline;
+}
+
+int main(int argc, char* argv[]) {
+    const char* smash_path = "./smash";
+    std::string baseline_path = "load_baseline.txt";
+    std::string filter;
+    bool update_baseline = false;
+    double threshold = 50; // percent
+    int scale = 1;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--smash") == 0 && i + 1 < argc)
+            smash_path = argv[++i];
+        else if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc)
+            baseline_path = argv[++i];
+        else if (strcmp(argv[i], "--threshold") == 0 && i + 1 < argc)
+            threshold = atof(argv[++i]);
+        else if (strcmp(argv[i], "--scale") == 0 && i + 1 < argc)
+            scale = std::max(1, atoi(argv[++i]));
+        else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc)
+            filter = argv[++i];
+        else if (strcmp(argv[i], "--update-baseline") == 0)
+            update_baseline = true;
+        else {
+            std::cerr << "usage: " << argv[0] << " [--smash PATH] [--baseline FILE] [--update-baseline]"
+                      << " [--threshold PERCENT] [--scale N] [--filter WORKLOAD]" << endl;
+            return 2;
+        }
+    }
+    char dir_template[] = "/tmp/smash_load.XXXXXX";
+    if (mkdtemp(dir_template) == NULL) {
+        perror("load: mkdtemp failed");
+        return 2;
+    }
+    std::string dir = dir_template;
+
+    Workload (*generators[])(int, const std::string&) = {
+        _backgroundJobs, _deepPipelines, _concurrentTimeouts, _redirectBuiltins, _fdLeak
+    };
+    std::map<std::string, double> metrics;
+    bool failed = false;
+    for (auto generate : generators) {
+        Workload w = generate(scale, dir);
+        if (!filter.empty() && w.name != filter)
+            continue;
+        // every workload gets a fresh smash, so job tables and peak RSS do not leak between them
+        SmashDriver smash;
+        if (!smash.start(smash_path)) {
+            std::cerr << "load: smash did not show a prompt" << endl;
+            return 2;
+        }
+        Histogram histogram;
+        int fds_before = smash.openFds();
+        for (const std::string& line : w.lines) {
+            int64_t us = smash.run(line);
+            if (us < 0) {
+                std::cerr << "load: " << w.name << ": no prompt after '" << line << "'" << endl;
+                failed = true;
+                break;
+            }
+            histogram.add((uint64_t)us);
+        }
+        long rss_kb = smash.peakRssKb();
+        int fds_after = smash.openFds();
+        smash.stop();
+        if (w.check_fds && fds_after != fds_before) {
+            printf("load: %s: LEAK smash had %d descriptors before the workload, %d after\n",
+                   w.name.c_str(), fds_before, fds_after);
+            failed = true;
+        }
+        histogram.print(w.name);
+        printf("  peak RSS %ld kB\n", rss_kb);
+        metrics[w.name + ".p50_us"] = histogram.percentile(50);
+        metrics[w.name + ".p99_us"] = histogram.percentile(99);
+        metrics[w.name + ".peak_rss_kb"] = rss_kb;
+    }
+    std::string cleanup = "rm -rf " + dir;
+    if (system(cleanup.c_str()) != 0)
+        perror("load: cleanup failed");
+
+    struct stat st;
+    if (update_baseline || stat(baseline_path.c_str(), &st) != 0) {
+        std::map<std::string, double> merged = _readBaseline(baseline_path);
+        for (auto& m : metrics)
+            merged[m.first] = m.second;
+        std::ofstream out(baseline_path.c_str());
+        for (auto& m : merged)
+            out << m.first << " " << (long long)m.second << "\n";
+        printf("load: baseline written to %s\n", baseline_path.c_str());
+        return failed ? 1 : 0;
+    }
+    std::map<std::string, double> baseline = _readBaseline(baseline_path);
+    for (auto& m : metrics) {
+        auto it = baseline.find(m.first);
+        if (it == baseline.end())
+            continue;
+        // latencies below a millisecond are mostly scheduler noise, give them an absolute slack too
+        double slack = (m.first.find("_us") != std::string::npos) ? 1000 : 0;
+        double limit = it->second * (1 + threshold / 100) + slack;
+        if (m.second > limit) {
+            printf("load: REGRESSION %s: %.0f > %.0f (baseline %.0f, threshold %.0f%%)\n",
+                   m.first.c_str(), m.second, limit, it->second, threshold);
+            failed = true;
+        }
+    }
+    printf("load: %s\n", failed ? "FAILED" : "PASSED");
+    return failed ? 1 : 0;
+}
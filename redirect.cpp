@@ -0,0 +1,366 @@
+#include <iostream>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "redirect.h"
+
+#define SAVED_FD_MIN (10) // keep the saved copies out of the way of 0-2 and of what the builtin opens
+
+static bool _isBlank(char c) {
+    return c != 0 && strchr(" \n\r\t\f\v", c) != NULL;
+}
+
+// Matches a redirection operator at p. The 2> forms only count at the start of a word, so
+// `echo a2>f` keeps the "a2" argument like bash does.
+static int _matchOperator(const char* p, bool word_start, RedirectKind* kind) {
+    if (strncmp(p, "<<<", 3) == 0) {
+        *kind = REDIRECT_HERE_STRING;
+        return 3;
+    }
+    if (*p == '<') {
+        *kind = REDIRECT_STDIN;
+        return 1;
+    }
+    if (strncmp(p, ">>", 2) == 0) {
+        *kind = REDIRECT_STDOUT_APPEND;
+        return 2;
+    }
+    if (*p == '>') {
+        *kind = REDIRECT_STDOUT;
+        return 1;
+    }
+    if (strncmp(p, "&>", 2) == 0) {
+        *kind = REDIRECT_ALL;
+        return 2;
+    }
+    if (!word_start || *p != '2')
+        return 0;
+    if (strncmp(p, "2>&1", 4) == 0) {
+        *kind = REDIRECT_STDERR_TO_STDOUT;
+        return 4;
+    }
+    if (strncmp(p, "2>>", 3) == 0) {
+        *kind = REDIRECT_STDERR_APPEND;
+        return 3;
+    }
+    if (strncmp(p, "2>", 2) == 0) {
+        *kind = REDIRECT_STDERR;
+        return 2;
+    }
+    return 0;
+}
+
+size_t readShellWord(const char** p, char* out) {
+    const char* s = *p;
+    size_t length = 0;
+    char quote = 0;
+    for (; *s != 0; s++) {
+        if (quote != 0) {
+            if (*s == quote)
+                quote = 0;
+            else
+                out[length++] = *s;
+        }
+        else if (*s == '\'' || *s == '"') {
+            quote = *s;
+        }
+        else if (_isBlank(*s) || *s == '<' || *s == '>') {
+            break;
+        }
+        else if (*s == '\\' && s[1] != 0) {
+            out[length++] = *(++s);
+        }
+        else {
+            out[length++] = *s;
+        }
+    }
+    out[length] = 0;
+    *p = s;
+    return length;
+}
+
+const char* findUnquoted(const char* s, const char* token) {
+    size_t token_length = strlen(token);
+    char quote = 0;
+    for (; *s != 0; s++) {
+        if (quote != 0) {
+            if (*s == quote)
+                quote = 0;
+        }
+        else if (*s == '\'' || *s == '"') {
+            quote = *s;
+        }
+        else if (*s == '\\' && s[1] != 0) {
+            s++;
+        }
+        else if (strncmp(s, token, token_length) == 0) {
+            return s;
+        }
+    }
+    return NULL;
+}
+
+static bool _isSyntax(char c, bool in_double) {
+    if (in_double) // inside double quotes a backslash only escapes these, bash keeps it before anything else
+        return c == '"' || c == '\\' || c == '$' || c == '`';
+    return c != 0 && strchr("|&;<>()$`\\'\"#~{}", c) != NULL;
+}
+
+size_t escapeShellText(const char* text, size_t length, bool in_double, char* out) {
+    size_t used = 0;
+    for (size_t i = 0; i < length; i++) {
+        char c = text[i];
+        if (!in_double && (c == '\n' || c == '\t' || c == '\r'))
+            c = ' ';
+        if (_isSyntax(c, in_double)) {
+            if (out != NULL)
+                out[used] = '\\';
+            used++;
+        }
+        if (out != NULL)
+            out[used] = c;
+        used++;
+    }
+    return used;
+}
+
+static bool _isOnlyBlanks(const char* s) {
+    while (_isBlank(*s))
+        s++;
+    return *s == 0;
+}
+
+Redirections::Redirections() : count(0) {
+    saved_fds[0] = saved_fds[1] = saved_fds[2] = -1;
+}
+
+char* Redirections::parse(const char* cmd_line, Arena* arena) {
+    size_t length = strlen(cmd_line);
+    char* line = (char*)arena->allocate(length + 3); // room for a " &" moved off a target
+    size_t used = 0;
+    char quote = 0;
+    bool word_start = true;
+    const char* p = cmd_line;
+    while (*p != 0) {
+        char c = *p;
+        RedirectKind kind;
+        int op_length;
+        if (quote != 0) {
+            if (c == quote)
+                quote = 0;
+        }
+        else if (c == '\'' || c == '"') {
+            quote = c;
+        }
+        else if (c == '\\' && p[1] != 0) {
+            line[used++] = *p++;
+            c = *p; // the escaped character is copied below like any other
+        }
+        else if ((op_length = _matchOperator(p, word_start, &kind)) > 0) {
+            p += op_length;
+            char* target = (char*)arena->allocate(length + 1);
+            if (kind != REDIRECT_STDERR_TO_STDOUT) {
+                while (_isBlank(*p))
+                    p++;
+                size_t target_length = readShellWord(&p, target);
+                // `cmd > out&`: the background sign belongs to the command, not to the file name
+                if (target_length > 0 && target[target_length - 1] == '&' && _isOnlyBlanks(p)) {
+                    target[target_length - 1] = 0;
+                    p = "&";
+                }
+            }
+            else {
+                target[0] = 0;
+            }
+            if (count < REDIRECTS_MAX) {
+                items[count].kind = kind;
+                items[count].target = target;
+                count++;
+            }
+            if (used > 0 && !_isBlank(line[used - 1]))
+                line[used++] = ' ';
+            word_start = true;
+            continue;
+        }
+        line[used++] = c;
+        word_start = _isBlank(c);
+        p++;
+    }
+    while (used > 0 && _isBlank(line[used - 1]) && count > 0)
+        used--;
+    line[used] = 0;
+    return line;
+}
+
+int Redirections::size() {
+    return this->count;
+}
+
+int Redirections::stdoutStatus(char** file_name) {
+    int status = 2;
+    for (int i = 0; i < count; i++) {
+        if (items[i].kind == REDIRECT_STDOUT || items[i].kind == REDIRECT_ALL) {
+            status = 0;
+            *file_name = items[i].target;
+        }
+        else if (items[i].kind == REDIRECT_STDOUT_APPEND) {
+            status = 1;
+            *file_name = items[i].target;
+        }
+        // stderr shares the target: apply() truncates it once, the builtin's writes append behind stderr's
+        if (items[i].kind == REDIRECT_ALL || (items[i].kind == REDIRECT_STDERR_TO_STDOUT && status != 2))
+            status = 1;
+    }
+    return status;
+}
+
+bool Redirections::saveFd(int fd) {
+    if (saved_fds[fd] != -1)
+        return true;
+    std::cout.flush();
+    saved_fds[fd] = fcntl(fd, F_DUPFD_CLOEXEC, SAVED_FD_MIN);
+    if (saved_fds[fd] == -1) {
+        perror("smash error: fcntl failed");
+        return false;
+    }
+    return true;
+}
+
+static int _openTarget(RedirectKind kind, const char* target, bool append_only) {
+    int flags;
+    if (kind == REDIRECT_STDIN)
+        flags = O_RDONLY;
+    else if (append_only || kind == REDIRECT_STDOUT_APPEND || kind == REDIRECT_STDERR_APPEND)
+        flags = O_WRONLY|O_CREAT|O_APPEND;
+    else
+        flags = O_WRONLY|O_CREAT|O_TRUNC;
+    int fd = open(target, flags|O_CLOEXEC, S_IRWXU|S_IRWXG|S_IRWXO);
+    if (fd == -1)
+        perror("smash error: open failed");
+    return fd;
+}
+
+// A builtin's stdout target that stderr goes to as well (`&>`, `> f 2>&1`): opened once, truncated
+// here if it should be, and in append mode so stderr and ChangeIO's writes land one after the other.
+static int _openShared(RedirectKind kind, const char* target) {
+    int flags = O_WRONLY|O_CREAT|O_APPEND|((kind == REDIRECT_STDOUT_APPEND) ? 0 : O_TRUNC);
+    int fd = open(target, flags|O_CLOEXEC, S_IRWXU|S_IRWXG|S_IRWXO);
+    if (fd == -1)
+        perror("smash error: open failed");
+    return fd;
+}
+
+static int _openHereString(const char* word) {
+    // a memfd instead of a pipe: the whole string is written before the command reads, whatever its size
+    int fd = memfd_create("smash-here-string", MFD_CLOEXEC);
+    if (fd == -1) {
+        perror("smash error: memfd_create failed");
+        return -1;
+    }
+    size_t length = strlen(word);
+    if (write(fd, word, length) != (ssize_t)length || write(fd, "\n", 1) != 1 || lseek(fd, 0, SEEK_SET) == -1) {
+        perror("smash error: write failed");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+bool Redirections::apply(bool builtin) {
+    int last_stdout = -1;
+    for (int i = 0; i < count; i++) {
+        if (items[i].kind == REDIRECT_STDOUT || items[i].kind == REDIRECT_STDOUT_APPEND || items[i].kind == REDIRECT_ALL)
+            last_stdout = i;
+    }
+    int curr_stdout = -1; // the stdout redirection in effect so far
+    for (int i = 0; i < count; i++) {
+        RedirectKind kind = items[i].kind;
+        int fd = -1;
+        int dest;
+        switch (kind) {
+            case REDIRECT_STDIN:
+                fd = _openTarget(kind, items[i].target, false);
+                dest = STDIN_FILENO;
+                break;
+            case REDIRECT_HERE_STRING:
+                fd = _openHereString(items[i].target);
+                dest = STDIN_FILENO;
+                break;
+            case REDIRECT_STDERR:
+            case REDIRECT_STDERR_APPEND:
+                fd = _openTarget(kind, items[i].target, false);
+                dest = STDERR_FILENO;
+                break;
+            case REDIRECT_STDERR_TO_STDOUT:
+                if (builtin && curr_stdout != -1) {
+                    // the builtin's stdout file is opened by ChangeIO on every write, share it in append
+                    // mode; the last target was not opened yet, it is truncated here rather than by ChangeIO
+                    fd = (curr_stdout == last_stdout) ? _openShared(items[curr_stdout].kind, items[curr_stdout].target) :
+                         _openTarget(items[curr_stdout].kind, items[curr_stdout].target, true);
+                }
+                else {
+                    fd = (builtin ? fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, SAVED_FD_MIN) : dup(STDOUT_FILENO));
+                    if (fd == -1)
+                        perror("smash error: dup failed");
+                }
+                dest = STDERR_FILENO;
+                break;
+            default: // stdout and &>
+                curr_stdout = i;
+                if (builtin) {
+                    if (i == last_stdout && kind != REDIRECT_ALL)
+                        continue; // written through ChangeIO
+                    // earlier targets are still created / truncated, like bash does
+                    fd = (i == last_stdout) ? _openShared(kind, items[i].target) : _openTarget(kind, items[i].target, false);
+                    if (fd == -1)
+                        return false;
+                    if (kind != REDIRECT_ALL) {
+                        close(fd);
+                        continue;
+                    }
+                    dest = STDERR_FILENO;
+                    break;
+                }
+                fd = _openTarget(kind, items[i].target, false);
+                if (fd == -1)
+                    return false;
+                if (kind == REDIRECT_ALL && dup2(fd, STDERR_FILENO) == -1) {
+                    perror("smash error: dup2 failed");
+                    close(fd);
+                    return false;
+                }
+                dest = STDOUT_FILENO;
+                break;
+        }
+        if (fd == -1)
+            return false;
+        if (builtin && !saveFd(dest)) {
+            close(fd);
+            return false;
+        }
+        if (dup2(fd, dest) == -1) {
+            perror("smash error: dup2 failed");
+            close(fd);
+            return false;
+        }
+        if (close(fd) == -1)
+            perror("smash error: close failed");
+    }
+    return true;
+}
+
+void Redirections::restore() {
+    std::cout.flush();
+    for (int fd = 0; fd < 3; fd++) {
+        if (saved_fds[fd] == -1)
+            continue;
+        if (dup2(saved_fds[fd], fd) == -1)
+            perror("smash error: dup2 failed");
+        if (close(saved_fds[fd]) == -1)
+            perror("smash error: close failed");
+        saved_fds[fd] = -1;
+    }
+}
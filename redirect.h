@@ -0,0 +1,57 @@
+#ifndef SMASH_REDIRECT_H_
+#define SMASH_REDIRECT_H_
+
+#include "arena.h"
+
+#define REDIRECTS_MAX (8)
+
+enum RedirectKind {
+    REDIRECT_STDIN = 0,        // < file
+    REDIRECT_STDOUT,           // > file
+    REDIRECT_STDOUT_APPEND,    // >> file
+    REDIRECT_STDERR,           // 2> file
+    REDIRECT_STDERR_APPEND,    // 2>> file
+    REDIRECT_STDERR_TO_STDOUT, // 2>&1
+    REDIRECT_ALL,              // &> file
+    REDIRECT_HERE_STRING       // <<< word
+};
+
+struct Redirect {
+    RedirectKind kind;
+    char* target; // file name or here-string word, quotes removed ("" for 2>&1)
+};
+
+// The redirections of one command, in the order they were written. parse() strips them from
+// the line in a single pass; apply() performs them with dup2, either completely (in the forked
+// child, right before exec) or around a builtin, where the last stdout target is left to
+// Command::ChangeIO and the original descriptors are kept for restore().
+class Redirections {
+    Redirect items[REDIRECTS_MAX];
+    int count;
+    int saved_fds[3]; // dup of fds 0-2 taken by apply(), -1 when untouched
+    bool saveFd(int fd);
+public:
+    Redirections();
+    // Returns the command line without its redirections, copied into the arena.
+    char* parse(const char* cmd_line, Arena* arena);
+    int size();
+    // 0 = last stdout redirection truncates, 1 = appends, 2 = stdout is not redirected
+    int stdoutStatus(char** file_name);
+    bool apply(bool builtin);
+    void restore();
+};
+
+// Reads one shell word starting at *p into out (at least strlen(*p) + 1 bytes), dropping its
+// quotes, and advances *p past it. Stops at an unquoted blank or redirection character.
+size_t readShellWord(const char** p, char* out);
+
+// The first token in s that is outside quotes and not escaped, NULL when there is none.
+const char* findUnquoted(const char* s, const char* token);
+
+// Writes text to out (when not NULL) so that parsing the line again takes it literally: the
+// characters that would act as syntax there (redirections, pipes, chains, quotes, further
+// expansions) get a backslash, and outside double quotes a newline or tab becomes a blank that
+// only splits words. For what $VAR and $(..) paste into a line. Returns the length written.
+size_t escapeShellText(const char* text, size_t length, bool in_double, char* out);
+
+#endif //SMASH_REDIRECT_H_
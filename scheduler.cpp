@@ -0,0 +1,124 @@
+#include <algorithm>
+#include <errno.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+#include "scheduler.h"
+
+// std::*_heap keep the largest element first; the earliest firing must be first
+static bool _later(const Schedule& a, const Schedule& b) {
+    return a.next_ms > b.next_ms || (a.next_ms == b.next_ms && a.id > b.id);
+}
+
+static bool _byId(const Schedule& a, const Schedule& b) {
+    return a.id < b.id;
+}
+
+CommandScheduler::CommandScheduler() : timer_fd(-1), next_id(1) {}
+
+CommandScheduler::~CommandScheduler() {
+    if (timer_fd != -1)
+        close(timer_fd);
+}
+
+int64_t CommandScheduler::nowMs() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+void CommandScheduler::arm() {
+    struct itimerspec spec = {{0, 0}, {0, 0}}; // all zero disarms
+    if (!heap.empty()) {
+        int64_t at = heap.front().next_ms;
+        spec.it_value.tv_sec = at / 1000;
+        spec.it_value.tv_nsec = (at % 1000) * 1000000 + 1; // never the all-zero value, even at time 0
+    }
+    if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &spec, NULL) == -1)
+        perror("smash error: timerfd_settime failed");
+}
+
+int CommandScheduler::add(long delay_ms, long interval_ms, const std::string& cmd_line) {
+    if (timer_fd == -1 && (timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC)) == -1) {
+        perror("smash error: timerfd_create failed");
+        return -1;
+    }
+    Schedule schedule;
+    schedule.id = next_id++;
+    schedule.next_ms = nowMs() + delay_ms;
+    schedule.interval_ms = interval_ms;
+    schedule.cmd_line = cmd_line;
+    schedule.last_pid = 0;
+    schedule.runs = 0;
+    schedule.skipped = 0;
+    heap.push_back(schedule);
+    std::push_heap(heap.begin(), heap.end(), _later);
+    if (heap.front().id == schedule.id)
+        arm();
+    return schedule.id;
+}
+
+bool CommandScheduler::cancel(int id) {
+    for (size_t i = 0; i < heap.size(); i++) {
+        if (heap[i].id == id) {
+            heap.erase(heap.begin() + i);
+            std::make_heap(heap.begin(), heap.end(), _later);
+            arm();
+            return true;
+        }
+    }
+    return false;
+}
+
+int CommandScheduler::getEventFd() {
+    return heap.empty() ? -1 : timer_fd;
+}
+
+void CommandScheduler::takeDue(std::vector<Schedule>* due) {
+    if (timer_fd == -1)
+        return;
+    uint64_t expirations;
+    if (read(timer_fd, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN)
+        perror("smash error: read failed");
+    int64_t now = nowMs();
+    std::vector<Schedule> again;
+    while (!heap.empty() && heap.front().next_ms <= now) {
+        std::pop_heap(heap.begin(), heap.end(), _later);
+        Schedule schedule = heap.back();
+        heap.pop_back();
+        due->push_back(schedule);
+        if (schedule.interval_ms > 0) {
+            int64_t missed = (now - schedule.next_ms) / schedule.interval_ms;
+            schedule.skipped += (unsigned)missed;
+            schedule.next_ms += (missed + 1) * schedule.interval_ms; // stays on its grid
+            again.push_back(schedule);
+        }
+    }
+    for (size_t i = 0; i < again.size(); i++) {
+        heap.push_back(again[i]);
+        std::push_heap(heap.begin(), heap.end(), _later);
+    }
+    arm();
+}
+
+void CommandScheduler::recordRun(int id, pid_t pid, bool skipped) {
+    for (size_t i = 0; i < heap.size(); i++) {
+        if (heap[i].id == id) {
+            if (skipped) {
+                heap[i].skipped++;
+            }
+            else {
+                heap[i].runs++;
+                heap[i].last_pid = pid;
+            }
+            return;
+        }
+    }
+}
+
+std::vector<Schedule> CommandScheduler::list() {
+    std::vector<Schedule> schedules(heap);
+    std::sort(schedules.begin(), schedules.end(), _byId);
+    return schedules;
+}
@@ -0,0 +1,45 @@
+#ifndef SMASH_SCHEDULER_H_
+#define SMASH_SCHEDULER_H_
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <sys/types.h>
+
+// A command run by `every` (interval_ms > 0) or `after` (interval_ms == 0).
+struct Schedule {
+    int id;
+    int64_t next_ms;   // CLOCK_MONOTONIC
+    long interval_ms;
+    std::string cmd_line;
+    pid_t last_pid;    // job started by the last firing, 0 if none
+    unsigned runs;
+    unsigned skipped;  // firings dropped because the previous run was still going, or coalesced
+};
+
+// Every pending firing in one min-heap on next_ms, behind a single timerfd armed for the
+// earliest of them; the main loop waits on the timerfd together with stdin.
+class CommandScheduler {
+    int timer_fd;
+    int next_id;
+    std::vector<Schedule> heap;
+    void arm();
+public:
+    CommandScheduler();
+    ~CommandScheduler();
+    CommandScheduler(CommandScheduler const&) = delete;
+    void operator=(CommandScheduler const&)   = delete;
+    static int64_t nowMs();
+    int add(long delay_ms, long interval_ms, const std::string& cmd_line);
+    bool cancel(int id);
+    // Readable when a schedule is due; -1 when nothing is scheduled.
+    int getEventFd();
+    // Takes out the schedules that are due. A recurring one goes back for its next period; the
+    // periods it missed meanwhile (smash was busy in the foreground) are counted as skipped.
+    void takeDue(std::vector<Schedule>* due);
+    void recordRun(int id, pid_t pid, bool skipped);
+    // Sorted by id.
+    std::vector<Schedule> list();
+};
+
+#endif //SMASH_SCHEDULER_H_
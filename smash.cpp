@@ -2,10 +2,34 @@
 #include <unistd.h>
 #include <sys/wait.h>
 #include <signal.h>
+#include <string.h>
 #include "Commands.h"
+#include "ioengine.h"
 #include "signals.h"
+#include "trace.h"
 
 int main(int argc, char* argv[]) {
+    const char* state_path = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--trace") == 0) {
+            Tracer::getInstance().setEnabled(true);
+        }
+        else if (strcmp(argv[i], "--state") == 0 && i + 1 < argc) {
+            state_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--cgroup") == 0 && i + 1 < argc) {
+            SmallShell::getInstance().getCgroups()->enable(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--control") == 0 && i + 1 < argc) {
+            SmallShell::getInstance().getControl()->listen(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--subreaper") == 0) {
+            SmallShell::getInstance().setSubreaper(true);
+        }
+        else {
+            std::cerr << "smash error: unknown option " << argv[i] << std::endl;
+        }
+    }
     if(signal(SIGTSTP , ctrlZHandler)==SIG_ERR) {
         perror("smash error: failed to set ctrl-Z handler");
     }
@@ -21,11 +45,19 @@ int main(int argc, char* argv[]) {
     }
 
     SmallShell& smash = SmallShell::getInstance();
+    smash.raiseFdLimit();
+    IoEngine::getInstance().usesUring(); // the ring counts among smash's own fds from the start
+    if (state_path != NULL)
+        smash.getJobsList()->attachStateFile(state_path); // without it smash still runs, it only forgets its jobs
     pid_t smash_pid = getpid();
+    std::string cmd_line; // reused across lines, getline keeps its capacity
     while(smash_pid == getpid()) {
         smash.getJobsList()->removeFinishedJobs();
+        if (smash.isSubreaper()) // nothing runs in the foreground here, every other child is an orphan
+            smash.getJobsList()->reapOrphans();
         std::cout << smash.getPrompt() << "> ";
-        std::string cmd_line;
+        std::cout.flush();
+        smash.waitForInput(STDIN_FILENO);
         std::getline(std::cin, cmd_line);
         if (cmd_line == "") {
             continue;
@@ -0,0 +1,274 @@
+#include <iostream>
+#include <new>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "trace.h"
+#include "arena.h"
+
+using namespace std;
+
+static const char* const TRACE_POINT_NAMES[TRACE_POINTS_NUM] = {
+    "parse", "factory", "fork", "exec", "first_byte", "wait"
+};
+
+// Forwards to the original cout buffer and stamps TRACE_FIRST_BYTE on the first write,
+// so builtins printing through std::cout are covered without touching each of them.
+class TraceStreamBuf : public std::streambuf {
+    std::streambuf* dest;
+protected:
+    int overflow(int c) override {
+        Tracer::getInstance().stamp(TRACE_FIRST_BYTE);
+        return dest->sputc(c);
+    }
+    std::streamsize xsputn(const char* s, std::streamsize n) override {
+        Tracer::getInstance().stamp(TRACE_FIRST_BYTE);
+        return dest->sputn(s, n);
+    }
+    int sync() override {
+        return dest->pubsync();
+    }
+public:
+    explicit TraceStreamBuf(std::streambuf* dest) : dest(dest) {}
+};
+
+// Small fixed buffer in front of write(2), so a dump of the whole ring costs a handful of syscalls.
+class TraceWriter {
+    int fd;
+    char buff[8192];
+    size_t used;
+public:
+    explicit TraceWriter(int fd) : fd(fd), used(0) {}
+    ~TraceWriter() { flush(); }
+    void flush() {
+        size_t done = 0;
+        while (done < used) {
+            ssize_t n = write(fd, buff + done, used - done);
+            if (n == -1) {
+                perror("smash error: write failed");
+                break;
+            }
+            done += n;
+        }
+        used = 0;
+    }
+    void append(const char* s, size_t length) {
+        if (used + length > sizeof(buff))
+            flush();
+        if (length > sizeof(buff)) {
+            if (write(fd, s, length) == -1)
+                perror("smash error: write failed");
+            return;
+        }
+        memcpy(buff + used, s, length);
+        used += length;
+    }
+    void append(const char* s) { append(s, strlen(s)); }
+    void appendJsonString(const char* s) {
+        append("\"");
+        for (; *s; s++) {
+            char esc[8];
+            if (*s == '"' || *s == '\\') {
+                esc[0] = '\\';
+                esc[1] = *s;
+                append(esc, 2);
+            }
+            else if ((unsigned char)*s < 0x20) {
+                snprintf(esc, sizeof(esc), "\\u%04x", *s);
+                append(esc);
+            }
+            else {
+                append(s, 1);
+            }
+        }
+        append("\"");
+    }
+    void appendCsvString(const char* s) {
+        append("\"");
+        for (; *s; s++) {
+            if (*s == '"')
+                append("\"\"", 2);
+            else
+                append(s, 1);
+        }
+        append("\"");
+    }
+};
+
+Tracer::Tracer() : ring(NULL), enabled(false), curr_slot(-1), depth(0) {}
+Tracer::~Tracer() {
+    if (ring != NULL)
+        munmap(ring, sizeof(Ring));
+}
+uint64_t Tracer::now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+bool Tracer::isEnabled() {
+    return this->enabled;
+}
+void Tracer::setEnabled(bool enable) {
+    if (enable && ring == NULL) {
+        void* mem = mmap(NULL, sizeof(Ring), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) {
+            perror("smash error: mmap failed");
+            return;
+        }
+        ring = new (mem) Ring(); // zeroed by mmap, the placement new only makes the atomics well-formed
+        static TraceStreamBuf cout_buf(std::cout.rdbuf());
+        std::cout.rdbuf(&cout_buf);
+    }
+    this->enabled = enable;
+}
+void Tracer::begin(const char* cmd_line) {
+    if (!enabled)
+        return;
+    if (depth++ > 0) // nested executeCommand (timeout) keeps stamping the outer record
+        return;
+    uint64_t idx = ring->head.fetch_add(1, std::memory_order_relaxed);
+    TraceRecord* rec = &ring->records[idx % TRACE_RING_SIZE];
+    rec->seq.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    rec->pid = getpid();
+    strncpy(rec->cmd_line, cmd_line, TRACE_CMD_LENGTH - 1);
+    rec->cmd_line[TRACE_CMD_LENGTH - 1] = 0;
+    for (int i = 0; i < TRACE_POINTS_NUM; i++)
+        rec->ts[i].store(0, std::memory_order_relaxed);
+    rec->mallocs = Arena::mallocCount();
+    rec->pipe_size = 0;
+    rec->pipe_waits = 0;
+    rec->pipe_preempts = 0;
+    rec->ts[TRACE_PARSE].store(now(), std::memory_order_relaxed);
+    rec->seq.store(idx + 1, std::memory_order_release);
+    curr_slot = (int64_t)idx;
+}
+void Tracer::end() {
+    if (depth == 0)
+        return;
+    if (--depth > 0)
+        return;
+    stamp(TRACE_WAIT);
+    if (curr_slot >= 0) {
+        TraceRecord* rec = &ring->records[curr_slot % TRACE_RING_SIZE];
+        if (rec->seq.load(std::memory_order_acquire) == (uint64_t)curr_slot + 1)
+            rec->mallocs = Arena::mallocCount() - rec->mallocs;
+    }
+    curr_slot = -1;
+}
+void Tracer::stamp(TracePoint point) {
+    if (!enabled || curr_slot < 0)
+        return;
+    TraceRecord* rec = &ring->records[curr_slot % TRACE_RING_SIZE];
+    if (rec->seq.load(std::memory_order_acquire) != (uint64_t)curr_slot + 1)
+        return; // the ring wrapped over this record
+    uint64_t expected = 0;
+    rec->ts[point].compare_exchange_strong(expected, now(), std::memory_order_relaxed);
+}
+void Tracer::recordPipe(int capacity, long waits, long preempts) {
+    if (!enabled || curr_slot < 0)
+        return;
+    TraceRecord* rec = &ring->records[curr_slot % TRACE_RING_SIZE];
+    if (rec->seq.load(std::memory_order_acquire) != (uint64_t)curr_slot + 1)
+        return;
+    rec->pipe_size = (uint32_t)capacity;
+    rec->pipe_waits = (uint64_t)waits;
+    rec->pipe_preempts = (uint64_t)preempts;
+}
+void Tracer::detach() {
+    curr_slot = -1;
+    depth = 0;
+}
+void Tracer::clear() {
+    if (ring == NULL)
+        return;
+    for (int i = 0; i < TRACE_RING_SIZE; i++)
+        ring->records[i].seq.store(0, std::memory_order_relaxed);
+}
+void Tracer::dump(int fd, bool csv) {
+    TraceWriter out(fd);
+    if (csv) {
+        out.append("seq,pid,cmd_line");
+        for (int i = 0; i < TRACE_POINTS_NUM; i++) {
+            out.append(",");
+            out.append(TRACE_POINT_NAMES[i]);
+            out.append("_ns");
+        }
+        out.append(",mallocs,pipe_size,pipe_waits,pipe_preempts\n");
+    }
+    else {
+        out.append("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    }
+    if (ring == NULL) {
+        out.append(csv ? "" : "]}\n");
+        return;
+    }
+    uint64_t head = ring->head.load(std::memory_order_acquire);
+    uint64_t first = (head > TRACE_RING_SIZE) ? head - TRACE_RING_SIZE : 0;
+    bool first_event = true;
+    char line[256];
+    for (uint64_t idx = first; idx < head; idx++) {
+        TraceRecord* rec = &ring->records[idx % TRACE_RING_SIZE];
+        if (rec->seq.load(std::memory_order_acquire) != idx + 1)
+            continue;
+        uint64_t ts[TRACE_POINTS_NUM];
+        for (int i = 0; i < TRACE_POINTS_NUM; i++)
+            ts[i] = rec->ts[i].load(std::memory_order_relaxed);
+        if (csv) {
+            snprintf(line, sizeof(line), "%llu,%ld,", (unsigned long long)idx + 1, (long)rec->pid);
+            out.append(line);
+            out.appendCsvString(rec->cmd_line);
+            for (int i = 0; i < TRACE_POINTS_NUM; i++) {
+                snprintf(line, sizeof(line), ",%llu", (unsigned long long)ts[i]);
+                out.append(line);
+            }
+            snprintf(line, sizeof(line), ",%llu,%lu,%llu,%llu\n", (unsigned long long)(ts[TRACE_WAIT] != 0 ? rec->mallocs : 0),
+                     (unsigned long)rec->pipe_size, (unsigned long long)rec->pipe_waits, (unsigned long long)rec->pipe_preempts);
+            out.append(line);
+            continue;
+        }
+        // one complete event for the whole command, nested ones for every reached stage in the
+        // order they happened (a forked child may reach exec before the parent sees fork return)
+        int order[TRACE_POINTS_NUM];
+        int reached = 0;
+        for (int i = TRACE_PARSE + 1; i < TRACE_POINTS_NUM; i++) {
+            if (ts[i] == 0)
+                continue;
+            int j = reached++;
+            while (j > 0 && ts[order[j - 1]] > ts[i]) {
+                order[j] = order[j - 1];
+                j--;
+            }
+            order[j] = i;
+        }
+        uint64_t last = (reached > 0) ? ts[order[reached - 1]] : ts[TRACE_PARSE];
+        snprintf(line, sizeof(line), "%s{\"name\":", first_event ? "\n" : ",\n");
+        out.append(line);
+        out.appendJsonString(rec->cmd_line);
+        snprintf(line, sizeof(line), ",\"cat\":\"command\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%ld,\"tid\":%ld,"
+                 "\"args\":{\"seq\":%llu,\"mallocs\":%llu", ts[TRACE_PARSE] / 1000.0, (last - ts[TRACE_PARSE]) / 1000.0,
+                 (long)rec->pid, (long)rec->pid, (unsigned long long)idx + 1,
+                 (unsigned long long)(ts[TRACE_WAIT] != 0 ? rec->mallocs : 0));
+        out.append(line);
+        if (rec->pipe_size != 0) {
+            snprintf(line, sizeof(line), ",\"pipe_size\":%lu,\"pipe_waits\":%llu,\"pipe_preempts\":%llu",
+                     (unsigned long)rec->pipe_size, (unsigned long long)rec->pipe_waits, (unsigned long long)rec->pipe_preempts);
+            out.append(line);
+        }
+        out.append("}}");
+        first_event = false;
+        uint64_t prev = ts[TRACE_PARSE];
+        for (int k = 0; k < reached; k++) {
+            int i = order[k];
+            snprintf(line, sizeof(line), ",\n{\"name\":\"%s\",\"cat\":\"stage\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                     "\"pid\":%ld,\"tid\":%ld}", TRACE_POINT_NAMES[i], prev / 1000.0,
+                     (ts[i] > prev ? ts[i] - prev : 0) / 1000.0, (long)rec->pid, (long)rec->pid);
+            out.append(line);
+            prev = ts[i];
+        }
+    }
+    if (!csv)
+        out.append("\n]}\n");
+}
@@ -0,0 +1,65 @@
+#ifndef SMASH_TRACE_H_
+#define SMASH_TRACE_H_
+
+#include <atomic>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define TRACE_RING_SIZE (4096)
+#define TRACE_CMD_LENGTH (64)
+
+// Points in the life of a command line, in the order they are reached.
+enum TracePoint {
+    TRACE_PARSE = 0,  // line handed to executeCommand
+    TRACE_FACTORY,    // CreateCommand resolved the command (builtin object built / external path chosen)
+    TRACE_FORK,       // fork returned in the parent
+    TRACE_EXEC,       // child is about to exec
+    TRACE_FIRST_BYTE, // first output byte written by smash on behalf of the command
+    TRACE_WAIT,       // foreground wait returned / builtin returned / background job launched
+    TRACE_POINTS_NUM
+};
+
+struct TraceRecord {
+    std::atomic<uint64_t> seq; // 0 while the slot is being (re)initialized, index+1 once published
+    pid_t pid;
+    char cmd_line[TRACE_CMD_LENGTH];
+    std::atomic<uint64_t> ts[TRACE_POINTS_NUM]; // CLOCK_MONOTONIC ns, 0 = point not reached
+    uint64_t mallocs; // malloc calls made by the recording process between parse and wait (0 unless built with ALLOC_STATS=1)
+    // pipelines only: pipe capacity and the stages' context switches. A voluntary switch is a
+    // stage blocking, mostly on a full or empty pipe; involuntary ones are preemptions.
+    uint32_t pipe_size;
+    uint64_t pipe_waits;
+    uint64_t pipe_preempts;
+};
+
+class Tracer {
+    struct Ring {
+        std::atomic<uint64_t> head;
+        TraceRecord records[TRACE_RING_SIZE];
+    };
+    Ring* ring; // MAP_SHARED, so forked children stamp the same records as the shell
+    bool enabled;
+    int64_t curr_slot;
+    int depth;
+    Tracer();
+public:
+    Tracer(Tracer const&)         = delete;
+    void operator=(Tracer const&) = delete;
+    static Tracer& getInstance() {
+        static Tracer instance;
+        return instance;
+    }
+    ~Tracer();
+    static uint64_t now();
+    bool isEnabled();
+    void setEnabled(bool enable);
+    void begin(const char* cmd_line);
+    void end();
+    void stamp(TracePoint point);
+    void recordPipe(int capacity, long waits, long preempts);
+    void detach();
+    void clear();
+    void dump(int fd, bool csv);
+};
+
+#endif //SMASH_TRACE_H_
@@ -0,0 +1,189 @@
+#include <algorithm>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "wildcard.h"
+
+static const char* const BLANKS = " \n\r\t\f\v";
+// characters smash or bash would read as syntax if a matched file name was pasted back as-is
+static const char* const NEEDS_ESCAPE = " \n\r\t\f\v*?[]$`'\"\\;&|(){}<>~!#";
+
+static uint64_t _nowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static bool _hasMagic(const char* s, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        if (s[i] == '*' || s[i] == '?' || s[i] == '[')
+            return true;
+    }
+    return false;
+}
+
+static std::string _join(const std::string& base, const std::string& name) {
+    if (base.empty())
+        return name;
+    if (base[base.size() - 1] == '/')
+        return base + name;
+    return base + "/" + name;
+}
+
+WildcardExpander::WildcardExpander() : cache_enabled(true) {}
+
+bool WildcardExpander::isCacheEnabled() {
+    return this->cache_enabled;
+}
+
+void WildcardExpander::setCacheEnabled(bool enable) {
+    this->cache_enabled = enable;
+    if (!enable)
+        cache.clear();
+}
+
+const std::vector<std::string>* WildcardExpander::list(const std::string& dir, Listing* scratch) {
+    struct stat st;
+    if (stat(dir.c_str(), &st) == -1 || !S_ISDIR(st.st_mode))
+        return NULL;
+    uint64_t now = _nowNs();
+    Listing* listing = scratch;
+    if (cache_enabled) {
+        listing = &cache[dir];
+        if (listing->dev == st.st_dev && listing->ino == st.st_ino && listing->fetched_ns + WILDCARD_CACHE_TTL_NS > now &&
+            listing->mtime.tv_sec == st.st_mtim.tv_sec && listing->mtime.tv_nsec == st.st_mtim.tv_nsec)
+            return &listing->names;
+    }
+    DIR* d = opendir(dir.c_str());
+    if (d == NULL) {
+        if (cache_enabled)
+            cache.erase(dir);
+        return NULL;
+    }
+    listing->names.clear();
+    struct dirent* entry;
+    while ((entry = readdir(d)) != NULL) {
+        if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0)
+            listing->names.push_back(entry->d_name);
+    }
+    closedir(d);
+    listing->dev = st.st_dev;
+    listing->ino = st.st_ino;
+    listing->mtime = st.st_mtim;
+    listing->fetched_ns = now;
+    return &listing->names;
+}
+
+void WildcardExpander::match(const std::string& base, const std::vector<std::string>& components, size_t idx,
+                             std::vector<std::string>* matches) {
+    struct stat st;
+    if (idx == components.size()) {
+        matches->push_back(base);
+        return;
+    }
+    const std::string& component = components[idx];
+    if (component.empty()) { // trailing slash: directories only
+        if (stat(base.c_str(), &st) == 0 && S_ISDIR(st.st_mode))
+            matches->push_back(base + "/");
+        return;
+    }
+    if (!_hasMagic(component.c_str(), component.size())) {
+        std::string path = _join(base, component);
+        if (idx + 1 < components.size() || lstat(path.c_str(), &st) == 0)
+            match(path, components, idx + 1, matches);
+        return;
+    }
+    Listing scratch;
+    const std::vector<std::string>* names = list(base.empty() ? "." : base, &scratch);
+    if (names == NULL)
+        return;
+    // a deeper level may refresh the cache entry this vector lives in, only the last one can use it in place
+    std::vector<std::string> copy;
+    if (idx + 1 < components.size()) {
+        copy = *names;
+        names = &copy;
+    }
+    for (const std::string& name : *names) {
+        if (fnmatch(component.c_str(), name.c_str(), FNM_PERIOD) == 0)
+            match(_join(base, name), components, idx + 1, matches);
+    }
+}
+
+std::vector<std::string> WildcardExpander::glob(const char* pattern) {
+    std::vector<std::string> components;
+    std::string base;
+    const char* p = pattern;
+    if (*p == '/') {
+        base = "/";
+        while (*p == '/')
+            p++;
+    }
+    while (true) {
+        const char* slash = strchr(p, '/');
+        if (slash == NULL) {
+            components.push_back(p);
+            break;
+        }
+        components.push_back(std::string(p, slash - p));
+        p = slash;
+        while (*p == '/')
+            p++;
+    }
+    std::vector<std::string> matches;
+    match(base, components, 0, &matches);
+    std::sort(matches.begin(), matches.end());
+    return matches;
+}
+
+const char* WildcardExpander::expand(const char* cmd_line, Arena* arena) {
+    if (strpbrk(cmd_line, "*?[") == NULL)
+        return cmd_line;
+    std::string out;
+    bool expanded = false;
+    const char* p = cmd_line;
+    const char* copied = cmd_line; // everything before this is already in out
+    while (*p != 0) {
+        p += strspn(p, BLANKS);
+        const char* word = p;
+        char quote = 0;
+        bool plain = true; // no quotes, escapes or operators: the word is exactly its characters
+        for (; *p != 0 && (quote != 0 || strchr(BLANKS, *p) == NULL); p++) {
+            if (quote != 0) {
+                if (*p == quote)
+                    quote = 0;
+            }
+            else if (*p == '\'' || *p == '"') {
+                quote = *p;
+                plain = false;
+            }
+            else if (strchr("\\$`<>|()", *p) != NULL) {
+                plain = false;
+            }
+        }
+        size_t length = p - word;
+        if (length > 0 && word[length - 1] == '&' && *(p + strspn(p, BLANKS)) == 0)
+            length--; // the background sign is not part of the pattern
+        if (!plain || length == 0 || !_hasMagic(word, length) || memchr(word, '&', length) != NULL)
+            continue;
+        std::vector<std::string> matches = glob(std::string(word, length).c_str());
+        if (matches.empty())
+            continue;
+        out.append(copied, word - copied);
+        for (size_t i = 0; i < matches.size(); i++) {
+            if (i > 0)
+                out += ' ';
+            for (char c : matches[i]) {
+                if (strchr(NEEDS_ESCAPE, c) != NULL)
+                    out += '\\';
+                out += c;
+            }
+        }
+        copied = word + length;
+        expanded = true;
+    }
+    if (!expanded)
+        return cmd_line;
+    out.append(copied);
+    return arena->copy(out.c_str(), out.size());
+}
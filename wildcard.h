@@ -0,0 +1,43 @@
+#ifndef SMASH_WILDCARD_H_
+#define SMASH_WILDCARD_H_
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+#include "arena.h"
+
+#define WILDCARD_CACHE_TTL_NS (2000000000ULL) // listings older than this are re-read even if unchanged
+
+// Native pathname expansion (*, ? and [...]) with readdir + fnmatch. Directory listings can be
+// kept for a short while, keyed by path and validated against the directory's inode and mtime,
+// so repeating `ls *.log` in the same directory does not read it again.
+class WildcardExpander {
+    struct Listing {
+        dev_t dev;
+        ino_t ino;
+        struct timespec mtime;
+        uint64_t fetched_ns;
+        std::vector<std::string> names;
+    };
+    std::unordered_map<std::string, Listing> cache;
+    bool cache_enabled;
+    const std::vector<std::string>* list(const std::string& dir, Listing* scratch);
+    void match(const std::string& base, const std::vector<std::string>& components, size_t idx,
+               std::vector<std::string>* matches);
+public:
+    WildcardExpander();
+    WildcardExpander(WildcardExpander const&)  = delete;
+    void operator=(WildcardExpander const&)    = delete;
+    bool isCacheEnabled();
+    void setCacheEnabled(bool enable);
+    // Sorted matches of one pattern; empty when nothing matches.
+    std::vector<std::string> glob(const char* pattern);
+    // Replaces every unquoted word holding *, ? or [ by its matches (kept as-is when nothing
+    // matches, like bash). Returns cmd_line itself when there is nothing to expand.
+    const char* expand(const char* cmd_line, Arena* arena);
+};
+
+#endif //SMASH_WILDCARD_H_
@@ -0,0 +1,91 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "writer.h"
+
+StreamWriter::StreamWriter(int fd) : fd(fd), used(0), failed(false) {}
+
+StreamWriter::~StreamWriter() {
+    flush();
+}
+
+bool StreamWriter::flush() {
+    size_t written = 0;
+    while (written < used && !failed) {
+        ssize_t n = write(fd, buff + written, used - written);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("smash error: write failed");
+            failed = true; // the rest is dropped, one error is enough
+            break;
+        }
+        written += n;
+    }
+    used = 0;
+    return !failed;
+}
+
+void StreamWriter::put(const char* data, size_t length) {
+    while (length > 0) {
+        if (used == WRITER_BUFFER_SIZE)
+            flush();
+        size_t chunk = WRITER_BUFFER_SIZE - used;
+        if (chunk > length)
+            chunk = length;
+        memcpy(buff + used, data, chunk);
+        used += chunk;
+        data += chunk;
+        length -= chunk;
+    }
+}
+
+void StreamWriter::put(const char* str) {
+    put(str, strlen(str));
+}
+
+void StreamWriter::put(const std::string& str) {
+    put(str.data(), str.size());
+}
+
+void StreamWriter::put(char c) {
+    if (used == WRITER_BUFFER_SIZE)
+        flush();
+    buff[used++] = c;
+}
+
+void StreamWriter::putInt(int64_t value) {
+    char digits[24];
+    int length = snprintf(digits, sizeof(digits), "%lld", (long long)value);
+    put(digits, length);
+}
+
+void StreamWriter::putJsonString(const std::string& str) {
+    static const char hex[] = "0123456789abcdef";
+    put('"');
+    size_t start = 0; // runs of plain characters are copied in one go
+    for (size_t i = 0; i < str.size(); i++) {
+        unsigned char c = (unsigned char)str[i];
+        if (c >= 0x20 && c != '"' && c != '\\')
+            continue;
+        put(str.data() + start, i - start);
+        start = i + 1;
+        if (c == '"' || c == '\\') {
+            put('\\');
+            put((char)c);
+        }
+        else if (c == '\n') {
+            put("\\n", 2);
+        }
+        else if (c == '\t') {
+            put("\\t", 2);
+        }
+        else {
+            char escape[] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xf]};
+            put(escape, sizeof(escape));
+        }
+    }
+    put(str.data() + start, str.size() - start);
+    put('"');
+}
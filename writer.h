@@ -0,0 +1,32 @@
+#ifndef SMASH_WRITER_H_
+#define SMASH_WRITER_H_
+
+#include <string>
+#include <stdint.h>
+#include <stddef.h>
+
+#define WRITER_BUFFER_SIZE (64 * 1024)
+
+// Buffered writes straight to a descriptor: a long listing goes out in WRITER_BUFFER_SIZE
+// chunks as it is produced instead of being built into one string first.
+class StreamWriter {
+    int fd;
+    size_t used;
+    bool failed;
+    char buff[WRITER_BUFFER_SIZE];
+public:
+    explicit StreamWriter(int fd);
+    ~StreamWriter();
+    StreamWriter(StreamWriter const&)   = delete;
+    void operator=(StreamWriter const&) = delete;
+    void put(const char* data, size_t length);
+    void put(const char* str);
+    void put(const std::string& str);
+    void put(char c);
+    void putInt(int64_t value);
+    // str as a JSON string literal, quotes included
+    void putJsonString(const std::string& str);
+    bool flush();
+};
+
+#endif //SMASH_WRITER_H_
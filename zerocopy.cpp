@@ -0,0 +1,247 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include "zerocopy.h"
+
+enum CopyMethod {
+    COPY_FILE_RANGE = 0,
+    COPY_SENDFILE,
+    COPY_SPLICE,
+    COPY_READ_WRITE
+};
+
+static const char* const COPY_FAILED[] = {"smash error: copy_file_range failed", "smash error: sendfile failed",
+                                          "smash error: splice failed", "smash error: read failed"};
+
+static char buffer[ZEROCOPY_BUFFER_SIZE]; // the builtins copy one stream at a time
+
+// errno values that mean the method does not work for these two fds, rather than a failed copy
+static bool _unsupported(int error) {
+    return error == EINVAL || error == EXDEV || error == ENOSYS || error == EOPNOTSUPP || error == EBADF;
+}
+
+// A terminal read is restarted after ctrl-C (the handlers have SA_RESTART semantics), poll is
+// not: waiting in poll first lets the copy see the ctrl-C before the next line is typed.
+static ssize_t _read(int fd, bool tty) {
+    struct pollfd pfd = {fd, POLLIN, 0};
+    if (tty && poll(&pfd, 1, -1) == -1)
+        return -1; // EINTR, the caller asks interrupted() again
+    return read(fd, buffer, sizeof(buffer));
+}
+
+static bool _writeAll(int fd, const char* data, size_t length) {
+    while (length > 0) {
+        ssize_t n = write(fd, data, length);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1)
+            return false;
+        data += n;
+        length -= n;
+    }
+    return true;
+}
+
+ssize_t copyFd(int in, int out, CopyInterrupted interrupted) {
+    struct stat in_stat;
+    struct stat out_stat;
+    if (fstat(in, &in_stat) == -1 || fstat(out, &out_stat) == -1) {
+        perror("smash error: fstat failed");
+        return -1;
+    }
+    bool in_file = S_ISREG(in_stat.st_mode);
+    bool in_tty = S_ISCHR(in_stat.st_mode) && isatty(in);
+    CopyMethod method = COPY_READ_WRITE;
+    if (in_file && S_ISREG(out_stat.st_mode))
+        method = COPY_FILE_RANGE;
+    else if (!in_tty && (S_ISFIFO(in_stat.st_mode) || S_ISFIFO(out_stat.st_mode))) // newer kernels splice from a tty too
+        method = COPY_SPLICE;
+    else if (in_file)
+        method = COPY_SENDFILE;
+    ssize_t total = 0;
+    while (interrupted == NULL || !interrupted()) {
+        ssize_t n;
+        switch (method) {
+            case COPY_FILE_RANGE:
+                n = copy_file_range(in, NULL, out, NULL, ZEROCOPY_CHUNK, 0);
+                break;
+            case COPY_SENDFILE:
+                n = sendfile(out, in, NULL, ZEROCOPY_CHUNK);
+                break;
+            case COPY_SPLICE:
+                n = splice(in, NULL, out, NULL, ZEROCOPY_CHUNK, SPLICE_F_MOVE|SPLICE_F_MORE);
+                break;
+            default:
+                n = _read(in, in_tty);
+                if (n > 0 && !_writeAll(out, buffer, n)) {
+                    perror("smash error: write failed");
+                    return -1;
+                }
+        }
+        if (n > 0) {
+            total += n;
+            continue;
+        }
+        if (n == -1 && errno == EINTR)
+            continue;
+        // nothing copied yet: the method may not suit these fds, and a /proc file reports size 0
+        // and gives nothing to copy_file_range although read() returns its contents
+        bool fall_back = total == 0 && method != COPY_READ_WRITE &&
+                         ((n == -1) ? _unsupported(errno) : in_file && in_stat.st_size == 0);
+        if (fall_back) {
+            method = (method == COPY_FILE_RANGE) ? COPY_SENDFILE : COPY_READ_WRITE;
+            continue;
+        }
+        if (n == -1) {
+            perror(COPY_FAILED[method]);
+            return -1;
+        }
+        break;
+    }
+    return total;
+}
+
+// Throws away what is left of a round in one of the private pipes, so the next round starts empty.
+static void _discard(int pipe_fd, size_t length) {
+    while (length > 0) {
+        ssize_t n = read(pipe_fd, buffer, std::min(length, sizeof(buffer)));
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return;
+        length -= n;
+    }
+}
+
+// Moves length bytes from one of the private pipes to out. splice stays on until out turns out
+// not to take it (a terminal, an O_APPEND file).
+static bool _drain(int pipe_fd, int out, size_t length, bool* splices) {
+    while (length > 0) {
+        ssize_t n;
+        if (*splices) {
+            n = splice(pipe_fd, NULL, out, NULL, length, SPLICE_F_MOVE|SPLICE_F_MORE);
+            if (n == -1 && _unsupported(errno)) {
+                *splices = false;
+                continue;
+            }
+        }
+        else {
+            n = read(pipe_fd, buffer, std::min(length, sizeof(buffer)));
+            if (n > 0 && !_writeAll(out, buffer, n))
+                n = -1;
+        }
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            perror(*splices ? "smash error: splice failed" : "smash error: write failed");
+            _discard(pipe_fd, length);
+            return false;
+        }
+        length -= n;
+    }
+    return true;
+}
+
+struct TeeOutput {
+    int fd;
+    bool splices;
+    bool failed;
+};
+
+bool teeFds(int in, const std::vector<int>& outs, CopyInterrupted interrupted) {
+    std::vector<TeeOutput> sinks;
+    for (size_t i = 0; i < outs.size(); i++) {
+        TeeOutput sink = {outs[i], true, false};
+        sinks.push_back(sink);
+    }
+    // scratch takes each round from in, copy gets the tee(2) duplicate for all outputs but the last
+    int scratch[2] = {-1, -1};
+    int copy[2] = {-1, -1};
+    bool in_tty = isatty(in);
+    bool in_splices = !in_tty && pipe2(scratch, O_CLOEXEC) == 0 && pipe2(copy, O_CLOEXEC) == 0;
+    size_t round = sizeof(buffer);
+    if (in_splices) {
+        // above /proc/sys/fs/pipe-max-size the default stays; copy must hold whatever scratch holds
+        fcntl(scratch[1], F_SETPIPE_SZ, ZEROCOPY_PIPE_SIZE);
+        fcntl(copy[1], F_SETPIPE_SZ, ZEROCOPY_PIPE_SIZE);
+        round = (size_t)std::min(fcntl(scratch[1], F_GETPIPE_SZ), fcntl(copy[1], F_GETPIPE_SZ));
+    }
+    std::vector<char> spill; // a round that had to come out of the pipe after all
+    bool ok = true;
+    while (!sinks.empty() && (interrupted == NULL || !interrupted())) {
+        ssize_t n;
+        if (in_splices) {
+            n = splice(in, NULL, scratch[1], NULL, round, SPLICE_F_MOVE);
+            if (n == -1 && _unsupported(errno)) { // a terminal
+                in_splices = false;
+                continue;
+            }
+        }
+        else {
+            n = _read(in, in_tty);
+        }
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1) {
+            perror(in_splices ? "smash error: splice failed" : "smash error: read failed");
+            ok = false;
+            break;
+        }
+        if (n == 0)
+            break;
+        const char* data = in_splices ? NULL : buffer; // set once the round is in user space
+        for (size_t i = 0; i < sinks.size(); i++) {
+            TeeOutput& sink = sinks[i];
+            if (data != NULL) {
+                if (!_writeAll(sink.fd, data, n)) {
+                    perror("smash error: write failed");
+                    sink.failed = true;
+                }
+                continue;
+            }
+            if (i == sinks.size() - 1) {
+                sink.failed = !_drain(scratch[0], sink.fd, n, &sink.splices);
+                continue;
+            }
+            ssize_t duplicated = tee(scratch[0], copy[1], n, 0);
+            duplicated = std::max(duplicated, (ssize_t)0);
+            if (duplicated > 0 && !_drain(copy[0], sink.fd, duplicated, &sink.splices))
+                sink.failed = true;
+            if (duplicated < n) {
+                // copy is as large as scratch, so this only happens where tee(2) is refused
+                // (a packet-mode pipe): the rest of the round goes through user space
+                spill.resize(n);
+                size_t got = 0;
+                while (got < (size_t)n) {
+                    ssize_t r = read(scratch[0], spill.data() + got, n - got);
+                    if (r == -1 && errno == EINTR)
+                        continue;
+                    if (r <= 0)
+                        break;
+                    got += r;
+                }
+                data = spill.data();
+                if (!sink.failed && !_writeAll(sink.fd, data + duplicated, n - duplicated)) {
+                    perror("smash error: write failed");
+                    sink.failed = true;
+                }
+            }
+        }
+        for (size_t i = sinks.size(); i > 0; i--) {
+            if (sinks[i - 1].failed)
+                sinks.erase(sinks.begin() + (i - 1));
+        }
+    }
+    for (int i = 0; i < 2; i++) {
+        if (scratch[i] != -1)
+            close(scratch[i]);
+        if (copy[i] != -1)
+            close(copy[i]);
+    }
+    return ok;
+}
@@ -0,0 +1,29 @@
+#ifndef SMASH_ZEROCOPY_H_
+#define SMASH_ZEROCOPY_H_
+
+#include <sys/types.h>
+#include <vector>
+
+#define ZEROCOPY_CHUNK (64 << 20)       // per copy_file_range / sendfile call, between two ctrl-C checks
+#define ZEROCOPY_PIPE_SIZE (1 << 20)    // the private pipes of teeFds
+#define ZEROCOPY_BUFFER_SIZE (128 << 10) // the read/write fallback
+
+// Returns true once the copy should stop (ctrl-C or ctrl-Z in the shell's own process). A
+// terminal input is waited on with poll, which a signal always interrupts, so it is asked again
+// after each one.
+typedef bool (*CopyInterrupted)();
+
+// Copies in to out until the end of in, without passing the data through user space where the
+// kernel can: copy_file_range between regular files, splice when either end is a pipe, sendfile
+// from a regular file otherwise. A method the two fds do not support (a terminal, an O_APPEND
+// target, two file systems) gives way to the next one, a read/write loop last. Errors are
+// reported on stderr; returns the bytes copied or -1.
+ssize_t copyFd(int in, int out, CopyInterrupted interrupted);
+
+// Copies in to every fd of outs. The data is spliced into a private pipe once and duplicated
+// with tee(2) for all but the last output, so it is never copied into user space unless an
+// input or an output cannot splice. An output that fails is reported and dropped, the others
+// keep going. false when in could not be read.
+bool teeFds(int in, const std::vector<int>& outs, CopyInterrupted interrupted);
+
+#endif //SMASH_ZEROCOPY_H_